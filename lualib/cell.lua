@@ -140,6 +140,28 @@ function cell.time()
     return c.time()
 end
 
+-- drop the shared code cache and the pre-warmed states, cells launched
+-- afterwards load the new files. Returns files and states dropped.
+function cell.clearcache()
+    return c.clearcache()
+end
+
+-- immutable bytes shared by reference when sent to cells or sockets,
+-- #buf is the size and tostring(buf) makes the string on first use
+function cell.buffer(str)
+    return c.buffer(str)
+end
+
+-- bytes held by this cell's lua state and its limit, 0 : no limit
+function cell.memory()
+    return c.memory()
+end
+
+-- allocations past the limit fail with a "not enough memory" error
+function cell.memlimit(limit)
+    c.memlimit(limit)
+end
+
 function cell.event()
     session = session + 1
     return session
@@ -236,7 +258,7 @@ function cell.sleep(ti, event)
         session = session + 1
         event = session
     end
-    c.send(system, 2, self, event, "timeout", ti)
+    c.timeout(ti, event)
     coroutine.yield("WAIT", event)
 end
 
@@ -251,7 +273,7 @@ function cell.timeout(ti, func, ...)
         return "EXIT"
     end)
     session = session + 1
-    c.send(system, 2, self, session, "timeout", ti)
+    c.timeout(ti, session)
     new_task(nil, nil, co, session)
 end
 
@@ -362,8 +384,11 @@ function debug_command.info()
 end
 
 function debug_command.mem()
-    local kb = collectgarbage "count"
-    return string.format("%.2f Kb", kb)
+    local used, limit = c.memory()
+    if limit > 0 then
+        return string.format("%.2f Kb / %.2f Kb", used / 1024, limit / 1024)
+    end
+    return string.format("%.2f Kb", used / 1024)
 end
 
 function debug_command.task()
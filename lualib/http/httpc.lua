@@ -7,6 +7,30 @@ local table = table
 
 local httpc = {}
 
+-- idle keep-alive connections by protocol://host:port, see httpc.pool
+local pool_config = {
+    max_idle = 16,
+    max_per_host = 256,
+    idle_timeout = 60000
+}
+local pools = {}
+local stats = {
+    hits = 0,
+    misses = 0,
+    evictions = 0,
+    errors = 0
+}
+
+-- a reused connection the server closed meanwhile fails before any answer,
+-- these are sent again
+local idempotent = {
+    GET = true,
+    HEAD = true,
+    PUT = true,
+    DELETE = true,
+    OPTIONS = true
+}
+
 local function check_protocol(host)
     local protocol = host:match "^[Hh][Tt][Tt][Pp][Ss]?://"
     if protocol then
@@ -24,35 +48,18 @@ local function check_protocol(host)
     end
 end
 
-local SSLCTX_CLIENT = nil
-local function gen_interface(protocol, sock, hostname)
-    if protocol == "http" then
-        return {
-            init = nil,
-            close = nil,
-            read = socket.readfunc(sock),
-            write = socket.writefunc(sock),
-            readall = function()
-                return socket.readall(sock)
-            end
-        }
-    elseif protocol == "https" then
-        local tls = require "http.tlshelper"
-        SSLCTX_CLIENT = SSLCTX_CLIENT or tls.newctx()
-        local tls_ctx = tls.newtls("client", SSLCTX_CLIENT, hostname)
-        return {
-            init = tls.initrequestfunc(sock, tls_ctx),
-            close = tls.closefunc(tls_ctx),
-            read = tls.readfunc(sock, tls_ctx),
-            write = tls.writefunc(sock, tls_ctx),
-            readall = tls.readallfunc(sock, tls_ctx)
-        }
-    else
-        error(string.format("Invalid protocol: %s", protocol))
-    end
+-- https is plaintext by then, the socket terminates tls
+local function gen_interface(sock)
+    return {
+        read = socket.readfunc(sock),
+        write = socket.writefunc(sock),
+        readall = function()
+            return socket.readall(sock)
+        end
+    }
 end
 
-local function connect(host, timeout)
+local function target(host)
     local protocol
     protocol, host = check_protocol(host)
     local hostaddr, port = host:match "([^:]+):?(%d*)$"
@@ -65,14 +72,28 @@ local function connect(host, timeout)
     if not hostaddr:match(".*%d+$") then
         hostname = hostaddr
     end
-    local sock = socket.connect(hostaddr, port, timeout)
+    return protocol, host, hostaddr, port, hostname
+end
+
+local function close_interface(interface, sock)
+    interface.finish = true
+    socket.close(sock)
+end
+
+-- an https connection resumes the tls session of the last one to the host
+local function open(protocol, hostaddr, port, hostname, timeout)
+    local opts = protocol == "https" and {tls = {servername = hostname}} or nil
+    local sock = socket.connect(hostaddr, port, timeout, opts)
     if not sock then
         error(string.format("%s connect error host:%s, port:%s, timeout:%s", protocol, hostaddr, port, timeout))
     end
-    local interface = gen_interface(protocol, sock, hostname)
-    if interface.init then
-        interface.init()
-    end
+    return sock, gen_interface(sock)
+end
+
+local function connect(host, timeout)
+    local protocol, hostaddr, port, hostname
+    protocol, host, hostaddr, port, hostname = target(host)
+    local sock, interface = open(protocol, hostaddr, port, hostname, timeout)
     if timeout then
         cell.timeout(
             timeout,
@@ -86,39 +107,199 @@ local function connect(host, timeout)
     return sock, interface, host
 end
 
-local function close_interface(interface, sock)
-    interface.finish = true
-    socket.close(sock)
-    if interface.close then
-        interface.close()
-        interface.close = nil
+local function getpool(hostname)
+    local protocol, host, hostaddr, port, name = target(hostname)
+    local key = string.format("%s://%s:%d", protocol, hostaddr, port)
+    local pool = pools[key]
+    if not pool then
+        pool = {
+            protocol = protocol,
+            host = host,
+            hostaddr = hostaddr,
+            port = port,
+            hostname = name,
+            idle = {},
+            waiting = {},
+            count = 0
+        }
+        pools[key] = pool
     end
+    return pool
 end
 
-function httpc.request(method, hostname, url, recvheader, header, content, timeout)
-    local sock, interface, host = connect(hostname, timeout)
-    local ok, statuscode, body, header =
-        pcall(internal.request, interface, method, host, url, recvheader, header, content)
-    if ok then
-        ok, body = pcall(internal.response, interface, statuscode, body, header)
+local function shut(pool, c)
+    pool.count = pool.count - 1
+    close_interface(c.interface, c.sock)
+end
+
+local function wake(pool)
+    local ev = table.remove(pool.waiting, 1)
+    if ev then
+        cell.wakeup(ev)
+    end
+end
+
+-- the server closed it, or it idled longer than the server may keep it
+local function expired(c, now)
+    return not c.sock:isconnect() or (now - c.last) * 1000 >= pool_config.idle_timeout
+end
+
+local function evict(pool)
+    for i = #pool.idle, 1, -1 do
+        shut(pool, pool.idle[i])
+        pool.idle[i] = nil
+        stats.evictions = stats.evictions + 1
+    end
+end
+
+-- an idle connection to the host, or a new one while there are less than
+-- max_per_host, or the next one released
+local function acquire(pool, timeout)
+    while true do
+        local idle = pool.idle
+        local now = cell.time()
+        while #idle > 0 do
+            local c = table.remove(idle)
+            if not expired(c, now) then
+                stats.hits = stats.hits + 1
+                return c, true
+            end
+            stats.evictions = stats.evictions + 1
+            shut(pool, c)
+        end
+        if pool.count < pool_config.max_per_host then
+            pool.count = pool.count + 1
+            stats.misses = stats.misses + 1
+            local ok, sock, interface =
+                pcall(open, pool.protocol, pool.hostaddr, pool.port, pool.hostname, timeout)
+            if not ok then
+                pool.count = pool.count - 1
+                wake(pool)
+                error(sock)
+            end
+            return {sock = sock, interface = interface, requests = 0}, false
+        end
+        local ev = cell.event()
+        table.insert(pool.waiting, ev)
+        cell.wait(ev)
     end
-    close_interface(interface, sock)
-    if ok then
-        return statuscode, body
+end
+
+local function release(pool, c, keep)
+    c.busy = false
+    if keep and #pool.idle < pool_config.max_idle and c.sock:isconnect() then
+        c.last = cell.time()
+        table.insert(pool.idle, c)
+        -- the oldest are at the bottom
+        local now = c.last
+        while #pool.idle > 0 and expired(pool.idle[1], now) do
+            shut(pool, table.remove(pool.idle, 1))
+            stats.evictions = stats.evictions + 1
+        end
     else
-        error(statuscode)
+        shut(pool, c)
     end
+    wake(pool)
+end
+
+-- timeout ms for this request on c, then it is closed
+local function watch(c, timeout)
+    c.busy = true
+    c.requests = c.requests + 1
+    if timeout then
+        local n = c.requests
+        cell.timeout(
+            timeout,
+            function()
+                if c.busy and c.requests == n then
+                    socket.close(c.sock)
+                end
+            end
+        )
+    end
+end
+
+local function reusable(httpver, header)
+    local connection = header["connection"]
+    if type(connection) == "table" then
+        connection = table.concat(connection, ",")
+    end
+    connection = connection and connection:lower() or ""
+    if httpver and httpver < 1.1 then
+        return connection:find("keep-alive", 1, true) ~= nil
+    end
+    return not connection:find("close", 1, true)
+end
+
+-- one request over a pooled connection, body false for no response body
+local function exchange(method, hostname, url, recvheader, header, content, timeout, body)
+    local pool = getpool(hostname)
+    local retry = idempotent[method]
+    while true do
+        local c, reused = acquire(pool, timeout)
+        watch(c, timeout)
+        local ok, statuscode, rbody, rheader, httpver =
+            pcall(internal.request, c.interface, method, pool.host, url, recvheader, header, content)
+        if not ok and reused and retry and statuscode == socket.socketerror then
+            -- the server dropped it idle, likely the others too
+            release(pool, c, false)
+            evict(pool)
+            retry = false
+        else
+            local keep = true
+            if ok and body ~= false then
+                ok, rbody, keep = pcall(internal.response, c.interface, statuscode, rbody, rheader)
+                if not ok then
+                    statuscode = rbody
+                end
+            end
+            if not ok then
+                stats.errors = stats.errors + 1
+            end
+            release(pool, c, ok and keep and reusable(httpver, rheader))
+            if not ok then
+                error(statuscode)
+            end
+            return statuscode, rbody
+        end
+    end
+end
+
+function httpc.request(method, hostname, url, recvheader, header, content, timeout)
+    return exchange(method, hostname, url, recvheader, header, content, timeout)
 end
 
 function httpc.head(hostname, url, recvheader, header, content, timeout)
-    local sock, interface, host = connect(hostname, timeout)
-    local ok, statuscode = pcall(internal.request, interface, "HEAD", host, url, recvheader, header, content)
-    close_interface(interface, sock)
-    if ok then
-        return statuscode
-    else
-        error(statuscode)
+    return (exchange("HEAD", hostname, url, recvheader, header, content, timeout, false))
+end
+
+-- Keep-alive connections are pooled per host. opts:
+--   max_idle (16) idle connections kept for a host
+--   max_per_host (256) connections open to a host, more requests wait
+--   idle_timeout (60000) ms an idle connection is kept
+-- max_idle 0 closes every connection after its request.
+function httpc.pool(opts)
+    for k, v in pairs(opts) do
+        assert(pool_config[k], k)
+        pool_config[k] = v
+    end
+end
+
+-- pool hits and misses, idle connections evicted and connections dropped
+-- on error, and connections idle and open now
+function httpc.stats()
+    local s = {}
+    for k, v in pairs(stats) do
+        s[k] = v
+    end
+    local idle, open = 0, 0
+    for _, pool in pairs(pools) do
+        idle = idle + #pool.idle
+        open = open + pool.count
     end
+    s.idle = idle
+    s.connections = open
+    return s
 end
 
 function httpc.request_stream(method, hostname, url, recvheader, header, content, timeout)
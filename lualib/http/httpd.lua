@@ -1,7 +1,13 @@
+local cell = require "cell"
+local log = require "log"
 local internal = require "http.internal"
+local sockethelper = require "http.sockethelper"
+local chttp = require "cell.c.http"
 
 local string = string
 local type = type
+local pairs = pairs
+local pcall = pcall
 
 local httpd = {}
 
@@ -48,22 +54,43 @@ local http_status_msg = {
     [505] = "HTTP Version not supported"
 }
 
+-- the head parsed in the socket buffer, the body is left there
+local function readhead(sock)
+    local method, url, httpver, header = sock:readwith(chttp.request)
+    if method == nil then
+        error(sockethelper.socketerror)
+    end
+    if not method then
+        return url -- 400, 413 or 505
+    end
+    return nil, url, method, header, "", httpver
+end
+
 local function readall(readbytes, bodylimit)
-    local tmpline = {}
-    local body = internal.recvheader(readbytes, tmpline, "")
-    if not body then
-        return 413 -- Request Entity Too Large
-    end
-    local request = assert(tmpline[1])
-    local method, url, httpver = request:match "^(%a+)%s+(.-)%s+HTTP/([%d%.]+)$"
-    assert(method and url and httpver)
-    httpver = assert(tonumber(httpver))
-    if httpver < 1.0 or httpver > 1.1 then
-        return 505 -- HTTP Version not supported
-    end
-    local header = internal.parseheader(tmpline, 2, {})
-    if not header then
-        return 400 -- Bad request
+    local sock = sockethelper.socket(readbytes)
+    local code, url, method, header, body, httpver
+    if sock then
+        code, url, method, header, body, httpver = readhead(sock)
+        if code then
+            return code
+        end
+    else
+        local tmpline = {}
+        body = internal.recvheader(readbytes, tmpline, "")
+        if not body then
+            return 413 -- Request Entity Too Large
+        end
+        local request = assert(tmpline[1])
+        method, url, httpver = request:match "^(%a+)%s+(.-)%s+HTTP/([%d%.]+)$"
+        assert(method and url and httpver)
+        httpver = assert(tonumber(httpver))
+        if httpver < 1.0 or httpver > 1.1 then
+            return 505 -- HTTP Version not supported
+        end
+        header = internal.parseheader(tmpline, 2, {})
+        if not header then
+            return 400 -- Bad request
+        end
     end
     local length = header["content-length"]
     if length then
@@ -77,7 +104,11 @@ local function readall(readbytes, bodylimit)
     end
 
     if mode == "chunked" then
-        body, header = internal.recvchunkedbody(readbytes, bodylimit, header, body)
+        if sock then
+            body, header = internal.readchunked(sock, readbytes, bodylimit, header)
+        else
+            body, header = internal.recvchunkedbody(readbytes, bodylimit, header, body)
+        end
         if not body then
             return 413
         end
@@ -96,13 +127,15 @@ local function readall(readbytes, bodylimit)
         end
     end
 
-    return 200, url, method, header, body
+    return 200, url, method, header, body, httpver
 end
 
+-- code, url, method, header, body, httpver; nil and the error once the
+-- socket is gone
 function httpd.readrequest(...)
-    local ok, code, url, method, header, body = pcall(readall, ...)
+    local ok, code, url, method, header, body, httpver = pcall(readall, ...)
     if ok then
-        return code, url, method, header, body
+        return code, url, method, header, body, httpver
     else
         return nil, code
     end
@@ -150,4 +183,154 @@ function httpd.writeresponse(...)
     return pcall(writeall, ...)
 end
 
+-- http/1.1 keeps the connection unless asked to close it, 1.0 only when
+-- asked to keep it
+local function keepalive(httpver, header)
+    local connection = header["connection"]
+    if type(connection) == "table" then
+        connection = table.concat(connection, ",")
+    end
+    connection = connection and connection:lower() or ""
+    if httpver >= 1.1 then
+        return not connection:find("close", 1, true)
+    end
+    return connection:find("keep-alive", 1, true) ~= nil
+end
+
+-- answers in request order, whichever handler finishes first
+local function flush(conn)
+    if conn.writing then
+        return
+    end
+    conn.writing = true
+    local r = conn.ready[conn.sent]
+    while r do
+        conn.ready[conn.sent] = nil
+        conn.sent = conn.sent + 1
+        httpd.writeresponse(conn.write, r.code, r.body, r.header)
+        r = conn.ready[conn.sent]
+    end
+    conn.writing = false
+    if conn.event then
+        cell.wakeup(conn.event)
+        conn.event = nil
+    end
+end
+
+local function answer(conn, n, code, body, header, connection)
+    if connection then
+        local h = {connection = connection}
+        for k, v in pairs(header or {}) do
+            h[k] = v
+        end
+        header = h
+    end
+    conn.ready[n] = {code = code, body = body, header = header}
+    flush(conn)
+end
+
+local function handle(conn, n, handler, connection, url, method, header, body)
+    local ok, code, rbody, rheader = pcall(handler, url, method, header, body)
+    if not ok then
+        log.error("httpd handler", url, code)
+        code, rbody, rheader = 500, nil, nil
+    end
+    if method == "HEAD" and rbody ~= nil then
+        -- the header alone, or the next response is taken for the body
+        local h = {}
+        for k, v in pairs(rheader or {}) do
+            h[k] = v
+        end
+        if type(rbody) == "string" then
+            h["content-length"] = #rbody
+        end
+        rbody, rheader = nil, h
+    end
+    answer(conn, n, code, rbody, rheader, connection)
+end
+
+-- wait until no more than n requests are unanswered
+local function drain(conn, n)
+    while conn.count - (conn.sent - 1) > n do
+        conn.event = cell.event()
+        cell.wait(conn.event)
+    end
+end
+
+-- the connection is closed when it idles timeout ms waiting for a request
+local function watch(conn, timeout)
+    cell.timeout(timeout, function()
+        if conn.closed then
+            return
+        end
+        local idle = (cell.time() - conn.last) * 1000
+        if conn.reading and idle >= timeout then
+            conn.sock:disconnect()
+        else
+            watch(conn, conn.reading and math.ceil(timeout - idle) or timeout)
+        end
+    end)
+end
+
+-- Serves the requests on sock until it closes, then closes it. Requests
+-- may be pipelined, up to pipeline of them are handled at once and they
+-- are answered in order. handler(url, method, header, body) returns code,
+-- body and header as writeresponse takes them. opts:
+--   timeout (60000) ms to wait for the next request, then close
+--   requests (1000) requests on one connection, the last one closes it
+--   pipeline (8) requests handled at a time
+--   bodylimit as readrequest
+function httpd.serve(sock, handler, opts)
+    opts = opts or {}
+    local timeout = opts.timeout or 60000
+    local requests = opts.requests or 1000
+    local pipeline = opts.pipeline or 8
+    local read = sockethelper.readfunc(sock)
+    local conn = {
+        sock = sock,
+        write = sockethelper.writefunc(sock),
+        ready = {},
+        sent = 1,
+        count = 0,
+        last = cell.time(),
+        reading = false
+    }
+    watch(conn, timeout)
+    while true do
+        drain(conn, pipeline - 1)
+        conn.reading = true
+        conn.last = cell.time()
+        local code, url, method, header, body, httpver = httpd.readrequest(read, opts.bodylimit)
+        conn.reading = false
+        if not code then
+            break
+        end
+        conn.count = conn.count + 1
+        if code ~= 200 then
+            answer(conn, conn.count, code, nil, nil, "close")
+            break
+        end
+        local keep = conn.count < requests and keepalive(httpver, header)
+        local connection
+        if not keep then
+            connection = "close"
+        elseif httpver < 1.1 then
+            connection = "keep-alive"
+        end
+        if pipeline == 1 then
+            handle(conn, conn.count, handler, connection, url, method, header, body)
+        else
+            cell.fork(handle, conn, conn.count, handler, connection, url, method, header, body)
+        end
+        if not keep then
+            break
+        end
+    end
+    drain(conn, 0)
+    conn.closed = true
+    if sock:isconnect() then
+        sock:disconnect()
+    end
+end
+
 return httpd
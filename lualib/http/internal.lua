@@ -1,3 +1,6 @@
+local chttp = require "cell.c.http"
+local sockethelper = require "http.sockethelper"
+
 local table = table
 local type = type
 local tonumber = tonumber
@@ -144,6 +147,43 @@ function M.recvchunkedbody(readbytes, bodylimit, header, body)
     return result, header
 end
 
+-- a chunked body off the socket buffer, its size lines and trailer parsed
+-- in place, readbytes reads sock
+function M.readchunked(sock, readbytes, bodylimit, header)
+    local result = {}
+    local size = 0
+    while true do
+        local sz = sock:readwith(chttp.chunk)
+        if sz == nil then
+            error(sockethelper.socketerror)
+        end
+        if not sz then
+            return
+        end
+        if sz == 0 then
+            break
+        end
+        size = size + sz
+        if bodylimit and size > bodylimit then
+            return
+        end
+        table.insert(result, readbytes(sz))
+        if readbytes(2) ~= "\r\n" then
+            return
+        end
+    end
+
+    local trailer = sock:readwith(chttp.trailer, header, LIMIT)
+    if trailer == nil then
+        error(sockethelper.socketerror)
+    end
+    if not trailer then
+        return
+    end
+    return table.concat(result), header
+end
+
+-- the body, and whether the connection ends with it and can be reused
 local function recvbody(interface, code, header, body)
     local length = header["content-length"]
     if length then
@@ -151,19 +191,17 @@ local function recvbody(interface, code, header, body)
     end
     if length then
         if #body >= length then
-            body = body:sub(1, length)
-        else
-            local padding = interface.read(length - #body)
-            body = body .. padding
+            return body:sub(1, length), #body == length
         end
+        local padding = interface.read(length - #body)
+        return body .. padding, true
     elseif code == 204 or code == 304 or code < 200 then
         -- See https://stackoverflow.com/questions/15991173/is-the-content-length-header-required-for-a-http-1-0-response
-        body = ""
+        return "", true
     else
         -- no content-length, read all
-        body = body .. interface.readall()
+        return body .. interface.readall(), false
     end
-    return body
 end
 
 function M.request(interface, method, host, url, recvheader, header, content)
@@ -192,6 +230,19 @@ function M.request(interface, method, host, url, recvheader, header, content)
         write(request_header)
     end
 
+    local sock = sockethelper.socket(read)
+    if sock then
+        -- parsed in the socket buffer, the body is left there to read
+        local code, status, httpver, header = sock:readwith(chttp.response, LIMIT, recvheader or {})
+        if code == nil then
+            error(sockethelper.socketerror)
+        end
+        if not code then
+            error(status == 413 and "Recv header failed" or "Invalid HTTP response header")
+        end
+        return code, "", header, httpver
+    end
+
     local tmpline = {}
     local body = M.recvheader(read, tmpline, "")
     if not body then
@@ -199,16 +250,17 @@ function M.request(interface, method, host, url, recvheader, header, content)
     end
 
     local statusline = tmpline[1]
-    local code, info = statusline:match "HTTP/[%d%.]+%s+([%d]+)%s+(.*)$"
+    local httpver, code, info = statusline:match "HTTP/([%d%.]+)%s+([%d]+)%s+(.*)$"
     code = assert(tonumber(code))
 
     local header = M.parseheader(tmpline, 2, recvheader or {})
     if not header then
         error("Invalid HTTP response header")
     end
-    return code, body, header
+    return code, body, header, tonumber(httpver)
 end
 
+-- the body, and whether the connection can carry another request
 function M.response(interface, code, body, header)
     local mode = header["transfer-encoding"]
     if mode then
@@ -218,16 +270,19 @@ function M.response(interface, code, body, header)
     end
 
     if mode == "chunked" then
-        body, header = M.recvchunkedbody(interface.read, nil, header, body)
+        local sock = body == "" and sockethelper.socket(interface.read)
+        if sock then
+            body, header = M.readchunked(sock, interface.read, nil, header)
+        else
+            body, header = M.recvchunkedbody(interface.read, nil, header, body)
+        end
         if not body then
             error("Invalid response body")
         end
-    else
-        -- identity mode
-        body = recvbody(interface, code, header, body)
+        return body, true
     end
-
-    return body
+    -- identity mode
+    return recvbody(interface, code, header, body)
 end
 
 local stream = {}
@@ -17,6 +17,9 @@ local socketerror =
 
 sockethelper.socketerror = socketerror
 
+-- readfunc -> its socket, so the http parser can read its buffer in place
+local readers = setmetatable({}, {__mode = "k"})
+
 local function preread(sock, str)
     return function(sz)
         if str then
@@ -56,7 +59,7 @@ function sockethelper.readfunc(sock, pre)
     if pre then
         return preread(sock, pre)
     end
-    return function(sz)
+    local readfunc = function(sz)
         local ret = sock:readbytes(sz)
         if ret then
             return ret
@@ -64,6 +67,13 @@ function sockethelper.readfunc(sock, pre)
             error(socketerror)
         end
     end
+    readers[readfunc] = sock
+    return readfunc
+end
+
+-- the socket read by readfunc, nil when it reads through something else
+function sockethelper.socket(readfunc)
+    return readers[readfunc]
 end
 
 function sockethelper.readall(sock)
@@ -79,12 +89,13 @@ function sockethelper.writefunc(sock)
     end
 end
 
-function sockethelper.connect(host, port, timeout)
+-- opts as socket.connect
+function sockethelper.connect(host, port, timeout, opts)
     local sock
     if timeout then
-        sock = cell.execwithtimeout(timeout, socket.connect, host, port)
+        sock = cell.execwithtimeout(timeout, socket.connect, host, port, opts)
     else
-        sock = socket.connect(host, port)
+        sock = socket.connect(host, port, opts)
     end
     if sock then
         return sock
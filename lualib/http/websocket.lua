@@ -1,6 +1,7 @@
 local internal = require "http.internal"
 local socket = require "socket"
 local crypt = require "crypt"
+local cws = require "cell.c.websocket"
 local httpd = require "http.httpd"
 local sockethelper = require "http.sockethelper"
 local env = require "env"
@@ -8,12 +9,35 @@ local log = require "log"
 
 local GLOBAL_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 local MAX_FRAME_SIZE = 256 * 1024 -- max frame is 256K
+local MAX_MESSAGE_SIZE = 4 * MAX_FRAME_SIZE -- fragments put together
+-- messages shorter than this go uncompressed
+local DEFLATE_MIN = 64
+-- both ends start each message afresh, so nothing is kept between them
+local DEFLATE_OFFER = "permessage-deflate; client_no_context_takeover; server_no_context_takeover"
 
 local CERT_FILE = env.getconfig("certfile") or "./server-cert.pem"
 local KEY_FILE = env.getconfig("keyfile") or "./server-key.pem"
 
 local M = {}
 
+-- the permessage-deflate offer in an extensions header that we can take,
+-- one that limits our window is not
+local function deflate_offer(extensions)
+    if not extensions or not cws.deflate then
+        return false
+    end
+    if type(extensions) == "table" then
+        extensions = table.concat(extensions, ",")
+    end
+    for offer in extensions:gmatch("[^,]+") do
+        local name = offer:match("^%s*([^;%s]+)")
+        if name == "permessage-deflate" and not offer:find("server_max_window_bits", 1, true) then
+            return true
+        end
+    end
+    return false
+end
+
 local function write_handshake(self, host, url, header)
     local key = crypt.base64encode(crypt.randomkey() .. crypt.randomkey())
     local request_header = {
@@ -22,6 +46,9 @@ local function write_handshake(self, host, url, header)
         ["Sec-WebSocket-Version"] = "13",
         ["Sec-WebSocket-Key"] = key
     }
+    if self.deflate then
+        request_header["Sec-WebSocket-Extensions"] = DEFLATE_OFFER
+    end
     if header then
         for k, v in pairs(header) do
             assert(request_header[k] == nil, k)
@@ -53,6 +80,7 @@ local function write_handshake(self, host, url, header)
     if sw_key ~= crypt.sha1(key .. guid) then
         error("websocket handshake invalid Sec-WebSocket-Accept")
     end
+    self.deflate = self.deflate and deflate_offer(recvheader["sec-websocket-extensions"])
 end
 
 local function read_handshake(self, upgrade_ops)
@@ -126,10 +154,16 @@ local function read_handshake(self, upgrade_ops)
         end
     end
 
+    local extensions = ""
+    self.deflate = self.deflate and deflate_offer(header["sec-websocket-extensions"])
+    if self.deflate then
+        extensions = string.format("Sec-WebSocket-Extensions: %s\r\n", DEFLATE_OFFER)
+    end
+
     -- response handshake
     local accept = crypt.base64encode(crypt.sha1(sw_key .. self.guid))
     local resp = "HTTP/1.1 101 Switching Protocols\r\n" .. "Upgrade: websocket\r\n" .. "Connection: Upgrade\r\n" ..
-                     string.format("Sec-WebSocket-Accept: %s\r\n", accept) .. sub_pro .. "\r\n"
+                     string.format("Sec-WebSocket-Accept: %s\r\n", accept) .. sub_pro .. extensions .. "\r\n"
     self.interface.write(resp)
     return nil, header, url
 end
@@ -149,33 +183,9 @@ local op_code = {
     [0x0A] = "pong"
 }
 
-local function write_frame(self, op, payload_data, masking_key)
-    payload_data = payload_data or ""
-    local payload_len = #payload_data
-    local op_v = assert(op_code[op])
-    local v1 = 0x80 | op_v -- fin is 1 with opcode
-    local s
-    local mask = masking_key and 0x80 or 0x00
-    -- mask set to 0
-    if payload_len < 126 then
-        s = string.pack("I1I1", v1, mask | payload_len)
-    elseif payload_len <= 0xffff then
-        s = string.pack("I1I1>I2", v1, mask | 126, payload_len)
-    else
-        s = string.pack("I1I1>I8", v1, mask | 127, payload_len)
-    end
-    self.interface.write(s)
-
-    -- write masking_key
-    if masking_key then
-        s = string.pack(">I4", masking_key)
-        self.interface.write(s)
-        payload_data = crypt.xor_str(payload_data, s)
-    end
-
-    if payload_len > 0 then
-        self.interface.write(payload_data)
-    end
+-- the whole frame in one write, rsv1 marks a compressed message
+local function write_frame(self, op, payload_data, masking_key, rsv1)
+    self.interface.write(cws.encode(assert(op_code[op]), payload_data, masking_key, true, rsv1))
 end
 
 local function read_close(payload_data)
@@ -189,11 +199,25 @@ local function read_close(payload_data)
 end
 
 local function read_frame(self)
+    local limit = self.mode == "server" and MAX_FRAME_SIZE or math.maxinteger
+    local sock = sockethelper.socket(self.interface.read)
+    if sock then
+        -- parsed and unmasked in the socket buffer
+        local op, payload_data, fin, rsv1 = sock:readwith(cws.frame, limit)
+        if op == nil then
+            error(sockethelper.socketerror)
+        end
+        if not op then
+            error(string.format("invalid frame, close code %d", payload_data))
+        end
+        return fin, assert(op_code[op], "invalid opcode"), payload_data, rsv1
+    end
+
     local s = self.interface.read(2)
     local v1, v2 = string.unpack("I1I1", s)
     local fin = (v1 & 0x80) ~= 0
+    local rsv1 = (v1 & 0x40) ~= 0
     -- unused flag
-    -- local rsv1 = (v1 & 0x40) ~= 0
     -- local rsv2 = (v1 & 0x20) ~= 0
     -- local rsv3 = (v1 & 0x10) ~= 0
     local op = v1 & 0x0f
@@ -207,14 +231,14 @@ local function read_frame(self)
         payload_len = string.unpack(">I8", s)
     end
 
-    if self.mode == "server" and payload_len > MAX_FRAME_SIZE then
+    if payload_len > limit then
         error("payload_len is too large")
     end
 
     local masking_key = mask and self.interface.read(4) or false
     local payload_data = payload_len > 0 and self.interface.read(payload_len) or ""
-    payload_data = masking_key and crypt.xor_str(payload_data, masking_key) or payload_data
-    return fin, assert(op_code[op]), payload_data
+    payload_data = masking_key and cws.mask(payload_data, masking_key) or payload_data
+    return fin, assert(op_code[op]), payload_data, rsv1
 end
 
 local function resolve_accept(self, options)
@@ -264,10 +288,12 @@ local websocket_meta = {
     end
 }
 
+-- a message is its first frame and the continuations after it, control
+-- frames may come between them
 function websocket:readmsg()
-    local recv_buf
+    local recv_buf, size, compressed
     while true do
-        local fin, op, payload_data = read_frame(self)
+        local fin, op, payload_data, rsv1 = read_frame(self)
         if op == "close" then
             local code, reason = read_close(payload_data)
             log.infof("%s close code %s reason %s", self.sock, code, reason)
@@ -276,24 +302,48 @@ function websocket:readmsg()
         elseif op == "ping" then
             write_frame(self, "pong", payload_data)
         elseif op ~= "pong" then -- op is frame, text binary
-            if fin and not recv_buf then
-                return payload_data
-            else
-                recv_buf = recv_buf or {}
-                recv_buf[#recv_buf + 1] = payload_data
+            if (op == "frame") ~= (recv_buf ~= nil) then
+                error(recv_buf and "websocket message interrupted" or "websocket continuation without message")
+            end
+            if not recv_buf then
+                compressed = rsv1 and self.deflate
                 if fin then
-                    local s = table.concat(recv_buf)
-                    return s
+                    return self:_inflate(payload_data, compressed)
                 end
+                recv_buf, size = {}, 0
+            end
+            size = size + #payload_data
+            if self.mode == "server" and size > MAX_MESSAGE_SIZE then
+                error("websocket message is too large")
+            end
+            recv_buf[#recv_buf + 1] = payload_data
+            if fin then
+                return self:_inflate(table.concat(recv_buf), compressed)
             end
         end
     end
 end
 
+function websocket:_inflate(data, compressed)
+    if not compressed then
+        return data
+    end
+    local limit = self.mode == "server" and MAX_MESSAGE_SIZE or math.maxinteger
+    local msg, err = cws.inflate(data, limit)
+    if not msg then
+        error("websocket inflate: " .. err)
+    end
+    return msg
+end
+
 function websocket:writemsg(data, fmt, masking_key)
     fmt = fmt or "text"
     assert(fmt == "text" or fmt == "binary")
-    write_frame(self, fmt, data, masking_key)
+    if self.deflate and #data >= DEFLATE_MIN then
+        write_frame(self, fmt, cws.deflate(data), masking_key, true)
+    else
+        write_frame(self, fmt, data, masking_key)
+    end
 end
 
 function websocket:ping()
@@ -351,7 +401,7 @@ local function _new_server_ws(sock, protocol)
             -- openssl req -x509 -newkey rsa:2048 -days 3650 -nodes -keyout server-key.pem -out server-cert.pem
             SSLCTX_SERVER:set_cert(CERT_FILE, KEY_FILE)
         end
-        local tls_ctx = tls.newtls("server", SSLCTX_SERVER)
+        tls_ctx = tls.newtls("server", SSLCTX_SERVER)
         local init = tls.initresponsefunc(sock, tls_ctx)
         init()
     end
@@ -370,6 +420,7 @@ function M.accept(socket_id, protocol, addr, options)
     local sock = socket.bind(socket_id)
     local ws_obj = _new_server_ws(sock, protocol)
     ws_obj.addr = addr
+    ws_obj.deflate = options and options.deflate
 
     local ok, err = xpcall(resolve_accept, debug.traceback, ws_obj, options)
     if not ok then
@@ -380,7 +431,9 @@ function M.accept(socket_id, protocol, addr, options)
     return ws_obj
 end
 
-function M.connect(url, header, timeout)
+-- opts.deflate offers permessage-deflate, as options.deflate in accept
+-- takes it when offered
+function M.connect(url, header, timeout, opts)
     local protocol, host, uri = string.match(url, "^(wss?)://([^/]+)(.*)$")
     if protocol ~= "wss" and protocol ~= "ws" then
         error(string.format("invalid protocol: %s", protocol))
@@ -401,6 +454,7 @@ function M.connect(url, header, timeout)
     local sock = sockethelper.connect(host_addr, host_port, timeout)
     local ws_obj = _new_client_ws(sock, protocol, hostname)
     ws_obj.addr = host
+    ws_obj.deflate = opts and opts.deflate
     write_handshake(ws_obj, host_addr, uri, header)
     return ws_obj
 end
@@ -61,14 +61,8 @@ local function pack(session, ok, data)
 end
 
 local function dispatch_request()
-    local sz = sock:readbytes(4)
-    while sz do
-        sz = string.unpack("<I4", sz)
-        local msg = sock:readbytes(sz)
-        if msg == nil then
-            sock:disconnect()
-            return
-        end
+    local msg = sock:readframe()
+    while msg do
         local request = mp.unpack(msg)
         if request == nil or request.service == nil then
             sock:disconnect()
@@ -111,7 +105,7 @@ local function dispatch_request()
             end
             sock:write(pack(request.session, true, {id}))
         end
-        sz = sock:readbytes(4)
+        msg = sock:readframe()
     end
     sock:disconnect()
 end
@@ -120,6 +114,8 @@ function cell.main(fd)
     clusterd = cell.uniqueservice("service.clusterd")
     register_name = new_register_name()
     sock = socket.bind(fd)
+    -- set before clusterd forwards fd here, no request arrives unframed
+    sock:framing(4, "little")
     sock:onclose(
         function(fd)
             cell.call(clusterd, "closeagent", fd)
@@ -52,8 +52,7 @@ cell.command(command)
 cell.message(message)
 
 local function read_response(sock)
-    local sz = string.unpack("<I4", sock:readbytes(4))
-    local msg = sock:readbytes(sz)
+    local msg = sock:readframe()
     local response = mp.unpack(msg)
     return response.session, response.ok, response.data -- session, ok, data
 end
@@ -63,6 +62,7 @@ function cell.main(init_host, init_port)
         sc.channel {
         host = init_host,
         port = tonumber(init_port),
-        response = read_response
+        response = read_response,
+        framing = {header = 4, endian = "little"}
     }
 end
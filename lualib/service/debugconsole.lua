@@ -1,4 +1,5 @@
 local cell = require "cell"
+local csocket = require "cell.c.socket"
 local socket = require "socket"
 local log = require "log"
 
@@ -133,10 +134,20 @@ function COMMAND.help()
         gc = "gc : force every lua service do garbage collect",
         start = "start service_path args : lanuch a new lua service, args like 'a',1,{} ",
         call = "call id cmd args : args like 'a',1,{} ",
-        task = "task id : show service task detail"
+        task = "task id : show service task detail",
+        clearcache = "clearcache : reload lua files for newly launched services",
+        socket = "socket : show live socket handles and the dns cache"
     }
 end
 
+function COMMAND.clearcache()
+    return string.format("%d files, %d pooled states dropped", cell.clearcache())
+end
+
+function COMMAND.socket()
+    return csocket.stats()
+end
+
 function COMMAND.list()
     return cell.cmd("list")
 end
@@ -4,16 +4,18 @@ local csocket = require "cell.c.socket"
 local command = {}
 local message = {}
 
-function command.listen(source, addr, port)
-    return csocket.listen(source, addr, port)
+-- listen and connect answer ev once the address is resolved, and with
+-- opts.tls once the handshake is done
+function message.listen(source, addr, port, ev, opts)
+    csocket.listen(source, addr, port, ev, opts)
 end
 
 function command.forward(fd, addr)
     return csocket.forward(fd, addr)
 end
 
-function message.connect(source, addr, port, ev)
-    csocket.connect(source, addr, port, ev)
+function message.connect(source, addr, port, ev, opts)
+    csocket.connect(source, addr, port, ev, opts)
 end
 
 function message.pause(fd)
@@ -28,8 +30,8 @@ function message.disconnect(fd)
     csocket.close(fd)
 end
 
-function command.udp_listen(source, addr, port)
-    return csocket.udp_listen(source, addr, port)
+function message.udp_listen(source, addr, port, ev)
+    csocket.udp_listen(source, addr, port, ev)
 end
 
 function command.udp_forward(fd, addr)
@@ -44,46 +46,26 @@ function message.udp_disconnect(fd)
     csocket.udp_close(fd)
 end
 
+-- reliable udp sockets, closed, forwarded and paused as tcp ones
+function message.kcp_listen(source, addr, port, ev, opts)
+    csocket.udp_listen(source, addr, port, ev, opts)
+end
+
+function message.kcp_connect(source, addr, port, ev, opts)
+    csocket.udp_connect(source, addr, port, ev, opts)
+end
+
 cell.command(command)
 cell.message(message)
 
+-- the sockets run on the network threads, this cell only hands them
+-- requests and writes
 cell.dispatch {
     msg_type = 10, -- write socket
-    dispatch = function(...)
-        csocket.send(...)
-        csocket.pollonce()
-    end
+    dispatch = csocket.send
 }
 
 cell.dispatch {
     msg_type = 15, -- udp write socket
-    dispatch = function(...)
-        csocket.udp_send(...)
-        csocket.pollonce()
-    end
-}
-
-local dispatch_message = cell.getdispatch(3)
-cell.dispatch {
-    msg_type = 3, -- message
-    dispatch = function(...)
-        dispatch_message(...)
-        csocket.pollonce()
-    end
-}
-
-local dispatch_command = cell.getdispatch(2)
-cell.dispatch {
-    msg_type = 2, -- command
-    dispatch = function(...)
-        dispatch_command(...)
-        csocket.pollonce()
-    end
+    dispatch = csocket.udp_send
 }
-
-function cell.main()
-    while true do
-        csocket.pollfor(100) -- milliseconds
-        cell.yield()
-    end
-end
@@ -12,9 +12,6 @@ local ipairs = ipairs
 
 local command = {}
 local message = {}
-local ticker = 0
-local timer = {}
-local free_queue = {}
 local unique_service = {}
 local service_name = {}
 local service_id = {}
@@ -22,34 +19,6 @@ local id_service = {}
 local register_name_service = {}
 local service_register_name = {}
 
-local function alloc_queue()
-    local n = #free_queue
-    if n > 0 then
-        local r = free_queue[n]
-        free_queue[n] = nil
-        return r
-    else
-        return {}
-    end
-end
-
-local function timeout(n, f)
-    local co = cell.cocreate(function()
-        local ev = cell.event()
-        local ti = ticker + n
-        local q = timer[ti]
-        if q == nil then
-            q = alloc_queue()
-            timer[ti] = q
-        end
-        table.insert(q, ev)
-        cell.wait(ev)
-        f()
-        return "EXIT"
-    end)
-    cell.suspend(nil, nil, co, coroutine.resume(co))
-end
-
 function command.echo(str)
     return str
 end
@@ -153,15 +122,7 @@ end
 
 function command.timeout(n)
     if n > 0 then
-        local ev = cell.event()
-        local ti = ticker + n
-        local q = timer[ti]
-        if q == nil then
-            q = alloc_queue()
-            timer[ti] = q
-        end
-        table.insert(q, ev)
-        cell.wait(ev)
+        cell.sleep(n)
     end
 end
 
@@ -213,7 +174,12 @@ function command.stat()
 end
 
 function command.mem()
-    return list_srv(3000, "mem")
+    -- read from the allocator counters, a busy cell is not asked
+    local list = {}
+    for c in pairs(service_name) do
+        list[tostring(c)] = string.format("%.2f Kb", c:memory() / 1024)
+    end
+    return list
 end
 
 function command.gc()
@@ -225,23 +191,6 @@ message.kill = command.kill
 cell.command(command)
 cell.message(message)
 
-cell.dispatch {
-    msg_type = 0, -- timer
-    dispatch = function()
-        ticker = ticker + 1
-        local q = timer[ticker]
-        if q == nil then
-            return
-        end
-        for i = 1, #q do
-            cell.wakeup(q[i])
-            q[i] = nil
-        end
-        timer[ticker] = nil
-        table.insert(free_queue, q)
-    end
-}
-
 local function addFloorService(c, fullname)
     service_name[c] = fullname
     service_id[c] = c:id()
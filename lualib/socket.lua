@@ -7,8 +7,12 @@ local assert = assert
 local type = type
 local string = string
 local setmetatable = setmetatable
+local ipairs = ipairs
 
 local BUFFER_LIMIT = 128 * 1024
+local FRAME_MAX = 16 * 1024 * 1024
+-- socket_wait argument of a reader waiting for a frame
+local FRAME_WAIT = {}
 
 local sockets_fd = nil
 local sockets_accept = {}
@@ -16,6 +20,7 @@ local sockets_closed = {}
 local sockets_event = {}
 local sockets_arg = {}
 local sockets_buffer = {}
+local sockets_frames = {}
 local sockets_pause = {}
 local sockets_warning = {}
 local sockets_onclose = {}
@@ -60,7 +65,7 @@ function socket:write(msg)
     if sockets_closed[fd] then
         return
     end
-    return cell.rawsend(sockets_fd, 10, fd, csocket.sendpack(msg))
+    return csocket.write(fd, msg)
 end
 
 function socket:isconnect()
@@ -78,6 +83,7 @@ function socket:disconnect()
         sockets_event[fd] = nil
     else
         sockets_buffer[fd] = nil
+        sockets_frames[fd] = nil
     end
 
     cell.send(sockets_fd, "disconnect", fd)
@@ -210,16 +216,85 @@ function socket:readall()
     return r
 end
 
+local function readwith(self, parse, a, b, r, ...)
+    if r ~= nil then
+        return r, ...
+    end
+    local fd = self.__fd
+    if sockets_closed[fd] then
+        return
+    end
+    -- r is nil and the bytes buffered, wake up once there are more
+    socket_wait(fd, (... or 0) + 1)
+    local buffer = sockets_buffer[fd]
+    if not buffer then
+        return
+    end
+    return readwith(self, parse, a, b, parse(buffer, a, b))
+end
+
+-- parse(buffer, a, b) reads off the front of the read buffer in place, see
+-- cell.c.http. It returns nil and the bytes buffered while it needs more,
+-- this waits for them and tries again. nil once closed
+function socket:readwith(parse, a, b)
+    local buffer = sockets_buffer[self.__fd]
+    if buffer then
+        return readwith(self, parse, a, b, parse(buffer, a, b))
+    end
+    return readwith(self, parse, a, b, nil, 0)
+end
+
+-- Let the session cut the stream into frames behind a header of 1, 2 or 4
+-- bytes (default 4), endian "little" (default) or "big". A frame over max
+-- closes the socket. Bytes that reached this cell before stay raw, so call
+-- it before forward or before the peer can send.
+function socket:framing(header, endian, max)
+    local fd = self.__fd
+    header = header or 4
+    if header == 0 then
+        sockets_frames[fd] = nil
+    else
+        sockets_frames[fd] = sockets_frames[fd] or {head = 1, tail = 0, bytes = 0}
+    end
+    return csocket.framing(fd, header, endian == "big", max or FRAME_MAX)
+end
+
+-- the next whole frame without its header, nil once closed
+function socket:readframe()
+    local fd = self.__fd
+    local frames = sockets_frames[fd]
+    if frames and frames.head > frames.tail and not sockets_closed[fd] then
+        socket_wait(fd, FRAME_WAIT)
+        frames = sockets_frames[fd]
+    end
+    if not frames then
+        return
+    end
+    if frames.head > frames.tail then
+        if sockets_closed[fd] then
+            sockets_frames[fd] = nil
+        end
+        return
+    end
+    local frame = frames[frames.head]
+    frames[frames.head] = nil
+    frames.head = frames.head + 1
+    frames.bytes = frames.bytes - #frame
+    return frame
+end
+
 function listen_socket:disconnect()
     sockets_accept[self.__fd] = nil
     socket.disconnect(self)
 end
 
-function socket_ins.listen(addr, port, accepter)
+local function listen(cmd, addr, port, accepter, opts)
     assert(type(accepter) == "function")
     sockets_fd = sockets_fd or cell.cmd("socket")
+    local ev = cell.event()
+    local fd, err = cell.rawcall(sockets_fd, ev, 3, cmd, cell.self, addr, port, ev, opts)
     local obj = {
-        __fd = assert(cell.call(sockets_fd, "listen", cell.self, addr, port), "Listen failed"),
+        __fd = assert(fd, err or "Listen failed"),
         __addr = addr
     }
     sockets_accept[obj.__fd] = function(fd, addr)
@@ -234,10 +309,10 @@ function socket_ins.listen(addr, port, accepter)
     return obj
 end
 
-function socket_ins.connect(addr, port)
+local function connect(cmd, addr, port, opts)
     sockets_fd = sockets_fd or cell.cmd("socket")
     local ev = cell.event()
-    local fd, err = cell.rawcall(sockets_fd, ev, 3, "connect", cell.self, addr, port, ev)
+    local fd, err = cell.rawcall(sockets_fd, ev, 3, cmd, cell.self, addr, port, ev, opts)
     if not fd then
         return fd, err
     end
@@ -250,6 +325,36 @@ function socket_ins.connect(addr, port)
     return obj
 end
 
+-- opts.tls terminates tls in the network threads, the socket reads and
+-- writes plaintext. A server takes {cert = pem file, key = pem file} and
+-- hands over a connection once its handshake is done. A client takes true
+-- or {servername = name, verify = true, cafile = pem file}, and resumes the
+-- session of its last connection to the same address and port. Either end
+-- takes max_version = "1.2" or "1.3", by default the most the library
+-- speaks; LibreSSL only resumes TLS 1.2 sessions.
+function socket_ins.listen(addr, port, accepter, opts)
+    return listen("listen", addr, port, accepter, opts)
+end
+
+function socket_ins.connect(addr, port, opts)
+    return connect("connect", addr, port, opts)
+end
+
+-- Reliable sockets over udp, a KCP style ARQ run by the network threads,
+-- for links where the head of line blocking of tcp hurts. They are read,
+-- written, forwarded and closed like tcp sockets. opts, both ends alike:
+--   nodelay (true), interval (10 ms), resend (2 acks skipping a segment,
+--   0 off), nocwnd (false), sndwnd (32), rcvwnd (128), mtu (1400)
+--   message (false), keep the boundary of each write, read them with
+--   framing() and readframe(), a message is at most 127 segments
+function socket_ins.kcp_listen(addr, port, accepter, opts)
+    return listen("kcp_listen", addr, port, accepter, opts or {})
+end
+
+function socket_ins.kcp_connect(addr, port, opts)
+    return connect("kcp_connect", addr, port, opts or {})
+end
+
 function socket_ins.bind(fd, addr)
     sockets_fd = sockets_fd or cell.cmd("socket")
     local obj = {
@@ -318,6 +423,29 @@ cell.dispatch {
     end
 }
 
+cell.dispatch {
+    msg_type = 16, -- socket frames
+    dispatch = function(fd, ...)
+        local frames = sockets_frames[fd]
+        if not frames or sockets_closed[fd] then
+            return
+        end
+        for _, frame in ipairs({...}) do
+            frames.tail = frames.tail + 1
+            frames[frames.tail] = frame
+            frames.bytes = frames.bytes + #frame
+        end
+        local ev = sockets_event[fd]
+        if ev and sockets_arg[fd] == FRAME_WAIT then
+            cell.wakeup(ev)
+            sockets_event[fd] = nil
+        end
+        if frames.bytes > BUFFER_LIMIT then
+            socket_pause(fd, frames.bytes)
+        end
+    end
+}
+
 cell.dispatch {
     msg_type = 8, -- close socket
     dispatch = function(fd)
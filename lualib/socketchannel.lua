@@ -12,7 +12,8 @@ local type = type
 local error = error
 
 -- channel support auto reconnect , and capture socket error in request/response transaction
--- { host = "", port = , auth = function(so) , response = function(so) session, data }
+-- { host = "", port = , auth = function(so) , response = function(so) session, data,
+--   framing = { header = , endian = , max = } }
 
 local socket_channel = {}
 local channel = {}
@@ -63,6 +64,20 @@ function channel_socket:readbytes(bytes)
     end
 end
 
+function channel_socket:readframe()
+    local sock = self[1]
+    if sock then
+        local result = sock:readframe()
+        if not result then
+            error(socket_error)
+        else
+            return result
+        end
+    else
+        error(socket_error)
+    end
+end
+
 function channel_socket:readline(sep)
     local sock = self[1]
     if sock then
@@ -84,6 +99,7 @@ function socket_channel.channel(desc)
         __backup = desc.backup,
         __auth = desc.auth,
         __response = desc.response, -- It's for session mode
+        __framing = desc.framing, -- socket:framing arguments, read by readframe
         __request = {}, -- request seq { response func }	-- It's for order mode
         __thread = {}, -- event seq or session->event map
         __result = {}, -- response result { event -> result }
@@ -279,6 +295,12 @@ local function connect_once(self)
         self.__host = addr.host
         self.__port = addr.port
 
+        local framing = self.__framing
+        if framing then
+            -- before the first request, so every reply arrives framed
+            sock:framing(framing.header, framing.endian, framing.max)
+        end
+
         assert(not self.__sock and not self.__authcoroutine)
         -- term current dispatch thread (send a signal)
         term_dispatch_thread(self)
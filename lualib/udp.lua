@@ -57,7 +57,7 @@ function socket:write(msg)
     if sockets_closed[fd] then
         return
     end
-    return cell.rawsend(sockets_fd, 15, fd, csocket.sendpack(msg))
+    return csocket.udp_write(fd, msg)
 end
 
 function socket:disconnect()
@@ -120,8 +120,10 @@ end
 function socket_ins.listen(addr, port, accepter)
     assert(type(accepter) == "function")
     sockets_fd = sockets_fd or cell.cmd("socket")
+    local ev = cell.event()
+    local fd, err = cell.rawcall(sockets_fd, ev, 3, "udp_listen", cell.self, addr, port, ev)
     local obj = {
-        __fd = assert(cell.call(sockets_fd, "udp_listen", cell.self, addr, port), "Udp listen failed"),
+        __fd = assert(fd, err or "Udp listen failed"),
         __addr = addr
     }
     sockets_accept[obj.__fd] = function(fd, addr)
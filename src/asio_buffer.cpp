@@ -0,0 +1,214 @@
+#include "asio_buffer.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+// Free blocks are cached per thread and per size class. Sessions allocate
+// on the network threads but cells free on the workers, so a full cache
+// hands half of it to a shared depot and an empty one refills from there.
+static const int CLASSES = 5;
+static const std::size_t CLASS_SIZE[CLASSES] = {512, 2048, 8192, 32768,
+                                                 65536};
+// bytes of free blocks one thread keeps per class
+static const std::size_t CACHE_BYTES = 256 * 1024;
+// bytes of free blocks the depot keeps per class
+static const std::size_t DEPOT_BYTES = 4 * 1024 * 1024;
+
+static int _class(std::size_t size) {
+    for (int i = 0; i < CLASSES; i++) {
+        if (size <= CLASS_SIZE[i]) {
+            return i;
+        }
+    }
+    return CLASSES - 1;
+}
+
+static int _limit(int index, std::size_t bytes) {
+    int n = static_cast<int>(bytes / CLASS_SIZE[index]);
+    return n < 4 ? 4 : n;
+}
+
+struct block_list {
+    r_block *head{nullptr};
+    int count{0};
+
+    void push(r_block *b) {
+        b->next = head;
+        head = b;
+        ++count;
+    }
+
+    r_block *pop() {
+        r_block *b = head;
+        head = b->next;
+        --count;
+        return b;
+    }
+};
+
+struct depot {
+    std::mutex mut;
+    block_list list;
+};
+
+static depot depots[CLASSES];
+
+struct block_cache {
+    block_list list[CLASSES];
+
+    ~block_cache() {
+        for (int i = 0; i < CLASSES; i++) {
+            while (list[i].count > 0) {
+                free(list[i].pop());
+            }
+        }
+    }
+};
+
+static thread_local block_cache cache;
+
+r_block *rblock_new(std::size_t size) {
+    int index = _class(size);
+    block_list &list = cache.list[index];
+    if (list.count == 0) {
+        depot &d = depots[index];
+        std::lock_guard<std::mutex> lock(d.mut);
+        int n = _limit(index, CACHE_BYTES) / 2;
+        while (n-- > 0 && d.list.count > 0) {
+            list.push(d.list.pop());
+        }
+    }
+
+    r_block *b = nullptr;
+    if (list.count > 0) {
+        b = list.pop();
+    } else {
+        b = static_cast<r_block *>(
+            malloc(sizeof(r_block) + CLASS_SIZE[index]));
+        b->cap = CLASS_SIZE[index];
+    }
+    b->data = reinterpret_cast<char *>(b + 1);
+    b->len = 0;
+    b->ptr = 0;
+    b->next = nullptr;
+    return b;
+}
+
+void rblock_free(r_block *b) {
+    int index = _class(b->cap);
+    block_list &list = cache.list[index];
+    list.push(b);
+    int limit = _limit(index, CACHE_BYTES);
+    if (list.count <= limit) {
+        return;
+    }
+
+    depot &d = depots[index];
+    int keep = _limit(index, DEPOT_BYTES);
+    std::lock_guard<std::mutex> lock(d.mut);
+    while (list.count > limit / 2) {
+        r_block *x = list.pop();
+        if (d.list.count < keep) {
+            d.list.push(x);
+        } else {
+            free(x);
+        }
+    }
+}
+
+// whether sep[0, sz) is at p in b, the rest may run into the next blocks
+static bool _match(r_block *b, std::size_t p, const char *sep,
+                   std::size_t sz) {
+    while (sz > 0) {
+        if (p == b->len) {
+            b = b->next;
+            p = b->ptr;
+            continue;
+        }
+        std::size_t n = b->len - p;
+        if (n > sz) {
+            n = sz;
+        }
+        if (memcmp(b->data + p, sep, n) != 0) {
+            return false;
+        }
+        p += n;
+        sep += n;
+        sz -= n;
+    }
+    return true;
+}
+
+void read_buffer::skip(std::size_t sz) {
+    consumed(sz);
+    while (sz > 0) {
+        std::size_t n = head->len - head->ptr;
+        if (sz < n) {
+            head->ptr += sz;
+            break;
+        }
+        sz -= n;
+        r_block *next = head->next;
+        rblock_free(head);
+        head = next;
+    }
+    if (head == nullptr) {
+        tail = nullptr;
+    }
+}
+
+std::size_t read_buffer::find(const char *sep, std::size_t sz) {
+    if (sz == 0) {
+        return 0;
+    }
+    if (sz != scan_len || memcmp(sep, scan_sep, sz) != 0) {
+        scanned = 0;
+        scan_len = 0;
+        if (sz <= SCAN_SEP_MAX) {
+            memcpy(scan_sep, sep, sz);
+            scan_len = sz;
+        }
+    }
+    if (scanned + sz > len) {
+        return npos;
+    }
+
+    // skip to the block holding the first unscanned byte
+    std::size_t base = 0;
+    r_block *b = head;
+    while (scanned - base >= b->len - b->ptr) {
+        base += b->len - b->ptr;
+        b = b->next;
+    }
+
+    std::size_t p = b->ptr + (scanned - base);
+    for (;;) {
+        // memchr is vectorized, only first byte hits are compared in full
+        const char *hit = static_cast<const char *>(
+            memchr(b->data + p, sep[0], b->len - p));
+        if (hit) {
+            p = hit - b->data;
+            std::size_t index = base + (p - b->ptr);
+            if (index + sz > len) {
+                // may still complete once more bytes arrive
+                scanned = index;
+                return npos;
+            }
+            if (_match(b, p, sep, sz)) {
+                scanned = index;
+                return index;
+            }
+            ++p;
+            continue;
+        }
+        base += b->len - b->ptr;
+        b = b->next;
+        if (b == nullptr) {
+            break;
+        }
+        p = b->ptr;
+    }
+    scanned = len;
+    return npos;
+}
@@ -6,26 +6,47 @@
 #include <vector>
 
 #include "asio/buffer.hpp"
+#include "hive_buffer.h"
 
-static const int READ_BLOCK_SIZE = 512;
+// a session reads into blocks of READ_BLOCK_SIZE up to READ_BLOCK_MAX,
+// doubling while reads fill them and halving after short ones
+static const std::size_t READ_BLOCK_SIZE = 512;
+static const std::size_t READ_BLOCK_MAX = 64 * 1024;
 static const int UDP_BLOCK_SIZE = 1400;
 
+// A read block, its cap bytes of data follow it in the same allocation.
 struct r_block {
-    std::array<char, READ_BLOCK_SIZE> data;
-    std::size_t len{READ_BLOCK_SIZE};
-    std::size_t ptr{0};
-    r_block *next{nullptr};
+    char *data;
+    std::size_t cap;
+    std::size_t len;
+    std::size_t ptr;
+    r_block *next;
 };
 
+// pooled per size class, size is rounded up to the class
+r_block *rblock_new(std::size_t size);
+void rblock_free(r_block *b);
+
+// longest separator whose scan position is kept between finds
+static const std::size_t SCAN_SEP_MAX = 16;
+
 struct read_buffer {
+    static const std::size_t npos = static_cast<std::size_t>(-1);
+
     r_block *head;
     r_block *tail;
     std::size_t len;
+    // no sep starts before scanned, for the sep in scan_sep
+    std::size_t scanned;
+    std::size_t scan_len;
+    char scan_sep[SCAN_SEP_MAX];
 
     void init(r_block *block) {
         head = block;
         tail = block;
         len = block->len;
+        scanned = 0;
+        scan_len = 0;
     }
 
     void append(r_block *block) {
@@ -40,55 +61,32 @@ struct read_buffer {
         }
     }
 
-    const char *peek(std::size_t index) {
-        if (index >= len || head == nullptr) {
-            return nullptr;
-        }
-        if (index >= (len - tail->len)) {
-            return &tail->data[index - (len - tail->len)];
-        }
-        if (index < (head->len - head->ptr)) {
-            return &head->data[head->ptr + index];
-        }
-        index -= (head->len - head->ptr);
-        r_block *next = head->next;
-        while (next != tail) {
-            if (index >= next->len) {
-                index -= next->len;
-                next = next->next;
-            } else {
-                return &next->data[index];
-            }
-        }
-        return nullptr;
-    }
+    // offset of the first sep in the buffer, npos when there is none yet.
+    // The scan resumes where the last one for the same sep stopped.
+    std::size_t find(const char *sep, std::size_t sz);
 
-    int check_sep(std::size_t from, const char *sep, std::size_t sz) {
-        for (std::size_t i = 0; i < sz; i++) {
-            std::size_t index = from + i;
-            const char *p = peek(index);
-            if (p == nullptr) {
-                return 0;
-            }
-            if (*p != sep[i]) {
-                return 0;
-            }
-        }
-        return 1;
+    // bytes taken from the front move the resumed scan along
+    void consumed(std::size_t sz) {
+        len -= sz;
+        scanned = scanned > sz ? scanned - sz : 0;
     }
 
+    // drop sz bytes from the front, freeing the blocks emptied
+    void skip(std::size_t sz);
+
     void free() {
         while (head != tail) {
             r_block *next = head->next;
-            delete head;
+            rblock_free(head);
             head = next;
         }
         if (head) {
-            delete head;
+            rblock_free(head);
         }
         head = nullptr;
         tail = nullptr;
         len = 0;
+        scanned = 0;
     }
 };
 
@@ -96,8 +94,16 @@ struct w_block {
     const char *data{nullptr};
     std::size_t len{0};
     std::size_t ptr{0};
+    // data belongs to shared when set, else to new[]
+    shared_buffer *shared{nullptr};
 
-    ~w_block() { delete[] data; }
+    ~w_block() {
+        if (shared) {
+            buffer_release(shared);
+        } else {
+            delete[] data;
+        }
+    }
 };
 
 class write_buffer {
@@ -113,6 +119,18 @@ class write_buffer {
         buffer.push_back(blk);
     }
 
+    void append(w_block *blk) { buffer.push_back(blk); }
+
+    // written without a copy, holds a reference until sent
+    void append(shared_buffer *b) {
+        buffer_grab(b);
+        w_block *blk = new w_block;
+        blk->data = buffer_data(b);
+        blk->len = buffer_size(b);
+        blk->shared = b;
+        buffer.push_back(blk);
+    }
+
     const std::vector<asio::const_buffer> &const_buffer() {
         c_buffer.clear();
         std::list<w_block *>::iterator iter = buffer.begin();
@@ -171,16 +189,25 @@ struct udp_r_block {
     udp_r_block *next{nullptr};
 };
 
+// datagrams arrive as chains of blocks, one chain per batch
 struct udp_read_buffer {
     udp_r_block *head;
+    udp_r_block *tail;
 
-    void init(udp_r_block *block) { head = block; }
+    void init(udp_r_block *block) {
+        head = nullptr;
+        append(block);
+    }
 
     void append(udp_r_block *block) {
         if (head == nullptr) {
             head = block;
         } else {
-            head->next = block;
+            tail->next = block;
+        }
+        tail = block;
+        while (tail->next != nullptr) {
+            tail = tail->next;
         }
     }
 
@@ -188,6 +215,7 @@ struct udp_read_buffer {
         auto block = head;
         if (head != nullptr) {
             head = head->next;
+            block->next = nullptr;
         }
         return block;
     }
@@ -1,6 +1,11 @@
 #ifndef client_h
 #define client_h
 
+#include <string>
+#include <vector>
+
+#include "asio/connect.hpp"
+#include "hive_dns.h"
 #include "session.h"
 
 class client : public std::enable_shared_from_this<client> {
@@ -8,36 +13,47 @@ class client : public std::enable_shared_from_this<client> {
     client(const client &) = delete;
     client &operator=(const client &) = delete;
 
-    client(cell *c, const char *addr, unsigned short port)
+    // tls is nullptr for plain tcp
+    client(cell *c, const char *addr, unsigned short port,
+           const tls_options *tls)
         : addr(addr), port(port) {
-        asio::ip::tcp::socket socket(io_context);
+        if (tls) {
+            tls_opts.reset(new tls_options(*tls));
+        }
+        asio::ip::tcp::socket socket(network_next());
         session_ptr = std::make_shared<session>(std::move(socket),
                                                 get_session_increase_id());
         session_ptr->set_to_cell(c);
     }
 
-    bool connect(lua_Integer event) {
-        asio::ip::tcp::resolver resolver(io_context);
-        std::error_code ec;
-        asio::ip::tcp::resolver::iterator iter =
-            resolver.resolve(addr, std::to_string(port), ec);
-        asio::ip::tcp::resolver::iterator end;
-
-        if (iter == end || ec) {
-            log_error(
-                "client connect address = %s, port = %d, id = %d, "
-                "error_code = %d, error = %s",
-                addr, port, session_ptr->session_id(), ec.value(),
-                ec.message().c_str());
-            return false;
-        }
-
+    // the address is looked up off the network threads, then each of its
+    // addresses is tried in turn
+    void connect(lua_Integer event) {
         auto self(shared_from_this());
-        session_ptr->get_socket().async_connect(
-            *iter, [this, self, event](std::error_code ec) {
-                handle_connect(event, ec);
-            });
-        return true;
+        dns_resolve(session_ptr->get_socket().get_executor(), addr,
+                    [this, self, event](
+                        std::error_code ec,
+                        const std::vector<asio::ip::address> &addrs) {
+                        if (!ec && session_ptr->session_id() == 0) {
+                            // every handle is live
+                            ec = asio::error::no_descriptors;
+                        }
+                        if (ec) {
+                            handle_connect(event, ec);
+                            return;
+                        }
+                        std::vector<asio::ip::tcp::endpoint> endpoints;
+                        for (const auto &a : addrs) {
+                            endpoints.emplace_back(a, port);
+                        }
+                        asio::async_connect(
+                            session_ptr->get_socket(), endpoints,
+                            [this, self, event](
+                                std::error_code ec,
+                                const asio::ip::tcp::endpoint &) {
+                                handle_connect(event, ec);
+                            });
+                    });
     }
 
     std::shared_ptr<session> get_session() { return session_ptr; }
@@ -50,28 +66,59 @@ class client : public std::enable_shared_from_this<client> {
 
    private:
     void handle_connect(lua_Integer event, std::error_code &ec) {
-        if (!ec) {
+        std::string err;
+        std::shared_ptr<tls_context> ctx;
+        if (!ec && tls_opts) {
+            ctx = tls_client_context(*tls_opts, err);
+        }
+        if (!ec && err.empty()) {
             session_ptr->get_socket().set_option(
                 asio::socket_base::enable_connection_aborted(true));
             session_ptr->get_socket().set_option(
                 asio::socket_base::linger(true, 30));
             session_ptr->get_socket().set_option(asio::ip::tcp::no_delay(true));
             session_ptr->get_socket().non_blocking(true);
+            if (!ctx) {
+                session_ptr->start();
+                notify_connect_succ(event);
+                return;
+            }
+            // connected once the handshake is done
+            // an address literal is verified against the IP names of the
+            // certificate, never left unchecked
+            std::string servername = tls_opts->servername;
+            if (servername.empty()) {
+                servername = addr;
+            }
+            auto self(shared_from_this());
+            session_ptr->set_tls(
+                std::unique_ptr<tls_stream>(new tls_stream(
+                    ctx, addr + ":" + std::to_string(port), servername)),
+                true, [this, self, event](session *, const std::string &err) {
+                    if (err.empty()) {
+                        notify_connect_succ(event);
+                    } else {
+                        fail(event, err);
+                    }
+                });
             session_ptr->start();
+            return;
+        }
+        if (ec) {
+            err = ec.message();
+        }
+        fail(event, err);
+    }
 
-            notify_connect_succ(event);
-        } else {
-            client_map[session_ptr->session_id()] = nullptr;
-            session_map[session_ptr->session_id()] = nullptr;
+    void fail(lua_Integer event, const std::string &err) {
+        client_map.erase(session_ptr->session_id());
+        session_map.erase(session_ptr->session_id());
 
-            log_error(
-                "client connect address = %s, port = %d, id = %d, "
-                "error_code = %d, error = %s",
-                addr, port, session_ptr->session_id(), ec.value(),
-                ec.message().c_str());
+        log_error(
+            "client connect address = %s, port = %d, id = %d, error = %s",
+            addr.c_str(), port, session_ptr->session_id(), err.c_str());
 
-            notify_connect_fail(event, ec.message());
-        }
+        notify_connect_fail(event, err);
     }
 
     void notify_connect_succ(lua_Integer event) {
@@ -99,8 +146,9 @@ class client : public std::enable_shared_from_this<client> {
         }
     }
 
-    const char *addr;
+    std::string addr;
     unsigned short port;
+    std::unique_ptr<tls_options> tls_opts;
     std::shared_ptr<session> session_ptr;
 };
 
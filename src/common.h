@@ -2,37 +2,166 @@
 #define common_h
 
 #include <atomic>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
-#include "asio/io_context.hpp"
+#include "hive_network.h"
 
-static std::atomic<uint32_t> auto_session_increase_id{1};
+// complete frames per socket frames message
+static const int FRAME_BATCH = 64;
 
-static uint32_t get_session_increase_id() {
-    return auto_session_increase_id.fetch_add(1);
-}
+// Socket ids are handles, slot | generation << HANDLE_SLOT_BITS. A freed
+// slot bumps its generation, so an id held after its socket closed finds
+// nothing instead of the slot's next owner.
+static const int HANDLE_SLOT_BITS = 20;
+static const uint32_t HANDLE_SLOT_MASK = (1u << HANDLE_SLOT_BITS) - 1;
+static const uint32_t HANDLE_GENERATION_MASK =
+    (1u << (32 - HANDLE_SLOT_BITS)) - 1;
+
+class handle_alloc {
+   public:
+    // the id lives until free(), the object it names frees it on destroy.
+    // 0 once every slot is live, the socket is refused then.
+    uint32_t alloc() {
+        std::lock_guard<std::mutex> lock(mut);
+        uint32_t slot = 0;
+        if (free_slots.empty()) {
+            slot = static_cast<uint32_t>(generation.size());
+            if (slot > HANDLE_SLOT_MASK) {
+                return 0;
+            }
+            generation.push_back(1);
+        } else {
+            // oldest first, a slot is reused as late as possible
+            slot = free_slots.front();
+            free_slots.pop_front();
+        }
+        ++live;
+        return slot | generation[slot] << HANDLE_SLOT_BITS;
+    }
+
+    void free(uint32_t id) {
+        if (id == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mut);
+        uint32_t slot = id & HANDLE_SLOT_MASK;
+        uint32_t gen = (generation[slot] + 1) & HANDLE_GENERATION_MASK;
+        // 0 stays unused, no id is ever 0
+        generation[slot] = gen == 0 ? 1 : gen;
+        free_slots.push_back(slot);
+        --live;
+    }
+
+    int live_count() {
+        std::lock_guard<std::mutex> lock(mut);
+        return live;
+    }
+
+    int slot_count() {
+        std::lock_guard<std::mutex> lock(mut);
+        return static_cast<int>(generation.size());
+    }
+
+   private:
+    std::mutex mut;
+    std::vector<uint32_t> generation;
+    std::deque<uint32_t> free_slots;
+    int live{0};
+};
+
+static handle_alloc handles;
+
+static uint32_t get_session_increase_id() { return handles.alloc(); }
+
+static void free_session_id(uint32_t id) { handles.free(id); }
+
+// id -> socket object, shared by the cells and the network threads. Indexed
+// by the id's slot, an entry only matches its full id. 0 is never in it.
+template <typename T>
+class session_table {
+   public:
+    std::shared_ptr<T> get(uint32_t id) {
+        if (id == 0) {
+            return nullptr;
+        }
+        uint32_t slot = id & HANDLE_SLOT_MASK;
+        std::lock_guard<std::mutex> lock(mut);
+        if (slot >= entries.size() || entries[slot].id != id) {
+            return nullptr;
+        }
+        return entries[slot].ptr;
+    }
+
+    void set(uint32_t id, std::shared_ptr<T> ptr) {
+        if (id == 0) {
+            return;
+        }
+        uint32_t slot = id & HANDLE_SLOT_MASK;
+        std::lock_guard<std::mutex> lock(mut);
+        if (slot >= entries.size()) {
+            entries.resize(slot + 1);
+        }
+        if (entries[slot].id == 0) {
+            ++count;
+        }
+        entries[slot].id = id;
+        entries[slot].ptr = std::move(ptr);
+    }
+
+    void erase(uint32_t id) {
+        if (id == 0) {
+            return;
+        }
+        uint32_t slot = id & HANDLE_SLOT_MASK;
+        std::shared_ptr<T> ptr;
+        {
+            std::lock_guard<std::mutex> lock(mut);
+            if (slot >= entries.size() || entries[slot].id != id) {
+                return;
+            }
+            entries[slot].id = 0;
+            // the object may be destroyed with it, outside the lock
+            ptr = std::move(entries[slot].ptr);
+            --count;
+        }
+    }
+
+    int size() {
+        std::lock_guard<std::mutex> lock(mut);
+        return count;
+    }
+
+   private:
+    struct entry {
+        uint32_t id{0};
+        std::shared_ptr<T> ptr;
+    };
+
+    std::mutex mut;
+    std::vector<entry> entries;
+    int count{0};
+};
 
 class session;
-static std::unordered_map<uint32_t, std::shared_ptr<session>> session_map;
+static session_table<session> session_map;
 
 class server;
-static std::unordered_map<uint32_t, std::shared_ptr<server>> server_map;
+static session_table<server> server_map;
 
 class client;
-static std::unordered_map<uint32_t, std::shared_ptr<client>> client_map;
+static session_table<client> client_map;
 
 class udp_session;
-static std::unordered_map<uint32_t, std::shared_ptr<udp_session>>
-    udp_session_map;
+static session_table<udp_session> udp_session_map;
 
 class udp_server;
-static std::unordered_map<uint32_t, std::shared_ptr<udp_server>> udp_server_map;
+static session_table<udp_server> udp_server_map;
 
 class udp_client;
-static std::unordered_map<uint32_t, std::shared_ptr<udp_client>> udp_client_map;
-
-static asio::io_context io_context;
-static asio::io_context::work work(io_context);
+static session_table<udp_client> udp_client_map;
 
 #endif
\ No newline at end of file
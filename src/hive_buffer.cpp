@@ -0,0 +1,119 @@
+#include "hive_buffer.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+struct shared_buffer {
+    std::atomic<int> ref{1};
+    std::size_t size{0};
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+};
+
+struct buffer_ud {
+    shared_buffer *b;
+};
+
+static int __buffer = 0;
+#define BUFFER_TAG (&__buffer)
+
+shared_buffer *buffer_new(const char *data, std::size_t sz) {
+    // header and bytes in one allocation
+    void *p = malloc(sizeof(shared_buffer) + sz);
+    if (p == nullptr) {
+        return nullptr;
+    }
+    auto b = new (p) shared_buffer;
+    b->size = sz;
+    if (data != nullptr) {
+        memcpy(b->data(), data, sz);
+    }
+    return b;
+}
+
+char *buffer_writable(shared_buffer *b) { return b->data(); }
+
+void buffer_grab(shared_buffer *b) { b->ref.fetch_add(1); }
+
+void buffer_release(shared_buffer *b) {
+    if (b->ref.fetch_sub(1) == 1) {
+        b->~shared_buffer();
+        free(b);
+    }
+}
+
+const char *buffer_data(shared_buffer *b) { return b->data(); }
+
+std::size_t buffer_size(shared_buffer *b) { return b->size; }
+
+static shared_buffer *checkbuffer(lua_State *L, int index) {
+    auto bud = static_cast<buffer_ud *>(luaL_checkudata(L, index, "buffer"));
+    return bud->b;
+}
+
+static int llen(lua_State *L) {
+    lua_pushinteger(L, static_cast<lua_Integer>(checkbuffer(L, 1)->size));
+    return 1;
+}
+
+// the lua string is made on first use and kept in the user value
+static int ltostring(lua_State *L) {
+    shared_buffer *b = checkbuffer(L, 1);
+    if (lua_getiuservalue(L, 1, 1) == LUA_TSTRING) {
+        return 1;
+    }
+    lua_pop(L, 1);
+    lua_pushlstring(L, b->data(), b->size);
+    lua_pushvalue(L, -1);
+    lua_setiuservalue(L, 1, 1);
+    return 1;
+}
+
+static int lgc(lua_State *L) {
+    auto bud = static_cast<buffer_ud *>(lua_touserdata(L, 1));
+    if (bud->b) {
+        buffer_release(bud->b);
+        bud->b = nullptr;
+    }
+    return 0;
+}
+
+void buffer_touserdata(lua_State *L, shared_buffer *b) {
+    auto bud = static_cast<buffer_ud *>(lua_newuserdatauv(L, sizeof(buffer_ud), 1));
+    bud->b = b;
+    if (luaL_newmetatable(L, "buffer")) {
+        lua_pushboolean(L, 1);
+        lua_rawsetp(L, -2, BUFFER_TAG);
+
+        luaL_Reg l[] = {
+            {"tostring", ltostring},
+            {"len", llen},
+            {nullptr, nullptr},
+        };
+        luaL_newlib(L, l);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, ltostring);
+        lua_setfield(L, -2, "__tostring");
+        lua_pushcfunction(L, llen);
+        lua_setfield(L, -2, "__len");
+        lua_pushcfunction(L, lgc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+}
+
+shared_buffer *buffer_fromuserdata(lua_State *L, int index) {
+    if (lua_type(L, index) != LUA_TUSERDATA) {
+        return nullptr;
+    }
+    if (lua_getmetatable(L, index)) {
+        lua_rawgetp(L, -1, BUFFER_TAG);
+        if (lua_toboolean(L, -1)) {
+            lua_pop(L, 2);
+            return static_cast<buffer_ud *>(lua_touserdata(L, index))->b;
+        }
+        lua_pop(L, 2);
+    }
+    return nullptr;
+}
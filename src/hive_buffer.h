@@ -0,0 +1,23 @@
+#ifndef hive_buffer_h
+#define hive_buffer_h
+
+#include <cstddef>
+
+#include "lua.hpp"
+
+// Immutable refcounted bytes, passed between cells and sockets by pointer.
+struct shared_buffer;
+
+// data may be null, the creator then fills buffer_writable(b) before
+// sharing b
+shared_buffer *buffer_new(const char *data, std::size_t sz);
+char *buffer_writable(shared_buffer *b);
+void buffer_grab(shared_buffer *b);
+void buffer_release(shared_buffer *b);
+const char *buffer_data(shared_buffer *b);
+std::size_t buffer_size(shared_buffer *b);
+// push a "buffer" userdata that owns one reference of b
+void buffer_touserdata(lua_State *L, shared_buffer *b);
+shared_buffer *buffer_fromuserdata(lua_State *L, int index);
+
+#endif
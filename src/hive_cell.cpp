@@ -1,18 +1,27 @@
 #include "hive_cell.h"
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <mutex>
-#include <queue>
+#include <thread>
 
 #include "hive_cell_lib.h"
+#include "hive_codecache.h"
 #include "hive_env.h"
+#include "hive_http_lib.h"
 #include "hive_log.h"
+#include "hive_memory.h"
+#include "hive_network.h"
 #include "hive_scheduler.h"
 #include "hive_seri.h"
 #include "hive_socket_lib.h"
 #include "hive_system_lib.h"
+#include "hive_websocket_lib.h"
+#include "mpsc_queue.h"
 
 struct message {
     int type{-1};
@@ -25,45 +34,73 @@ struct message {
 static std::atomic<int> __cell_id{1};
 
 struct cell {
-    std::mutex mut;
     std::atomic<int> ref{0};
     lua_State *L{nullptr};
-    std::queue<message> mq;
+    mpsc_queue<message> mq;
+    std::atomic<int> mq_size{0};
     global_queue *gmq{nullptr};
-    bool in_gmq{true};
+    // true while the cell sits in a run queue or a worker dispatches it
+    std::atomic<bool> in_gmq{true};
     bool single_thread{false};
-    bool close{false};
+    // dispatched on a network thread (the socket cell)
+    bool network{false};
+    std::atomic<bool> close{false};
+    // cell_send calls between the close check and the push
+    std::atomic<int> sending{0};
     int id{__cell_id.fetch_add(1)};
-    int message_count{0};
-
-    void lock() { mut.lock(); }
-
-    void unlock() { mut.unlock(); }
+    std::atomic<int> message_count{0};
+    // the allocator account of L, it outlives L for cell:memory()
+    cell_memory *mem{nullptr};
+    // the dedicated thread of a single thread cell waits here while idle
+    std::mutex wait_mut;
+    std::condition_variable wait_cv;
 
     void push_in_gmq() {
-        if (!single_thread && !in_gmq) {
+        if (in_gmq.exchange(true)) {
+            return;
+        }
+        if (single_thread) {
+            // under the lock, or the wakeup could fall between the check
+            // in cell_wait and its wait
+            std::lock_guard<std::mutex> lock(wait_mut);
+            wait_cv.notify_one();
+        } else if (network) {
+            network_dispatch(this);
+        } else {
             globalmq_push(gmq, this);
-            in_gmq = true;
         }
     }
 
-    void pop_out_gmq() { in_gmq = false; }
+    void pop_out_gmq() { in_gmq.store(false); }
 
     void push(int type, void *buffer) {
-        mq.emplace(type, buffer);
+        mq.push(message(type, buffer));
+        mq_size.fetch_add(1, std::memory_order_relaxed);
         push_in_gmq();
     }
 
-    bool pop(message *m) {
-        if (mq.empty()) {
-            pop_out_gmq();
+    // pop without giving up the run queue slot
+    bool pop_raw(message *m) {
+        if (!mq.pop(*m)) {
             return false;
         }
-        *m = std::move(mq.front());
-        mq.pop();
+        mq_size.fetch_sub(1, std::memory_order_relaxed);
         return true;
     }
 
+    bool pop(message *m) {
+        if (pop_raw(m)) {
+            return true;
+        }
+        pop_out_gmq();
+        // a producer may have pushed (or cell_close run) after the
+        // failed pop but before in_gmq was cleared, take the cell back
+        if (!mq.empty() || close.load()) {
+            push_in_gmq();
+        }
+        return false;
+    }
+
     ~cell() {
         assert(ref.load() == 0);
         assert(L == nullptr);
@@ -80,6 +117,7 @@ static int __cell = 0;
 cell *cell_alloc(lua_State *L) {
     cell *c = new cell;
     c->L = L;
+    c->mem = memory_grab(L, c->id);
     hive_getenv(L, "message_queue");
     c->gmq = static_cast<global_queue *>(lua_touserdata(L, -1));
     lua_pop(L, 1);
@@ -89,6 +127,10 @@ cell *cell_alloc(lua_State *L) {
 static void require_socket(lua_State *L) {
     luaL_requiref(L, "cell.c.socket", socket_lib, 0);
     lua_pop(L, 1);
+    luaL_requiref(L, "cell.c.http", http_lib, 0);
+    lua_pop(L, 1);
+    luaL_requiref(L, "cell.c.websocket", websocket_lib, 0);
+    lua_pop(L, 1);
 }
 
 static void require_cell(lua_State *L, cell *c,
@@ -190,7 +232,7 @@ static cell *init_cell(lua_State *L, cell *c, const char *mainfile,
                        const char *loaderfile) {
     int err = 0;
     if (loaderfile != nullptr) {
-        err = luaL_loadfile(L, loaderfile);
+        err = codecache_loadfile(L, loaderfile);
         if (err) {
             luaL_error(L, "%d : %s\n", err, lua_tostring(L, -1));
         }
@@ -202,7 +244,7 @@ static cell *init_cell(lua_State *L, cell *c, const char *mainfile,
         }
     }
 
-    err = luaL_loadfile(L, mainfile);
+    err = codecache_loadfile(L, mainfile);
     if (err) {
         luaL_error(L, "%d : %s\n", err, lua_tostring(L, -1));
     }
@@ -253,7 +295,7 @@ cell *cell_socket(lua_State *L, cell *sys, cell *logger,
     require_socket(L);
 
     cell *c = cell_alloc(L);
-    c->single_thread = true;
+    c->network = true;
 
     require_cell(L, c, [sys, logger](lua_State *L, int cell_map) {
         cell_touserdata(L, cell_map, sys);
@@ -292,7 +334,7 @@ cell *cell_sys(lua_State *L, cell *sys, cell *socket, cell *logger,
     return init_cell(L, sys, systemfile, loaderfile);
 }
 
-cell *cell_new(lua_State *L, const char *mainfile, const char *loaderfile) {
+static cell *require_new(lua_State *L) {
     require_socket(L);
 
     cell *c = cell_alloc(L);
@@ -320,76 +362,179 @@ cell *cell_new(lua_State *L, const char *mainfile, const char *loaderfile) {
         lua_setfield(L, -2, "config");
     });
 
+    return c;
+}
+
+cell *cell_new(lua_State *L, const char *mainfile, const char *loaderfile) {
+    cell *c = require_new(L);
     return init_cell(L, c, mainfile, loaderfile);
 }
 
+static int lprepare(lua_State *L) {
+    auto loaderfile = static_cast<const char *>(lua_touserdata(L, 1));
+    lua_settop(L, 0);
+    require_new(L);
+    if (loaderfile != nullptr) {
+        if (codecache_loadfile(L, loaderfile) != LUA_OK) {
+            return lua_error(L);
+        }
+        lua_call(L, 0, 0);
+    }
+    // cell.lua is what every main file requires first
+    lua_getglobal(L, "require");
+    lua_pushliteral(L, "cell");
+    lua_call(L, 1, 0);
+    return 0;
+}
+
+cell *cell_prepare(lua_State *L, const char *loaderfile) {
+    lua_pushcfunction(L, lprepare);
+    lua_pushlightuserdata(L, const_cast<char *>(loaderfile));
+    if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+        log_error("prepare cell error : %s", lua_tostring(L, -1));
+        cell_discard(L);
+        return nullptr;
+    }
+    hive_getenv(L, "cell_pointer");
+    auto c = static_cast<cell *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    return c;
+}
+
+cell *cell_start(lua_State *L, const char *mainfile) {
+    hive_getenv(L, "cell_pointer");
+    auto c = static_cast<cell *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    return init_cell(L, c, mainfile, nullptr);
+}
+
+void cell_discard(lua_State *L) {
+    hive_getenv(L, "cell_pointer");
+    auto c = static_cast<cell *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    if (c == nullptr) {
+        scheduler_deletetask(L);
+        return;
+    }
+    c->L = nullptr;
+    cell_grab(c);
+    // the cell was never counted, balance the globalmq_dec of cell_release
+    globalmq_inc(c->gmq);
+    scheduler_deletetask(L);
+    cell_release(c);
+}
+
 void cell_close(cell *c) {
-    c->lock();
-    if (!c->close) {
-        c->close = true;
+    if (!c->close.exchange(true)) {
         c->push_in_gmq();
     }
-    c->unlock();
 }
 
-static void _dispatch(lua_State *L, message *m) {
+// the dispatcher catches the errors of the message handlers, what gets out
+// is the dispatcher itself failing, out of memory over the cell's limit
+static bool _dispatch(lua_State *L, cell *c, message *m) {
     lua_pushvalue(L, 1);
     lua_pushinteger(L, m->type);
     lua_pushlightuserdata(L, m->buffer);
-    lua_call(L, 2, 0);
+    int err = lua_pcall(L, 2, 0, 0);
+    if (err) {
+        log_error("[cell id %d] dispatch failed, err_code = %d, err = %s",
+                  c->id, err, lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return false;
+    }
+    return true;
 }
 
 static void trash_msg(lua_State *L, cell *c) {
-    // no new message in , because already set c->close
-    // don't need lock c later
+    // no new message in, because c->close is set and the senders drained
     message m;
-    while (c->pop(&m)) {
-        _dispatch(L, &m);
+    while (c->pop_raw(&m)) {
+        _dispatch(L, c, &m);
     }
     // HIVE_PORT 5 : exit
     // read cell.lua
     m.type = 5;
     m.buffer = nullptr;
-    _dispatch(L, &m);
+    _dispatch(L, c, &m);
+}
+
+static void close_cell(cell *c, lua_State *L) {
+    c->L = nullptr;
+    cell_grab(c);
+    // a sender that saw close == false may still be pushing
+    while (c->sending.load() > 0) {
+        std::this_thread::yield();
+    }
+    c->pop_out_gmq();
+    trash_msg(L, c);
+    cell_release(c);
+    scheduler_deletetask(L);
+}
+
+void cell_wait(cell *c, int ms) {
+    std::unique_lock<std::mutex> lock(c->wait_mut);
+    c->wait_cv.wait_for(lock, std::chrono::milliseconds(ms),
+                        [c]() { return c->in_gmq.load(); });
 }
 
 bool cell_dispatch_message(cell *c) {
-    c->lock();
+    return cell_dispatch_batch(c, -1, 0) > 0;
+}
+
+int cell_dispatch_batch(cell *c, int weight, int budget) {
     lua_State *L = c->L;
-    if (c->close && L) {
-        c->L = nullptr;
-        cell_grab(c);
-        c->pop_out_gmq();
-        c->unlock();
-        trash_msg(L, c);
-        cell_release(c);
-        scheduler_deletetask(L);
-        return false;
+    if (L == nullptr) {
+        return 0;
+    }
+    if (c->close.load()) {
+        close_cell(c, L);
+        return 0;
     }
 
     message m;
-    if (!c->pop(&m) || L == nullptr) {
-        c->unlock();
-        return false;
+    if (!c->pop(&m)) {
+        return 0;
     }
 
+    // weight < 0 : one message, else mq length >> weight
+    int n = 1;
+    if (weight >= 0) {
+        n = std::max(1, (c->mq_size.load(std::memory_order_relaxed) + 1) >>
+                            weight);
+    }
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::microseconds(budget);
+    int total = 0;
     cell_grab(c);
-    ++c->message_count;
-    c->unlock();
-    _dispatch(L, &m);
+    for (;;) {
+        c->message_count.fetch_add(1, std::memory_order_relaxed);
+        ++total;
+        if (!_dispatch(L, c, &m)) {
+            // the state can't be trusted to go on, only this cell goes
+            cell_close(c);
+            break;
+        }
+        // pop_raw keeps in_gmq set, the cell stays owned by this worker
+        // and the next turn gives it up if the mailbox is empty
+        if (total >= n ||
+            (budget > 0 && std::chrono::steady_clock::now() >= deadline) ||
+            c->close.load() || !c->pop_raw(&m)) {
+            break;
+        }
+    }
     cell_release(c);
-
-    return true;
+    return total;
 }
 
 int cell_send(cell *c, int type, void *msg) {
-    c->lock();
-    if (c->close) {
-        c->unlock();
+    c->sending.fetch_add(1);
+    if (c->close.load()) {
+        c->sending.fetch_sub(1);
         return 1;
     }
     c->push(type, msg);
-    c->unlock();
+    c->sending.fetch_sub(1);
     return 0;
 }
 
@@ -411,27 +556,29 @@ static int lrelease(lua_State *L) {
 static int lmqlen(lua_State *L) {
     auto cud = static_cast<cell_ud *>(luaL_checkudata(L, 1, "cell"));
     luaL_argcheck(L, cud != nullptr, 1, "cell expected");
-    cud->c->lock();
-    lua_pushinteger(L, cud->c->mq.size());
-    cud->c->unlock();
+    lua_pushinteger(L, cud->c->mq_size.load(std::memory_order_relaxed));
     return 1;
 }
 
 static int lmessage(lua_State *L) {
     auto cud = static_cast<cell_ud *>(luaL_checkudata(L, 1, "cell"));
     luaL_argcheck(L, cud != nullptr, 1, "cell expected");
-    cud->c->lock();
-    lua_pushinteger(L, cud->c->message_count);
-    cud->c->unlock();
+    lua_pushinteger(L,
+                    cud->c->message_count.load(std::memory_order_relaxed));
+    return 1;
+}
+
+static int lmemory(lua_State *L) {
+    auto cud = static_cast<cell_ud *>(luaL_checkudata(L, 1, "cell"));
+    luaL_argcheck(L, cud != nullptr, 1, "cell expected");
+    lua_pushinteger(L, static_cast<lua_Integer>(memory_used(cud->c->mem)));
     return 1;
 }
 
 static int lid(lua_State *L) {
     auto cud = static_cast<cell_ud *>(luaL_checkudata(L, 1, "cell"));
     luaL_argcheck(L, cud != nullptr, 1, "cell expected");
-    cud->c->lock();
     lua_pushinteger(L, cud->c->id);
-    cud->c->unlock();
     return 1;
 }
 
@@ -451,6 +598,7 @@ void cell_touserdata(lua_State *L, int index, cell *c) {
         luaL_Reg l[] = {
             {"mqlen", lmqlen},
             {"message", lmessage},
+            {"memory", lmemory},
             {"id", lid},
             {nullptr, nullptr},
         };
@@ -485,11 +633,15 @@ cell *cell_fromuserdata(lua_State *L, int index) {
 void cell_grab(cell *c) { c->ref.fetch_add(1); }
 
 void cell_release(cell *c) {
-    c->ref.fetch_sub(1);
-    if (c->ref.load() == 0) {
+    if (c->ref.fetch_sub(1) == 1) {
         globalmq_dec(c->gmq);
-        scheduler_deletetask(c->L);
-        c->L = nullptr;
+        // close_cell has already closed L when a killed cell is released
+        // by the last cell_ud collected in another state
+        if (c->L) {
+            scheduler_deletetask(c->L);
+            c->L = nullptr;
+        }
+        memory_release(c->mem);
         delete c;
     }
 }
\ No newline at end of file
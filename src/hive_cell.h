@@ -16,8 +16,16 @@ cell *cell_sys(lua_State *L, cell *sys, cell *socket, cell *logger,
                const char *loggerfile, const char *mainfile,
                const char *loaderfile);
 cell *cell_new(lua_State *L, const char *mainfile, const char *loaderfile);
+// run the loader and cell.lua ahead of launch, nullptr on error
+cell *cell_prepare(lua_State *L, const char *loaderfile);
+// run mainfile in a state set up by cell_prepare
+cell *cell_start(lua_State *L, const char *mainfile);
+void cell_discard(lua_State *L);
 void cell_close(cell *c);
 bool cell_dispatch_message(cell *c);
+// on the thread of a single thread cell, until cell_send wakes it or ms pass
+void cell_wait(cell *c, int ms);
+int cell_dispatch_batch(cell *c, int weight, int budget);
 int cell_send(cell *c, int type, void *msg);
 void cell_touserdata(lua_State *L, int index, cell *c);
 cell *cell_fromuserdata(lua_State *L, int index);
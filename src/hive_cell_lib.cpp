@@ -1,8 +1,13 @@
 #include "hive_cell_lib.h"
+#include "hive_buffer.h"
 #include "hive_cell.h"
+#include "hive_codecache.h"
 #include "hive_env.h"
 #include "hive_log.h"
+#include "hive_memory.h"
+#include "hive_scheduler.h"
 #include "hive_seri.h"
+#include "hive_timer.h"
 
 #include <chrono>
 
@@ -46,6 +51,21 @@ static int lsend(lua_State *L) {
     return 1;
 }
 
+static int ltimeout(lua_State *L) {
+    lua_Integer ti = luaL_checkinteger(L, 1);
+    lua_Integer event = luaL_checkinteger(L, 2);
+    hive_getenv(L, "cell_pointer");
+    auto c = static_cast<cell *>(lua_touserdata(L, -1));
+    hive_getenv(L, "timer_pointer");
+    auto tw = static_cast<timewheel *>(lua_touserdata(L, -1));
+    lua_pop(L, 2);
+    if (c == nullptr || tw == nullptr) {
+        return luaL_error(L, "Timer is not ready");
+    }
+    timewheel_add(tw, c, ti, event);
+    return 0;
+}
+
 static int ltime(lua_State *L) {
     auto time_now = std::chrono::system_clock::now();
     auto duration_in_ms = std::chrono::duration_cast<std::chrono::microseconds>(
@@ -54,12 +74,49 @@ static int ltime(lua_State *L) {
     return 1;
 }
 
+static int lmemory(lua_State *L) {
+    cell_memory *m = memory_state(L);
+    lua_pushinteger(L, static_cast<lua_Integer>(memory_used(m)));
+    lua_pushinteger(L, static_cast<lua_Integer>(memory_limit(m)));
+    return 2;
+}
+
+static int lmemlimit(lua_State *L) {
+    lua_Integer limit = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, limit >= 0, 1, "limit must be >= 0");
+    memory_setlimit(memory_state(L), static_cast<std::size_t>(limit));
+    return 0;
+}
+
+static int lbuffer(lua_State *L) {
+    std::size_t sz = 0;
+    const char *str = luaL_checklstring(L, 1, &sz);
+    shared_buffer *b = buffer_new(str, sz);
+    if (b == nullptr) {
+        return luaL_error(L, "not enough memory");
+    }
+    buffer_touserdata(L, b);
+    return 1;
+}
+
+// the pooled states loaded the old files too, they go with the cache
+static int lclearcache(lua_State *L) {
+    lua_pushinteger(L, codecache_clear());
+    lua_pushinteger(L, scheduler_clearpool(L));
+    return 2;
+}
+
 int cell_lib(lua_State *L) {
     luaL_checkversion(L);
     luaL_Reg l[] = {
         {"dispatch", ldispatch},
         {"send", lsend},
+        {"timeout", ltimeout},
         {"time", ltime},
+        {"clearcache", lclearcache},
+        {"buffer", lbuffer},
+        {"memory", lmemory},
+        {"memlimit", lmemlimit},
         {nullptr, nullptr},
     };
     luaL_newlib(L, l);
@@ -0,0 +1,91 @@
+#include "hive_codecache.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Chunks are kept as lua_dump output, loading one skips the parser but
+// every lua_State still builds its own prototypes from it.
+using chunk = std::shared_ptr<const std::string>;
+
+static std::mutex cache_mut;
+static std::unordered_map<std::string, chunk> cache;
+static std::atomic<bool> cache_on{false};
+
+static int writer(lua_State *, const void *p, size_t sz, void *ud) {
+    static_cast<std::string *>(ud)->append(static_cast<const char *>(p), sz);
+    return 0;
+}
+
+static chunk find(const char *filename) {
+    std::lock_guard<std::mutex> lock(cache_mut);
+    auto it = cache.find(filename);
+    if (it == cache.end()) {
+        return chunk();
+    }
+    return it->second;
+}
+
+void codecache_mode(bool on) { cache_on.store(on); }
+
+int codecache_loadfile(lua_State *L, const char *filename) {
+    if (!cache_on.load()) {
+        return luaL_loadfile(L, filename);
+    }
+    chunk code = find(filename);
+    if (code) {
+        return luaL_loadbufferx(L, code->data(), code->size(), filename, "b");
+    }
+
+    int err = luaL_loadfile(L, filename);
+    if (err != LUA_OK) {
+        return err;
+    }
+    // keep the debug info, tracebacks still name the source file
+    auto dump = std::make_shared<std::string>();
+    lua_dump(L, writer, dump.get(), 0);
+    std::lock_guard<std::mutex> lock(cache_mut);
+    // first one wins when several cells compile the same file
+    cache.emplace(filename, std::move(dump));
+    return LUA_OK;
+}
+
+static int lsearcher(lua_State *L) {
+    const char *name = luaL_checkstring(L, 1);
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchpath");  // package searchpath
+    lua_pushvalue(L, 1);
+    lua_getfield(L, -3, "path");
+    if (!lua_isstring(L, -1)) {
+        return luaL_error(L, "'package.path' must be a string");
+    }
+    lua_call(L, 2, 2);  // package filename err
+    if (lua_isnil(L, -2)) {
+        return 1;
+    }
+    lua_pop(L, 1);
+    const char *filename = lua_tostring(L, -1);
+    if (codecache_loadfile(L, filename) != LUA_OK) {
+        return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+                          name, filename, lua_tostring(L, -1));
+    }
+    lua_pushvalue(L, -2);  // package filename loader filename
+    return 2;
+}
+
+void codecache_searcher(lua_State *L) {
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchers");
+    lua_pushcfunction(L, lsearcher);
+    lua_rawseti(L, -2, 2);
+    lua_pop(L, 2);
+}
+
+int codecache_clear() {
+    std::lock_guard<std::mutex> lock(cache_mut);
+    int n = static_cast<int>(cache.size());
+    cache.clear();
+    return n;
+}
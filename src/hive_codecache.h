@@ -0,0 +1,17 @@
+#ifndef hive_codecache_h
+#define hive_codecache_h
+
+#include "lua.hpp"
+
+// Process-wide cache of compiled lua chunks, shared by every cell. Off
+// unless the config sets codecache = true, an edited file then only takes
+// effect after clearcache.
+void codecache_mode(bool on);
+// luaL_loadfile, compiled once per path and loaded as bytecode afterwards
+int codecache_loadfile(lua_State *L, const char *filename);
+// put the cached lua searcher in place of package.searchers[2]
+void codecache_searcher(lua_State *L);
+// drop every cached chunk, return the number dropped
+int codecache_clear();
+
+#endif
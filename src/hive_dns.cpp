@@ -0,0 +1,150 @@
+#include "hive_dns.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "asio/ip/tcp.hpp"
+#include "asio/post.hpp"
+
+// getaddrinfo tells no ttl, an answer is kept this long
+static const std::chrono::milliseconds DNS_TTL(60 * 1000);
+// and a failure this long, so a dead name doesn't keep the resolver busy
+static const std::chrono::milliseconds DNS_NEGATIVE_TTL(5 * 1000);
+// expired entries are swept once the cache holds this many
+static const std::size_t DNS_SWEEP_SIZE = 1024;
+
+using dns_clock = std::chrono::steady_clock;
+
+struct dns_waiter {
+    asio::any_io_executor ex;
+    dns_handler handler;
+};
+
+struct dns_entry {
+    std::error_code ec;
+    std::vector<asio::ip::address> addrs;
+    dns_clock::time_point expires;
+    bool pending{false};
+    std::vector<dns_waiter> waiters;
+};
+
+static std::mutex mut;
+static std::unordered_map<std::string, dns_entry> cache;
+static dns_stats stats{};
+static double total_ms = 0;
+
+static void _answer(const asio::any_io_executor &ex, dns_handler handler,
+                    const std::error_code &ec,
+                    const std::vector<asio::ip::address> &addrs) {
+    asio::post(ex, [handler, ec, addrs]() { handler(ec, addrs); });
+}
+
+static void _sweep(dns_clock::time_point now) {
+    for (auto it = cache.begin(); it != cache.end();) {
+        if (!it->second.pending && it->second.expires <= now) {
+            it = cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+static void _done(const std::string &host, dns_clock::time_point start,
+                  std::error_code ec,
+                  const asio::ip::tcp::resolver::results_type &results) {
+    std::vector<asio::ip::address> addrs;
+    if (!ec) {
+        for (const auto &r : results) {
+            asio::ip::address a = r.endpoint().address();
+            bool seen = false;
+            for (const auto &b : addrs) {
+                seen = seen || a == b;
+            }
+            if (!seen) {
+                addrs.push_back(a);
+            }
+        }
+        if (addrs.empty()) {
+            ec = asio::error::host_not_found;
+        }
+    }
+
+    dns_clock::time_point now = dns_clock::now();
+    double ms =
+        std::chrono::duration<double, std::milli>(now - start).count();
+    std::vector<dns_waiter> waiters;
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        dns_entry &e = cache[host];
+        e.pending = false;
+        e.ec = ec;
+        e.addrs = addrs;
+        e.expires = now + (ec ? DNS_NEGATIVE_TTL : DNS_TTL);
+        waiters.swap(e.waiters);
+        --stats.pending;
+        if (ec) {
+            ++stats.failures;
+        }
+        total_ms += ms;
+        if (ms > stats.max_ms) {
+            stats.max_ms = ms;
+        }
+    }
+    for (auto &w : waiters) {
+        _answer(w.ex, std::move(w.handler), ec, addrs);
+    }
+}
+
+void dns_resolve(const asio::any_io_executor &ex, const std::string &host,
+                 dns_handler handler) {
+    std::error_code ec;
+    asio::ip::address literal = asio::ip::make_address(host, ec);
+    if (!ec) {
+        _answer(ex, std::move(handler), ec,
+                std::vector<asio::ip::address>{literal});
+        return;
+    }
+
+    dns_clock::time_point now = dns_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        if (cache.size() >= DNS_SWEEP_SIZE) {
+            _sweep(now);
+        }
+        dns_entry &e = cache[host];
+        if (e.pending) {
+            ++stats.hits;
+            e.waiters.push_back(dns_waiter{ex, std::move(handler)});
+            return;
+        }
+        if (e.expires > now) {
+            ++stats.hits;
+            _answer(ex, std::move(handler), e.ec, e.addrs);
+            return;
+        }
+        e.pending = true;
+        e.waiters.push_back(dns_waiter{ex, std::move(handler)});
+        ++stats.lookups;
+        ++stats.pending;
+    }
+
+    // asio runs getaddrinfo on a resolver thread of its own
+    auto resolver = std::make_shared<asio::ip::tcp::resolver>(ex);
+    resolver->async_resolve(
+        host, "",
+        [resolver, host, now](
+            const std::error_code &ec,
+            const asio::ip::tcp::resolver::results_type &results) {
+            _done(host, now, ec, results);
+        });
+}
+
+dns_stats dns_get_stats() {
+    std::lock_guard<std::mutex> lock(mut);
+    dns_stats s = stats;
+    s.cached = static_cast<int>(cache.size());
+    s.avg_ms = s.lookups > s.pending ? total_ms / (s.lookups - s.pending) : 0;
+    return s;
+}
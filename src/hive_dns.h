@@ -0,0 +1,38 @@
+#ifndef hive_dns_h
+#define hive_dns_h
+
+#include <functional>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "asio/any_io_executor.hpp"
+#include "asio/ip/address.hpp"
+
+// Host lookups for listen and connect, off the network threads. A literal
+// address needs none, a name goes to asio's resolver thread and its answer,
+// good or bad, is cached for a while. Lookups of a name already on its way
+// wait for that one.
+using dns_handler = std::function<void(
+    const std::error_code &ec, const std::vector<asio::ip::address> &addrs)>;
+
+// handler runs on ex, addrs is not empty unless ec is set
+void dns_resolve(const asio::any_io_executor &ex, const std::string &host,
+                 dns_handler handler);
+
+struct dns_stats {
+    // queries sent to the resolver
+    long long lookups;
+    long long failures;
+    // answered from the cache or by a query on its way
+    long long hits;
+    int cached;
+    int pending;
+    // milliseconds per query
+    double avg_ms;
+    double max_ms;
+};
+
+dns_stats dns_get_stats();
+
+#endif
@@ -0,0 +1,402 @@
+#include "hive_http_lib.h"
+
+#include <cstring>
+
+#include "asio_buffer.h"
+
+// Parses http/1.x heads, chunk sizes and trailers off the front of a socket
+// read buffer, in place when the first block holds them. Each returns what
+// it read and drops it from the buffer, or nil and the bytes buffered when
+// it needs more, or false and the status to answer when they are malformed.
+
+// heads longer than this are refused unless a limit is given
+static const lua_Integer HTTP_HEAD_LIMIT = 8192;
+// a chunk size line, extensions included
+static const std::size_t HTTP_CHUNK_LINE = 128;
+// longest header name
+static const std::size_t HTTP_NAME_MAX = 256;
+
+static bool _tchar(unsigned char c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9')) {
+        return true;
+    }
+    return c != 0 && strchr("!#$%&'*+-.^_`|~", c) != nullptr;
+}
+
+static bool _digit(char c) { return c >= '0' && c <= '9'; }
+
+static int _hex(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// byte i of the buffer, -1 past its end
+static int _byte(read_buffer *buffer, std::size_t i) {
+    for (r_block *b = buffer->head; b != nullptr; b = b->next) {
+        std::size_t n = b->len - b->ptr;
+        if (i < n) {
+            return static_cast<unsigned char>(b->data[b->ptr + i]);
+        }
+        i -= n;
+    }
+    return -1;
+}
+
+// the first size bytes in one piece, copied to a userdata left on the
+// stack when they run past the first block
+static const char *_contiguous(lua_State *L, read_buffer *buffer,
+                               std::size_t size) {
+    r_block *b = buffer->head;
+    if (size <= b->len - b->ptr) {
+        return b->data + b->ptr;
+    }
+    char *p = static_cast<char *>(lua_newuserdatauv(L, size, 0));
+    char *out = p;
+    while (size > 0) {
+        std::size_t n = b->len - b->ptr;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(out, b->data + b->ptr, n);
+        out += n;
+        size -= n;
+        b = b->next;
+    }
+    return p;
+}
+
+static int _more(lua_State *L, read_buffer *buffer) {
+    lua_pushnil(L);
+    lua_pushinteger(L, buffer ? static_cast<lua_Integer>(buffer->len) : 0);
+    return 2;
+}
+
+static int _bad(lua_State *L, int status) {
+    lua_pushboolean(L, 0);
+    lua_pushinteger(L, status);
+    return 2;
+}
+
+// offset past the blank line ending the head, 0 when it is not all here
+static std::size_t _head_size(read_buffer *buffer) {
+    std::size_t i = buffer->find("\r\n\r\n", 4);
+    return i == read_buffer::npos ? 0 : i + 4;
+}
+
+// a value more of a header already in t, two of them make a list
+static void _add(lua_State *L, int t, const char *name, const char *value,
+                 std::size_t sz) {
+    int type = lua_getfield(L, t, name);
+    if (type == LUA_TNIL) {
+        lua_pop(L, 1);
+        lua_pushlstring(L, value, sz);
+        lua_setfield(L, t, name);
+    } else if (type == LUA_TTABLE) {
+        lua_pushlstring(L, value, sz);
+        lua_rawseti(L, -2, static_cast<lua_Integer>(lua_rawlen(L, -2)) + 1);
+        lua_pop(L, 1);
+    } else {
+        lua_createtable(L, 2, 0);
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, 1);
+        lua_pushlstring(L, value, sz);
+        lua_rawseti(L, -2, 2);
+        lua_setfield(L, t, name);
+    }
+}
+
+// a folded line goes on the last value of the header
+static void _fold(lua_State *L, int t, const char *name, const char *value,
+                  std::size_t sz) {
+    if (lua_getfield(L, t, name) == LUA_TTABLE) {
+        lua_Integer n = static_cast<lua_Integer>(lua_rawlen(L, -1));
+        lua_rawgeti(L, -1, n);
+        lua_pushlstring(L, value, sz);
+        lua_concat(L, 2);
+        lua_rawseti(L, -2, n);
+        lua_pop(L, 1);
+    } else {
+        lua_pushlstring(L, value, sz);
+        lua_concat(L, 2);
+        lua_setfield(L, t, name);
+    }
+}
+
+// the header lines from p to the blank line ending at end, into the table
+// at t with lower case names
+static bool _fields(lua_State *L, int t, const char *p, const char *end) {
+    char name[HTTP_NAME_MAX + 1];
+    std::size_t name_len = 0;
+    for (;;) {
+        // the head ends with a blank line, a line end is always found
+        const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (eol == p || eol[-1] != '\r') {
+            return false;
+        }
+        const char *line_end = eol - 1;
+        if (line_end == p) {
+            return eol + 1 == end;
+        }
+        if (*p == ' ' || *p == '\t') {
+            if (name_len == 0) {
+                return false;
+            }
+            _fold(L, t, name, p + 1, line_end - p - 1);
+            p = eol + 1;
+            continue;
+        }
+
+        const char *n = p;
+        while (p < line_end && _tchar(static_cast<unsigned char>(*p))) {
+            ++p;
+        }
+        name_len = p - n;
+        if (name_len == 0 || name_len > HTTP_NAME_MAX || p == line_end ||
+            *p != ':') {
+            return false;
+        }
+        for (std::size_t i = 0; i < name_len; i++) {
+            char c = n[i];
+            name[i] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+        }
+        name[name_len] = '\0';
+
+        const char *v = p + 1;
+        while (v < line_end && (*v == ' ' || *v == '\t')) {
+            ++v;
+        }
+        const char *v_end = line_end;
+        while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) {
+            --v_end;
+        }
+        _add(L, t, name, v, v_end - v);
+        p = eol + 1;
+    }
+}
+
+// HTTP/d.d at p, the version or 0 when it is not one
+static lua_Number _version(const char *p) {
+    if (memcmp(p, "HTTP/", 5) != 0 || !_digit(p[5]) || p[6] != '.' ||
+        !_digit(p[7])) {
+        return 0;
+    }
+    return (p[5] - '0') + (p[7] - '0') / 10.0;
+}
+
+// empty lines before a request are skipped
+static void _skip_crlf(read_buffer *buffer) {
+    while (_byte(buffer, 0) == '\r' && _byte(buffer, 1) == '\n') {
+        buffer->skip(2);
+    }
+}
+
+// buffer [, limit] -> method, target, version, header
+static int lrequest(lua_State *L) {
+    read_buffer *buffer = static_cast<read_buffer *>(lua_touserdata(L, 1));
+    lua_Integer limit = luaL_optinteger(L, 2, HTTP_HEAD_LIMIT);
+    if (buffer == nullptr) {
+        return _more(L, buffer);
+    }
+    _skip_crlf(buffer);
+    std::size_t size = _head_size(buffer);
+    if (size == 0) {
+        if (buffer->len > static_cast<std::size_t>(limit)) {
+            return _bad(L, 413);
+        }
+        return _more(L, buffer);
+    }
+    if (size > static_cast<std::size_t>(limit)) {
+        return _bad(L, 413);
+    }
+
+    const char *head = _contiguous(L, buffer, size);
+    const char *end = head + size;
+    // method SP target SP HTTP/1.x CRLF
+    const char *p = head;
+    while (_tchar(static_cast<unsigned char>(*p))) {
+        ++p;
+    }
+    const char *method_end = p;
+    if (p == head || *p != ' ') {
+        return _bad(L, 400);
+    }
+    const char *target = ++p;
+    while (static_cast<unsigned char>(*p) > ' ' && *p != '\x7f') {
+        ++p;
+    }
+    const char *target_end = p;
+    if (p == target || *p != ' ' || end - ++p < 10) {
+        return _bad(L, 400);
+    }
+    lua_Number version = _version(p);
+    if (version == 0 || p[8] != '\r' || p[9] != '\n') {
+        return _bad(L, 400);
+    }
+    if (version < 1.0 || version > 1.1) {
+        return _bad(L, 505);
+    }
+
+    lua_pushlstring(L, head, method_end - head);
+    lua_pushlstring(L, target, target_end - target);
+    lua_pushnumber(L, version);
+    lua_newtable(L);
+    if (!_fields(L, lua_gettop(L), p + 10, end)) {
+        return _bad(L, 400);
+    }
+    buffer->skip(size);
+    return 4;
+}
+
+// buffer [, limit [, header]] -> status, reason, version, header. The
+// header fields go to the table given
+static int lresponse(lua_State *L) {
+    read_buffer *buffer = static_cast<read_buffer *>(lua_touserdata(L, 1));
+    lua_Integer limit = luaL_optinteger(L, 2, HTTP_HEAD_LIMIT);
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+    if (buffer == nullptr) {
+        return _more(L, buffer);
+    }
+    std::size_t size = _head_size(buffer);
+    if (size == 0) {
+        if (buffer->len > static_cast<std::size_t>(limit)) {
+            return _bad(L, 413);
+        }
+        return _more(L, buffer);
+    }
+    if (size > static_cast<std::size_t>(limit)) {
+        return _bad(L, 413);
+    }
+
+    const char *head = _contiguous(L, buffer, size);
+    const char *end = head + size;
+    // HTTP/1.x SP status [SP reason] CRLF
+    const char *p = head;
+    lua_Number version = end - p >= 14 ? _version(p) : 0;
+    if (version == 0 || p[8] != ' ' || !_digit(p[9]) || !_digit(p[10]) ||
+        !_digit(p[11]) || (p[12] != ' ' && p[12] != '\r')) {
+        return _bad(L, 400);
+    }
+    int status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+    p += 12;
+    if (*p == ' ') {
+        ++p;
+    }
+    const char *reason = p;
+    p = static_cast<const char *>(memchr(p, '\n', end - p));
+    if (p == reason || p[-1] != '\r') {
+        return _bad(L, 400);
+    }
+
+    lua_pushinteger(L, status);
+    lua_pushlstring(L, reason, p - 1 - reason);
+    lua_pushnumber(L, version);
+    if (lua_istable(L, 3)) {
+        lua_pushvalue(L, 3);
+    } else {
+        lua_newtable(L);
+    }
+    if (!_fields(L, lua_gettop(L), p + 1, end)) {
+        return _bad(L, 400);
+    }
+    buffer->skip(size);
+    return 4;
+}
+
+// buffer -> the size of the next chunk, its size line dropped. The chunk
+// and the line end after it are left to read
+static int lchunk(lua_State *L) {
+    read_buffer *buffer = static_cast<read_buffer *>(lua_touserdata(L, 1));
+    if (buffer == nullptr) {
+        return _more(L, buffer);
+    }
+    std::size_t i = buffer->find("\r\n", 2);
+    if (i == read_buffer::npos) {
+        // no endless size lines
+        if (buffer->len > HTTP_CHUNK_LINE) {
+            return _bad(L, 400);
+        }
+        return _more(L, buffer);
+    }
+    if (i == 0 || i > HTTP_CHUNK_LINE) {
+        return _bad(L, 400);
+    }
+
+    const char *line = _contiguous(L, buffer, i);
+    lua_Integer size = 0;
+    std::size_t n = 0;
+    int d;
+    while (n < i && (d = _hex(line[n])) >= 0) {
+        // 15 digits at most, it stays positive
+        if (n == 15) {
+            return _bad(L, 413);
+        }
+        size = size * 16 + d;
+        ++n;
+    }
+    // extensions are ignored
+    if (n == 0 || (n < i && line[n] != ';' && line[n] != ' ' &&
+                   line[n] != '\t')) {
+        return _bad(L, 400);
+    }
+    buffer->skip(i + 2);
+    lua_pushinteger(L, size);
+    return 1;
+}
+
+// buffer, header [, limit] -> header, the trailer after the last chunk
+// added to it
+static int ltrailer(lua_State *L) {
+    read_buffer *buffer = static_cast<read_buffer *>(lua_touserdata(L, 1));
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_Integer limit = luaL_optinteger(L, 3, HTTP_HEAD_LIMIT);
+    if (buffer == nullptr || buffer->len < 2) {
+        return _more(L, buffer);
+    }
+    if (_byte(buffer, 0) == '\r' && _byte(buffer, 1) == '\n') {
+        buffer->skip(2);
+        lua_settop(L, 2);
+        return 1;
+    }
+    std::size_t size = _head_size(buffer);
+    if (size == 0) {
+        if (buffer->len > static_cast<std::size_t>(limit)) {
+            return _bad(L, 413);
+        }
+        return _more(L, buffer);
+    }
+    if (size > static_cast<std::size_t>(limit)) {
+        return _bad(L, 413);
+    }
+
+    const char *head = _contiguous(L, buffer, size);
+    if (!_fields(L, 2, head, head + size)) {
+        return _bad(L, 400);
+    }
+    buffer->skip(size);
+    lua_settop(L, 2);
+    return 1;
+}
+
+int http_lib(lua_State *L) {
+    luaL_checkversion(L);
+    luaL_Reg l[] = {
+        {"request", lrequest},
+        {"response", lresponse},
+        {"chunk", lchunk},
+        {"trailer", ltrailer},
+        {nullptr, nullptr},
+    };
+    luaL_newlib(L, l);
+    return 1;
+}
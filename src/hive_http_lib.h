@@ -0,0 +1,8 @@
+#ifndef hive_http_lib_h
+#define hive_http_lib_h
+
+#include "lua.hpp"
+
+int http_lib(lua_State *L);
+
+#endif
@@ -0,0 +1,165 @@
+#include "hive_memory.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <vector>
+
+#include "hive_log.h"
+
+#if defined(__linux__)
+#include "jemalloc/include/jemalloc/jemalloc.h"
+#endif
+
+struct cell_memory {
+    // written only by the thread running the state, read by anyone
+    std::atomic<std::size_t> used{0};
+    std::atomic<std::size_t> limit{0};
+    std::atomic<int> ref{1};
+    std::atomic<bool> warned{false};
+    int id{0};
+    // jemalloc mallocx flags, 0 : plain malloc
+    int flags{0};
+};
+
+static std::atomic<std::size_t> default_limit{0};
+static std::vector<unsigned> arenas;
+static std::atomic<unsigned> next_arena{0};
+
+void memory_config(int n) {
+#if defined(__linux__)
+    for (int i = 0; i < n; i++) {
+        unsigned index = 0;
+        std::size_t sz = sizeof(index);
+        if (mallctl("arenas.create", &index, &sz, nullptr, 0) != 0) {
+            log_error("create jemalloc arena failed");
+            break;
+        }
+        arenas.push_back(index);
+    }
+#else
+    if (n > 0) {
+        log_error("memory_arena needs jemalloc, ignored");
+    }
+#endif
+}
+
+static void *_realloc(cell_memory *m, void *ptr, std::size_t nsize) {
+#if defined(__linux__)
+    if (m->flags) {
+        if (nsize == 0) {
+            // unlike free, dallocx does not accept nullptr
+            if (ptr) {
+                dallocx(ptr, m->flags);
+            }
+            return nullptr;
+        }
+        if (ptr == nullptr) {
+            return mallocx(nsize, m->flags);
+        }
+        return rallocx(ptr, nsize, m->flags);
+    }
+#endif
+    if (nsize == 0) {
+        free(ptr);
+        return nullptr;
+    }
+    return realloc(ptr, nsize);
+}
+
+static void *lalloc(void *ud, void *ptr, std::size_t osize, std::size_t nsize) {
+    auto m = static_cast<cell_memory *>(ud);
+    if (ptr == nullptr) {
+        // osize is the object type for a new block
+        osize = 0;
+    }
+    std::size_t used = m->used.load(std::memory_order_relaxed);
+    std::size_t limit = m->limit.load(std::memory_order_relaxed);
+    // lua needs shrinking to succeed, only growth may hit the limit
+    if (limit > 0 && nsize > osize && used + nsize - osize > limit) {
+        if (!m->warned.exchange(true)) {
+            log_error("[cell id %d] memory %zu bytes over the limit %zu", m->id,
+                      used + nsize - osize, limit);
+        }
+        return nullptr;
+    }
+    void *ret = _realloc(m, ptr, nsize);
+    if (ret == nullptr && nsize > 0) {
+        return nullptr;
+    }
+    used = used + nsize - osize;
+    m->used.store(used, std::memory_order_relaxed);
+    // warn again once the cell is well under the limit, not on every
+    // emergency collection around it
+    if (limit > 0 && used < limit - limit / 4 &&
+        m->warned.load(std::memory_order_relaxed)) {
+        m->warned.store(false);
+    }
+    return ret;
+}
+
+// what luaL_newstate installs, lua_newstate leaves it empty
+static int panic(lua_State *L) {
+    const char *msg = lua_tostring(L, -1);
+    if (msg == nullptr) {
+        msg = "error object is not a string";
+    }
+    log_error("PANIC: unprotected error in call to Lua API (%s)\n", msg);
+    return 0;
+}
+
+void memory_setdefault(std::size_t limit) { default_limit.store(limit); }
+
+lua_State *memory_newstate() {
+    cell_memory *m = new cell_memory;
+    m->limit.store(default_limit.load());
+#if defined(__linux__)
+    if (!arenas.empty()) {
+        unsigned a = arenas[next_arena.fetch_add(1) % arenas.size()];
+        // a thread cache would hand out blocks of other arenas
+        m->flags = MALLOCX_ARENA(a) | MALLOCX_TCACHE_NONE;
+    }
+#endif
+    lua_State *L = lua_newstate(lalloc, m);
+    if (L == nullptr) {
+        delete m;
+        return nullptr;
+    }
+    lua_atpanic(L, panic);
+    return L;
+}
+
+void memory_closestate(lua_State *L) {
+    void *ud = nullptr;
+    lua_getallocf(L, &ud);
+    lua_close(L);
+    memory_release(static_cast<cell_memory *>(ud));
+}
+
+cell_memory *memory_state(lua_State *L) {
+    void *ud = nullptr;
+    lua_getallocf(L, &ud);
+    return static_cast<cell_memory *>(ud);
+}
+
+cell_memory *memory_grab(lua_State *L, int id) {
+    cell_memory *m = memory_state(L);
+    m->id = id;
+    m->ref.fetch_add(1);
+    return m;
+}
+
+void memory_release(cell_memory *m) {
+    if (m->ref.fetch_sub(1) == 1) {
+        delete m;
+    }
+}
+
+std::size_t memory_used(cell_memory *m) {
+    return m->used.load(std::memory_order_relaxed);
+}
+
+std::size_t memory_limit(cell_memory *m) { return m->limit.load(); }
+
+void memory_setlimit(cell_memory *m, std::size_t limit) {
+    m->limit.store(limit);
+}
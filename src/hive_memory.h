@@ -0,0 +1,27 @@
+#ifndef hive_memory_h
+#define hive_memory_h
+
+#include <cstddef>
+
+#include "lua.hpp"
+
+// Per lua_State allocator account, shared by the state and its cell.
+struct cell_memory;
+
+// arenas : dedicated jemalloc arenas handed out round robin (0 : the
+// default malloc)
+void memory_config(int arenas);
+// limit for states created from now on in bytes (0 : none), set once the
+// system, logger and socket cells have theirs so they are never capped
+void memory_setdefault(std::size_t limit);
+lua_State *memory_newstate();
+void memory_closestate(lua_State *L);
+cell_memory *memory_state(lua_State *L);
+// id names the cell in the over limit warning
+cell_memory *memory_grab(lua_State *L, int id);
+void memory_release(cell_memory *m);
+std::size_t memory_used(cell_memory *m);
+std::size_t memory_limit(cell_memory *m);
+void memory_setlimit(cell_memory *m, std::size_t limit);
+
+#endif
@@ -0,0 +1,71 @@
+#include "hive_network.h"
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "asio/executor_work_guard.hpp"
+#include "asio/post.hpp"
+#include "hive_cell.h"
+
+using work_guard = asio::executor_work_guard<asio::io_context::executor_type>;
+
+struct shard {
+    asio::io_context context{1};
+    work_guard work{context.get_executor()};
+};
+
+// handlers per network_poll, the caller wakes workers in between
+static const std::size_t POLL_BATCH = 64;
+
+static std::vector<shard *> shards;
+static std::atomic<unsigned int> next_shard{0};
+
+void network_init(int threads) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    for (int i = 0; i < threads; i++) {
+        shards.push_back(new shard);
+    }
+}
+
+void network_release() {
+    // sockets still held by the socket tables close at exit and need their
+    // io_context, so the shards are stopped but never freed
+    for (shard *s : shards) {
+        s->work.reset();
+        s->context.stop();
+    }
+}
+
+int network_threads() { return static_cast<int>(shards.size()); }
+
+asio::io_context &network_context(int index) {
+    return shards[index]->context;
+}
+
+asio::io_context &network_next() {
+    unsigned int n = next_shard.fetch_add(1, std::memory_order_relaxed);
+    return shards[n % shards.size()]->context;
+}
+
+static void _dispatch(cell *c) {
+    // one mailbox length per turn, then the I/O handlers queued meanwhile
+    if (cell_dispatch_batch(c, 0, 0) > 0) {
+        asio::post(shards[0]->context, [c]() { _dispatch(c); });
+    }
+}
+
+void network_dispatch(cell *c) {
+    asio::post(shards[0]->context, [c]() { _dispatch(c); });
+}
+
+std::size_t network_poll(int index, int ms) {
+    asio::io_context &ctx = shards[index]->context;
+    std::size_t n = ctx.run_one_for(std::chrono::milliseconds(ms));
+    while (n > 0 && n < POLL_BATCH && ctx.poll_one() > 0) {
+        ++n;
+    }
+    return n;
+}
@@ -0,0 +1,24 @@
+#ifndef hive_network_h
+#define hive_network_h
+
+#include <cstddef>
+
+#include "asio/io_context.hpp"
+
+// Network I/O shards, one io_context per network thread. A socket lives on
+// the shard it was opened on and every handler of it runs on that thread.
+void network_init(int threads);
+void network_release();
+int network_threads();
+asio::io_context &network_context(int index);
+// the shard for a new socket, round robin
+asio::io_context &network_next();
+// run the handlers of one shard, wait up to ms for the first one
+std::size_t network_poll(int index, int ms);
+
+struct cell;
+// dispatch c on the first shard, called again by cell_send whenever its
+// mailbox goes from empty to non empty
+void network_dispatch(cell *c);
+
+#endif
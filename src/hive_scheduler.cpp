@@ -3,57 +3,209 @@
 #include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cstring>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 
 #include "concurrent_queue.h"
 #include "crash_dump.h"
 #include "hive_cell.h"
+#include "hive_codecache.h"
 #include "hive_env.h"
+#include "hive_memory.h"
 #include "hive_log.h"
+#include "hive_network.h"
 #include "hive_seri.h"
+#include "hive_timer.h"
+#include "mpmc_queue.h"
 
 static const lua_Integer DEFAULT_THREAD = 4;
+static const lua_Integer DEFAULT_NETWORK_THREAD = 1;
+// a network thread checks for shutdown at least this often
+static const int NETWORK_WAIT_MS = 100;
+// an idle system cell thread checks for shutdown this often
+static const int CELL_WAIT_MS = 100;
+static const lua_Integer DEFAULT_WEIGHT = -1;
+static const lua_Integer DEFAULT_QUEUE_SIZE = 65536;
+static const std::size_t LOCAL_QUEUE_SIZE = 256;
+static const unsigned int GLOBAL_POLL_INTERVAL = 61;
+// an idle worker looks at the queues again this often, so a wakeup missed
+// between its last look and its wait only delays a message by as much, and
+// refills the state pool then, not in a burst
+static const int POOL_IDLE_MS = 2;
+
+static const char *TASK_ENV[] = {
+    "message_queue",  "timer_pointer", "system_pointer",
+    "logger_pointer", "config",
+};
+static const int TASK_ENV_SIZE = sizeof(TASK_ENV) / sizeof(TASK_ENV[0]);
+
+// lua states with the loader and cell.lua already run, ready for llaunch
+struct state_pool {
+    std::mutex mut;
+    std::vector<lua_State *> states;
+    int size{0};
+    int filling{0};
+    // bumped by clearcache, a state built before it is dropped
+    int generation{0};
+    std::string path;
+    std::string cpath;
+    bool has_loader{false};
+    std::string loader;
+    void *env[TASK_ENV_SIZE];
+};
 
 struct global_queue {
     std::atomic<int> *total;
     concurrent_queue<cell *> *queue;
+    // optional lock-free ring, the mutex queue above takes the overflow
+    mpmc_queue<cell *> *lockfree;
+    std::atomic<int> *overflow;
+    // per worker run queues, nullptr unless work stealing is enabled
+    mpmc_queue<cell *> **local;
+    // per worker weight, -1 : one message per turn, n >= 0 : mq length >> n
+    int *weight;
+    // microseconds a worker may spend on one cell per turn, 0 : no limit
+    int budget{0};
+    state_pool *pool;
     std::mutex *mutex;
     std::condition_variable *cv;
     int thread{0};
-    int sleep{0};
+    // read without the mutex by the threads waking a worker
+    std::atomic<int> sleep{0};
 };
 
 struct timer {
-    long long current;
-    cell *sys;
+    timewheel *tw;
     global_queue *mq;
 };
 
-void globalmq_push(global_queue *q, cell *c) {
-    assert(c);
+// run queue of the worker running on this thread, nullptr on the system,
+// logger, timer and network threads
+static thread_local mpmc_queue<cell *> *local_queue = nullptr;
+static thread_local int local_index = 0;
+static thread_local unsigned int local_tick = 0;
+
+static void _shared_push(global_queue *q, cell *c) {
+    if (q->lockfree) {
+        if (q->lockfree->push(c)) {
+            return;
+        }
+        q->overflow->fetch_add(1);
+    }
     q->queue->push(c);
 }
 
-cell *globalmq_pop(global_queue *q) {
+static cell *_shared_pop(global_queue *q) {
     cell *c = nullptr;
+    if (q->lockfree) {
+        if (q->lockfree->pop(c)) {
+            return c;
+        }
+        // skip the mutex while nothing has overflowed the ring
+        if (q->overflow->load() <= 0) {
+            return nullptr;
+        }
+        if (q->queue->pop(c)) {
+            q->overflow->fetch_sub(1);
+        }
+        return c;
+    }
     q->queue->pop(c);
     return c;
 }
 
-static void globalmq_init(global_queue *q, int thread) {
+void globalmq_push(global_queue *q, cell *c) {
+    assert(c);
+    if (local_queue && local_queue->push(c)) {
+        if (q->sleep.load() > 0) {
+            // let an idle worker steal it
+            q->cv->notify_one();
+        }
+        return;
+    }
+    _shared_push(q, c);
+    if (q->sleep.load() > 0) {
+        q->cv->notify_one();
+    }
+}
+
+static cell *_steal(global_queue *q) {
+    cell *c = nullptr;
+    for (int i = 1; i < q->thread; i++) {
+        if (q->local[(local_index + i) % q->thread]->pop(c)) {
+            return c;
+        }
+    }
+    return nullptr;
+}
+
+cell *globalmq_pop(global_queue *q) {
+    if (local_queue == nullptr) {
+        return _shared_pop(q);
+    }
+
+    cell *c = nullptr;
+    // look at the shared queue now and then, so cells woken by the socket and
+    // timer threads don't starve behind a busy local queue
+    if (++local_tick % GLOBAL_POLL_INTERVAL == 0) {
+        c = _shared_pop(q);
+        if (c) {
+            return c;
+        }
+    }
+    if (local_queue->pop(c)) {
+        return c;
+    }
+    c = _shared_pop(q);
+    if (c) {
+        return c;
+    }
+    return _steal(q);
+}
+
+static void globalmq_init(global_queue *q, int thread, bool lockfree,
+                          std::size_t queue_size, bool steal,
+                          const std::vector<int> &weight, int budget) {
     q->total = new std::atomic<int>{0};
     q->queue = new concurrent_queue<cell *>{};
+    q->lockfree = lockfree ? new mpmc_queue<cell *>(queue_size) : nullptr;
+    q->overflow = new std::atomic<int>{0};
+    q->local = nullptr;
+    if (steal) {
+        q->local = new mpmc_queue<cell *> *[thread];
+        for (int i = 0; i < thread; i++) {
+            q->local[i] = new mpmc_queue<cell *>(LOCAL_QUEUE_SIZE);
+        }
+    }
+    q->weight = new int[thread];
+    for (int i = 0; i < thread; i++) {
+        q->weight[i] = i < static_cast<int>(weight.size())
+                           ? weight[i]
+                           : static_cast<int>(DEFAULT_WEIGHT);
+    }
+    q->budget = budget;
+    q->pool = nullptr;
     q->mutex = new std::mutex;
     q->cv = new std::condition_variable;
     q->thread = thread;
-    q->sleep = 0;
+    q->sleep.store(0);
 }
 
 static void globalmq_release(global_queue *q) {
     delete q->total;
     delete q->queue;
+    delete q->lockfree;
+    delete q->overflow;
+    if (q->local) {
+        for (int i = 0; i < q->thread; i++) {
+            delete q->local[i];
+        }
+        delete[] q->local;
+    }
+    delete[] q->weight;
     delete q->mutex;
     delete q->cv;
 }
@@ -64,35 +216,25 @@ void globalmq_dec(global_queue *q) { q->total->fetch_sub(1); }
 
 int globalmq_size(global_queue *q) { return q->total->load(); }
 
-lua_State *scheduler_newtask(lua_State *pL, bool inc) {
-    lua_State *L = luaL_newstate();
+static lua_State *_newtask(const char *path, const char *cpath,
+                           void *const env[]) {
+    lua_State *L = memory_newstate();
     luaL_openlibs(L);
 
-    auto copy = [](lua_State *L, lua_State *pL, const char *table,
-                   const char *field) {
-        lua_getglobal(pL, table);
-        lua_getfield(pL, -1, field);
-        std::string str = luaL_checkstring(pL, -1);
-        lua_pop(pL, 2);
-
-        lua_getglobal(L, table);
-        lua_pushstring(L, str.c_str());
-        lua_setfield(L, -2, field);
-        lua_pop(L, 1);
-    };
-    copy(L, pL, "package", "cpath");
-    copy(L, pL, "package", "path");
+    lua_getglobal(L, "package");
+    lua_pushstring(L, cpath);
+    lua_setfield(L, -2, "cpath");
+    lua_pushstring(L, path);
+    lua_setfield(L, -2, "path");
+    lua_pop(L, 1);
+    codecache_searcher(L);
 
     hive_createenv(L);
 
-    global_queue *mq =
-        static_cast<global_queue *>(hive_copyenv(L, pL, "message_queue"));
-    if (inc) {
-        globalmq_inc(mq);
+    for (int i = 0; i < TASK_ENV_SIZE; i++) {
+        lua_pushlightuserdata(L, env[i]);
+        hive_setenv(L, TASK_ENV[i]);
     }
-    hive_copyenv(L, pL, "system_pointer");
-    hive_copyenv(L, pL, "logger_pointer");
-    hive_copyenv(L, pL, "config");
 
     lua_newtable(L);
     lua_newtable(L);
@@ -104,6 +246,153 @@ lua_State *scheduler_newtask(lua_State *pL, bool inc) {
     return L;
 }
 
+static std::string _getpackage(lua_State *L, const char *field) {
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, field);
+    std::string str = luaL_checkstring(L, -1);
+    lua_pop(L, 2);
+    return str;
+}
+
+static void _getenvs(lua_State *L, void *env[]) {
+    for (int i = 0; i < TASK_ENV_SIZE; i++) {
+        hive_getenv(L, TASK_ENV[i]);
+        env[i] = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+    }
+}
+
+lua_State *scheduler_newtask(lua_State *pL, bool inc) {
+    void *env[TASK_ENV_SIZE];
+    _getenvs(pL, env);
+    lua_State *L = _newtask(_getpackage(pL, "path").c_str(),
+                            _getpackage(pL, "cpath").c_str(), env);
+    if (inc) {
+        globalmq_inc(static_cast<global_queue *>(env[0]));
+    }
+    return L;
+}
+
+static void statepool_init(global_queue *q, lua_State *L, const char *loader,
+                           int size) {
+    if (size <= 0) {
+        return;
+    }
+    state_pool *p = new state_pool;
+    p->size = size;
+    p->path = _getpackage(L, "path");
+    p->cpath = _getpackage(L, "cpath");
+    p->has_loader = loader != nullptr;
+    p->loader = loader ? loader : "";
+    _getenvs(L, p->env);
+    p->states.reserve(size);
+    q->pool = p;
+}
+
+static void statepool_release(global_queue *q) {
+    state_pool *p = q->pool;
+    if (p == nullptr) {
+        return;
+    }
+    for (auto L : p->states) {
+        cell_discard(L);
+    }
+    delete p;
+    q->pool = nullptr;
+}
+
+static bool statepool_short(global_queue *q) {
+    state_pool *p = q->pool;
+    if (p == nullptr) {
+        return false;
+    }
+    p->mut.lock();
+    bool ret = static_cast<int>(p->states.size()) + p->filling < p->size;
+    p->mut.unlock();
+    return ret;
+}
+
+// build one pre-warmed state if the pool is short, called by idle workers
+static bool statepool_fill(global_queue *q) {
+    state_pool *p = q->pool;
+    if (p == nullptr) {
+        return false;
+    }
+    p->mut.lock();
+    bool need = static_cast<int>(p->states.size()) + p->filling < p->size;
+    int generation = p->generation;
+    if (need) {
+        ++p->filling;
+    }
+    p->mut.unlock();
+    if (!need) {
+        return false;
+    }
+
+    lua_State *L = _newtask(p->path.c_str(), p->cpath.c_str(), p->env);
+    cell *c = cell_prepare(L, p->has_loader ? p->loader.c_str() : nullptr);
+
+    p->mut.lock();
+    --p->filling;
+    bool stale = c && generation != p->generation;
+    if (c && !stale) {
+        p->states.push_back(L);
+    } else if (!c) {
+        // the loader is broken, launch will report it on the cold path
+        p->size = 0;
+    }
+    p->mut.unlock();
+    if (stale) {
+        cell_discard(L);
+    }
+    return true;
+}
+
+int scheduler_clearpool(lua_State *L) {
+    hive_getenv(L, "message_queue");
+    auto gmq = static_cast<global_queue *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    state_pool *p = gmq->pool;
+    if (p == nullptr) {
+        return 0;
+    }
+    std::vector<lua_State *> states;
+    p->mut.lock();
+    states.swap(p->states);
+    ++p->generation;
+    p->mut.unlock();
+    // idle workers build new ones
+    for (auto sL : states) {
+        cell_discard(sL);
+    }
+    return static_cast<int>(states.size());
+}
+
+lua_State *scheduler_pooltask(lua_State *pL, const char *loader) {
+    hive_getenv(pL, "message_queue");
+    auto gmq = static_cast<global_queue *>(lua_touserdata(pL, -1));
+    lua_pop(pL, 1);
+    state_pool *p = gmq->pool;
+    if (p == nullptr || p->has_loader != (loader != nullptr) ||
+        (loader && p->loader != loader)) {
+        return nullptr;
+    }
+
+    lua_State *L = nullptr;
+    p->mut.lock();
+    if (!p->states.empty()) {
+        L = p->states.back();
+        p->states.pop_back();
+    }
+    p->mut.unlock();
+    if (L == nullptr) {
+        return nullptr;
+    }
+
+    globalmq_inc(gmq);
+    return L;
+}
+
 void scheduler_starttask(lua_State *L) {
     hive_getenv(L, "message_queue");
     auto gmq = static_cast<global_queue *>(lua_touserdata(L, -1));
@@ -114,10 +403,10 @@ void scheduler_starttask(lua_State *L) {
     globalmq_push(gmq, c);
 }
 
-void scheduler_deletetask(lua_State *L) { lua_close(L); }
+void scheduler_deletetask(lua_State *L) { memory_closestate(L); }
 
 static void wakeup(global_queue *gmq, int busy) {
-    if (gmq->sleep >= gmq->thread - busy) {
+    if (gmq->sleep.load() >= gmq->thread - busy) {
         // signal sleep worker, "spurious wakeup" is harmless
         gmq->cv->notify_one();
     }
@@ -140,39 +429,37 @@ static void _cell(global_queue *gmq, cell *c) {
             wakeup(gmq, 0);
         } else if (globalmq_size(gmq) <= 0) {
             return;
+        } else {
+            cell_wait(c, CELL_WAIT_MS);
         }
     }
 }
 
-static long long _gettime() {
-    auto time_now = std::chrono::system_clock::now();
-    auto duration_in_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-        time_now.time_since_epoch());
-    return duration_in_ms.count();
-}
-
-static void timer_init(timer *t, cell *sys, global_queue *mq) {
-    t->current = _gettime();
-    t->sys = sys;
+static void timer_init(timer *t, global_queue *mq) {
+    t->tw = timewheel_new();
     t->mq = mq;
 }
 
-static inline void send_tick(cell *c) { cell_send(c, 0, nullptr); }
+static void timer_release(timer *t) { timewheel_release(t->tw); }
 
-static void _updatetime(timer *t) {
-    long long ct = _gettime();
-    if (ct > t->current) {
-        long long diff = ct - t->current;
-        t->current = ct;
-        for (long long i = 0; i < diff; i++) {
-            send_tick(t->sys);
+static void _network(global_queue *gmq, int index) {
+    for (;;) {
+        if (network_poll(index, NETWORK_WAIT_MS) > 0) {
+            // reads go straight to their cells, wake a sleeping worker
+            wakeup(gmq, gmq->thread - 1);
+        }
+        if (globalmq_size(gmq) <= 0) {
+            return;
         }
     }
 }
 
 static void _timer(timer *t) {
     for (;;) {
-        _updatetime(t);
+        if (timewheel_update(t->tw) > 0) {
+            // timeouts go straight to their cells, wake a sleeping worker
+            wakeup(t->mq, t->mq->thread - 1);
+        }
         std::this_thread::sleep_for(std::chrono::microseconds(2500));
         if (globalmq_size(t->mq) <= 0) {
             return;
@@ -180,7 +467,7 @@ static void _timer(timer *t) {
     }
 }
 
-static cell *_message_dispatch(global_queue *q, cell *c) {
+static cell *_message_dispatch(global_queue *q, cell *c, int weight) {
     if (c == nullptr) {
         c = globalmq_pop(q);
         if (c == nullptr) {
@@ -188,7 +475,7 @@ static cell *_message_dispatch(global_queue *q, cell *c) {
         }
     }
 
-    if (!cell_dispatch_message(c)) {
+    if (!cell_dispatch_batch(c, weight, q->budget)) {
         return globalmq_pop(q);
     }
 
@@ -204,23 +491,36 @@ static cell *_message_dispatch(global_queue *q, cell *c) {
     return c;
 }
 
-static void _worker(global_queue *gmq) {
+static void _worker(global_queue *gmq, int index) {
+    if (gmq->local) {
+        local_queue = gmq->local[index];
+        local_index = index;
+    }
+    int weight = gmq->weight[index];
     cell *c = nullptr;
     for (;;) {
-        c = _message_dispatch(gmq, c);
+        c = _message_dispatch(gmq, c, weight);
         if (c == nullptr) {
+            bool idle = false;
             {
                 std::unique_lock<std::mutex> locker(*gmq->mutex);
                 ++gmq->sleep;
                 // "spurious wakeup" is harmless,
                 // because _message_dispatch() can be call at any
-                // time.
-                gmq->cv->wait(locker);
+                // time. never wait unbounded, a cell pushed after the
+                // queues were found empty but before ++sleep sends no
+                // notify
+                idle = gmq->cv->wait_for(
+                           locker, std::chrono::milliseconds(POOL_IDLE_MS)) ==
+                       std::cv_status::timeout;
                 --gmq->sleep;
             }
             if (globalmq_size(gmq) <= 0) {
                 return;
             }
+            if (idle && statepool_short(gmq)) {
+                statepool_fill(gmq);
+            }
         }
     }
 }
@@ -230,14 +530,19 @@ static void _start(global_queue *gmq, cell *sys, cell *socket, timer *t) {
 
     threads.emplace_back(_cell, gmq, sys);
 
-    threads.emplace_back(_cell, gmq, socket);
+    // the socket cell runs on a network thread, woken by cell_send
+    network_dispatch(socket);
 
     threads.emplace_back(_logger, gmq, get_logger());
 
     threads.emplace_back(_timer, t);
 
+    for (int i = 0; i < network_threads(); i++) {
+        threads.emplace_back(_network, gmq, i);
+    }
+
     for (int i = 0; i < gmq->thread; i++) {
-        threads.emplace_back(_worker, gmq);
+        threads.emplace_back(_worker, gmq, i);
     }
 
     for (auto &thread : threads) {
@@ -257,8 +562,58 @@ int scheduler_start(lua_State *L) {
     if (lua_type(L, 6) == LUA_TSTRING) {
         loader_lua = luaL_checkstring(L, 6);
     }
+    // thread = n, or thread = { count = n, weight = { ... }, budget = us }
+    int thread = static_cast<int>(DEFAULT_THREAD);
+    std::vector<int> weight;
+    int budget = 0;
     lua_getfield(L, 1, "thread");
-    int thread = static_cast<int>(luaL_optinteger(L, -1, DEFAULT_THREAD));
+    if (lua_type(L, -1) == LUA_TTABLE) {
+        lua_getfield(L, -1, "count");
+        thread = static_cast<int>(luaL_optinteger(L, -1, DEFAULT_THREAD));
+        lua_pop(L, 1);
+        lua_getfield(L, -1, "weight");
+        if (lua_type(L, -1) == LUA_TTABLE) {
+            for (int i = 1; i <= thread; i++) {
+                lua_rawgeti(L, -1, i);
+                weight.push_back(static_cast<int>(
+                    luaL_optinteger(L, -1, DEFAULT_WEIGHT)));
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+        lua_getfield(L, -1, "budget");
+        budget = static_cast<int>(luaL_optinteger(L, -1, 0));
+        lua_pop(L, 1);
+    } else {
+        thread = static_cast<int>(luaL_optinteger(L, -1, DEFAULT_THREAD));
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "queue");
+    const char *queue = luaL_optstring(L, -1, "mutex");
+    bool lockfree = strcmp(queue, "lockfree") == 0;
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "steal");
+    bool steal = lua_toboolean(L, -1) ? true : false;
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "codecache");
+    codecache_mode(lua_toboolean(L, -1) ? true : false);
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "memory_limit");
+    auto memory_limit = static_cast<std::size_t>(luaL_optinteger(L, -1, 0));
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "memory_arena");
+    int memory_arena = static_cast<int>(luaL_optinteger(L, -1, 0));
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "pool");
+    int pool = static_cast<int>(luaL_optinteger(L, -1, 0));
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "network_thread");
+    int network_thread = static_cast<int>(
+        luaL_optinteger(L, -1, DEFAULT_NETWORK_THREAD));
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "queue_size");
+    auto queue_size = static_cast<std::size_t>(
+        luaL_optinteger(L, -1, DEFAULT_QUEUE_SIZE));
     lua_pop(L, 1);
     lua_getfield(L, 1, "logdir");
     const char *logdir = luaL_checkstring(L, -1);
@@ -267,6 +622,9 @@ int scheduler_start(lua_State *L) {
     const char *logfile = luaL_checkstring(L, -1);
     lua_pop(L, 1);
 
+    memory_config(memory_arena);
+    network_init(network_thread);
+
     hive_createenv(L);
 
     lua_pushcfunction(L, data_pack);
@@ -281,11 +639,16 @@ int scheduler_start(lua_State *L) {
 
     auto gmq = static_cast<global_queue *>(
         lua_newuserdatauv(L, sizeof(global_queue), 0));
-    globalmq_init(gmq, thread);
+    globalmq_init(gmq, thread, lockfree, queue_size, steal, weight, budget);
 
     lua_pushvalue(L, -1);
     hive_setenv(L, "message_queue");
 
+    auto t = static_cast<timer *>(lua_newuserdatauv(L, sizeof(timer), 0));
+    timer_init(t, gmq);
+    lua_pushlightuserdata(L, t->tw);
+    hive_setenv(L, "timer_pointer");
+
     lua_State *sL = scheduler_newtask(L, false);
     cell *sys = cell_alloc(sL);
 
@@ -300,16 +663,20 @@ int scheduler_start(lua_State *L) {
         return 0;
     }
 
+    // user cells only, main is the first, the core cells serve everyone
+    memory_setdefault(memory_limit);
     sys = cell_sys(sL, sys, socket, logger, system_lua, socket_lua, logger_lua,
                    main_lua, loader_lua);
     if (sys == nullptr) {
         return 0;
     }
 
-    auto t = static_cast<timer *>(lua_newuserdatauv(L, sizeof(timer), 0));
-    timer_init(t, sys, gmq);
+    statepool_init(gmq, sL, loader_lua, pool);
 
     _start(gmq, sys, socket, t);
+    network_release();
+    statepool_release(gmq);
+    timer_release(t);
     globalmq_release(gmq);
 
     return 0;
@@ -12,6 +12,10 @@ void globalmq_dec(global_queue *q);
 int globalmq_size(global_queue *q);
 
 lua_State *scheduler_newtask(lua_State *L, bool inc);
+lua_State *scheduler_pooltask(lua_State *L, const char *loader);
+// drop the pre-warmed states, they ran the files before a clearcache,
+// return the number dropped
+int scheduler_clearpool(lua_State *L);
 void scheduler_starttask(lua_State *L);
 void scheduler_deletetask(lua_State *L);
 
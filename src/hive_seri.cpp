@@ -22,13 +22,13 @@ int data_unpack(lua_State *L) {
 
     read_block rb;
     rb.init(blk);
+    rb.keep = nodelete;
 
     for (int i = 0;; i++) {
         if (i % 8 == 7) {
             luaL_checkstack(L, LUA_MINSTACK, nullptr);
         }
-        uint8_t type = 0;
-        uint8_t *t = static_cast<uint8_t *>(rb.read(&type, sizeof(type)));
+        auto t = static_cast<const uint8_t *>(rb.read(sizeof(uint8_t)));
         if (t == nullptr) {
             break;
         }
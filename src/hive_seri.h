@@ -3,21 +3,24 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
-#include <functional>
+#include <new>
 
+#include "hive_buffer.h"
 #include "hive_cell.h"
 #include "lua.hpp"
 
-static const int BLOCK_SIZE = 128;
 static const int MAX_DEPTH = 32;
 static const int MAX_COOKIE = 32;
+// strings this long are copied once into a shared_buffer, not into blocks
+static const std::size_t SHARED_STRING_SIZE = 4096;
 
 enum class data_type {
     TYPE_NIL,
     TYPE_BOOLEAN,  // hibits 0 false 1 true
     TYPE_NUMBER,   // hibits 0 : 0 , 1: byte, 2:word, 4: dword, 8 : double
-    TYPE_USERDATA,
+    TYPE_USERDATA,  // hibits userdata_type
     TYPE_SHORT_STRING,  // hibits 0~31 : len
     TYPE_LONG_STRING,
     TYPE_TABLE,
@@ -33,92 +36,140 @@ enum class number_type {
     TYPE_NUMBER_REAL = 8,
 };
 
+enum class userdata_type {
+    TYPE_POINTER = 0,        // lightuserdata
+    TYPE_BUFFER = 1,         // shared_buffer, unpack as a buffer userdata
+    TYPE_SHARED_STRING = 2,  // shared_buffer, unpack as a string
+};
+
 static constexpr uint8_t COMBINE_TYPE(data_type t, uint8_t v) {
     return static_cast<uint8_t>(t) | v << 3;
 }
 
+// A packed message, the header and its payload share one allocation.
 struct block {
-    block *next{nullptr};
-    char buffer[BLOCK_SIZE];
+    int len;  // payload bytes that follow the header
+};
+
+static inline char *block_data(block *b) {
+    return reinterpret_cast<char *>(b + 1);
+}
+
+// Per thread pack buffer, write_block packs into it and close() copies the
+// result out once. A pack started while it is taken gets a private buffer.
+struct pack_scratch {
+    char *data{nullptr};
+    int cap{0};
+    bool busy{false};
+
+    ~pack_scratch() { ::free(data); }
 };
 
+static const int SCRATCH_INIT = 256;
+// a scratch grown past this by one huge message is not kept
+static const int SCRATCH_KEEP = 64 * 1024;
+
+static inline pack_scratch &_scratch() {
+    static thread_local pack_scratch s;
+    return s;
+}
+
 struct write_block {
     block *head{nullptr};
+    char *data{nullptr};
     int len{0};
-    block *current{nullptr};
-    int ptr{0};
+    int cap{0};
+    bool scratch{false};
+    // set while packing lua values, out of memory is a lua error then
+    lua_State *L{nullptr};
+
+    void grow(int sz) {
+        int ncap = cap > 0 ? cap : SCRATCH_INIT;
+        while (ncap - len < sz) {
+            ncap *= 2;
+        }
+        char *ndata = static_cast<char *>(realloc(data, ncap));
+        if (ndata == nullptr) {
+            _nomem();
+        }
+        data = ndata;
+        cap = ncap;
+        if (scratch) {
+            pack_scratch &s = _scratch();
+            s.data = data;
+            s.cap = cap;
+        }
+    }
 
     void push(const void *buf, int sz) {
-        auto buffer = static_cast<const char *>(buf);
-
-        auto new_next_block = [&]() {
-            current->next = new block;
-            current = current->next;
-            ptr = 0;
-        };
-
-        std::function<void()> copy_buf = [&]() {
-            if (ptr <= BLOCK_SIZE - sz) {
-                memcpy(current->buffer + ptr, buffer, sz);
-                ptr += sz;
-                len += sz;
-            } else {
-                int copy = BLOCK_SIZE - ptr;
-                memcpy(current->buffer + ptr, buffer, copy);
-                buffer += copy;
-                len += copy;
-                sz -= copy;
-                new_next_block();
-                copy_buf();
-            }
-        };
-
-        if (ptr == BLOCK_SIZE) {
-            new_next_block();
+        if (cap - len < sz) {
+            grow(sz);
         }
-        copy_buf();
+        memcpy(data + len, buf, sz);
+        len += sz;
     }
 
     void init(block *b) {
-        if (b == nullptr) {
-            head = new block;
-            current = head;
-            push(&len, sizeof(len));
-        } else {
-            head = b;
-            auto plen = reinterpret_cast<int *>(b->buffer);
-            int sz = *plen;
-            len = sz;
-            while (b->next) {
-                sz -= BLOCK_SIZE;
-                b = b->next;
-            }
-            current = b;
-            ptr = sz;
+        pack_scratch &s = _scratch();
+        if (!s.busy) {
+            s.busy = true;
+            scratch = true;
+            data = s.data;
+            cap = s.cap;
+        }
+        len = 0;
+        if (b != nullptr) {
+            push(block_data(b), b->len);
+            ::free(b);
         }
     }
 
     block *close() {
-        current = head;
-        ptr = 0;
-        push(&len, sizeof(len));
-        current = nullptr;
+        head = static_cast<block *>(malloc(sizeof(block) + len));
+        if (head == nullptr) {
+            _nomem();
+        }
+        head->len = len;
+        memcpy(block_data(head), data, len);
+        _release();
         return head;
     }
 
+    // drop the packed data, or the closed block when it could not be sent
     void free() {
-        block *blk = head;
-        while (blk) {
-            block *next = blk->next;
-            delete blk;
-            blk = next;
-        }
+        _release();
+        ::free(head);
         head = nullptr;
-        current = nullptr;
-        ptr = 0;
         len = 0;
     }
 
+    void _release() {
+        if (scratch) {
+            pack_scratch &s = _scratch();
+            if (s.cap > SCRATCH_KEEP) {
+                ::free(s.data);
+                s.data = nullptr;
+                s.cap = 0;
+            }
+            s.busy = false;
+            scratch = false;
+        } else {
+            ::free(data);
+        }
+        data = nullptr;
+        cap = 0;
+    }
+
+    // the buffer is still the one before the failed allocation, so it and
+    // the scratch are given back before unwinding
+    [[noreturn]] void _nomem() {
+        free();
+        if (L != nullptr) {
+            luaL_error(L, "not enough memory");
+        }
+        throw std::bad_alloc();
+    }
+
     void wb_nil() {
         uint8_t n = static_cast<uint8_t>(data_type::TYPE_NIL);
         push(&n, sizeof(n));
@@ -201,8 +252,8 @@ struct write_block {
         }
     }
 
-    void wb_pointer(void *v, data_type type) {
-        uint8_t n = static_cast<uint8_t>(type);
+    void wb_pointer(void *v, data_type type, uint8_t cookie = 0) {
+        uint8_t n = COMBINE_TYPE(type, cookie);
         push(&n, sizeof(n));
         push(&v, sizeof(v));
     }
@@ -231,7 +282,7 @@ struct write_block {
         lua_pushnil(L);
         while (lua_next(L, index) != 0) {
             if (lua_type(L, -2) == LUA_TNUMBER) {
-                lua_Number k = lua_tonumber(L, 2);
+                lua_Number k = lua_tonumber(L, -2);
                 int32_t x = static_cast<int32_t>(lua_tointeger(L, -2));
                 if (k == static_cast<lua_Number>(x) && x > 0 &&
                     x <= array_size) {
@@ -281,7 +332,17 @@ struct write_block {
             case LUA_TSTRING: {
                 std::size_t sz = 0;
                 const char *str = lua_tolstring(L, index, &sz);
-                wb_string(str, sz);
+                shared_buffer *b = nullptr;
+                if (sz >= SHARED_STRING_SIZE) {
+                    b = buffer_new(str, sz);
+                }
+                if (b) {
+                    wb_pointer(b, data_type::TYPE_USERDATA,
+                               static_cast<uint8_t>(
+                                   userdata_type::TYPE_SHARED_STRING));
+                } else {
+                    wb_string(str, sz);
+                }
                 break;
             }
             case LUA_TLIGHTUSERDATA:
@@ -297,6 +358,13 @@ struct write_block {
                     wb_pointer(c, data_type::TYPE_CELL);
                     break;
                 }
+                shared_buffer *b = buffer_fromuserdata(L, index);
+                if (b) {
+                    buffer_grab(b);
+                    wb_pointer(b, data_type::TYPE_USERDATA,
+                               static_cast<uint8_t>(userdata_type::TYPE_BUFFER));
+                    break;
+                }
                 // else go through
             }
             default:
@@ -307,6 +375,7 @@ struct write_block {
     }
 
     void _pack_from(lua_State *L, int from) {
+        this->L = L;
         int n = lua_gettop(L) - from;
         for (int i = 1; i <= n; i++) {
             _pack_one(L, from + i, 0);
@@ -315,89 +384,47 @@ struct write_block {
 };
 
 struct read_block {
-    char *buffer{nullptr};
     block *head{nullptr};
-    block *current{nullptr};
+    const char *data{nullptr};
     int len{0};
     int ptr{0};
+    // the block is unpacked again later, it keeps its references to cells
+    // and buffers and is not freed here
+    bool keep{false};
 
     int init(block *b) {
         head = b;
-        current = b;
-        memcpy(&len, b->buffer, sizeof(len));
-        ptr = sizeof(len);
-        len -= ptr;
+        data = block_data(b);
+        len = b->len;
+        ptr = 0;
         return len;
     }
 
-    void *read(void *buf, int sz) {
+    // a pointer into the block, nullptr past its end
+    const void *read(int sz) {
         if (len < sz) {
             return nullptr;
         }
-
-        if (buffer) {
-            int tmp_ptr = ptr;
-            ptr += sz;
-            len -= sz;
-            return buffer + tmp_ptr;
-        }
-
-        if (ptr == BLOCK_SIZE) {
-            block *next = current->next;
-            current = next;
-            ptr = 0;
-        }
-
-        int copy = BLOCK_SIZE - ptr;
-
-        if (sz <= copy) {
-            void *ret = current->buffer + ptr;
-            ptr += sz;
-            len -= sz;
-            return ret;
-        }
-
-        char *tmp = static_cast<char *>(buf);
-
-        memcpy(tmp, current->buffer + ptr, copy);
-        sz -= copy;
-        tmp += copy;
-        len -= copy;
-
-        for (;;) {
-            block *next = current->next;
-            current = next;
-
-            if (sz < BLOCK_SIZE) {
-                memcpy(tmp, current->buffer, sz);
-                ptr = sz;
-                len -= sz;
-                return buf;
-            }
-
-            memcpy(tmp, current->buffer, BLOCK_SIZE);
-            sz -= BLOCK_SIZE;
-            tmp += BLOCK_SIZE;
-            len -= BLOCK_SIZE;
-        }
+        const void *ret = data + ptr;
+        ptr += sz;
+        len -= sz;
+        return ret;
     }
 
     void close() {
-        while (head) {
-            block *next = head->next;
-            delete head;
-            head = next;
-        }
+        ::free(head);
+        head = nullptr;
+        data = nullptr;
         len = 0;
         ptr = 0;
     }
 
     void __invalid_stream(lua_State *L, int line) {
         int tmp_len = len;
-        if (buffer == nullptr) {
+        if (!keep) {
             close();
         }
-        luaL_error(L, "Invalid serialize stream %d (line:%d)", len, line);
+        luaL_error(L, "Invalid serialize stream %d (line:%d)", tmp_len, line);
     }
 
 #define _invalid_stream(L) __invalid_stream(L, __LINE__)
@@ -408,32 +435,32 @@ struct read_block {
             case number_type::TYPE_NUMBER_ZERO:
                 return 0;
             case number_type::TYPE_NUMBER_BYTE: {
-                uint8_t n = 0;
-                uint8_t *pn = static_cast<uint8_t *>(read(&n, sizeof(n)));
+                const uint8_t *pn =
+                    static_cast<const uint8_t *>(read(sizeof(uint8_t)));
                 if (pn == nullptr) {
                     _invalid_stream(L);
                 }
                 return *pn;
             }
             case number_type::TYPE_NUMBER_WORD: {
-                uint16_t n = 0;
-                uint16_t *pn = static_cast<uint16_t *>(read(&n, sizeof(n)));
+                const uint16_t *pn =
+                    static_cast<const uint16_t *>(read(sizeof(uint16_t)));
                 if (pn == nullptr) {
                     _invalid_stream(L);
                 }
                 return *pn;
             }
             case number_type::TYPE_NUMBER_DWORD: {
-                int32_t n = 0;
-                int32_t *pn = static_cast<int32_t *>(read(&n, sizeof(n)));
+                const int32_t *pn =
+                    static_cast<const int32_t *>(read(sizeof(int32_t)));
                 if (pn == nullptr) {
                     _invalid_stream(L);
                 }
                 return *pn;
             }
             case number_type::TYPE_NUMBER_QWORD: {
-                int64_t n = 0;
-                int64_t *pn = static_cast<int64_t *>(read(&n, sizeof(n)));
+                const int64_t *pn =
+                    static_cast<const int64_t *>(read(sizeof(int64_t)));
                 if (pn == nullptr) {
                     _invalid_stream(L);
                 }
@@ -446,8 +473,7 @@ struct read_block {
     }
 
     double _get_number(lua_State *L) {
-        double n = 0;
-        double *pn = static_cast<double *>(read(&n, sizeof(n)));
+        const double *pn = static_cast<const double *>(read(sizeof(double)));
         if (pn == nullptr) {
             _invalid_stream(L);
         }
@@ -455,8 +481,7 @@ struct read_block {
     }
 
     void *_get_pointer(lua_State *L) {
-        void *userdata = nullptr;
-        void **v = static_cast<void **>(read(&userdata, sizeof(userdata)));
+        void *const *v = static_cast<void *const *>(read(sizeof(void *)));
         if (v == nullptr) {
             _invalid_stream(L);
         }
@@ -464,15 +489,15 @@ struct read_block {
     }
 
     void _get_buffer(lua_State *L, int len) {
-        char *tmp = new char[len];
-        char *p = static_cast<char *>(read(tmp, len));
+        const char *p = static_cast<const char *>(read(len));
+        if (p == nullptr) {
+            _invalid_stream(L);
+        }
         lua_pushlstring(L, p, len);
-        delete[] tmp;
     }
 
     void _unpack_one(lua_State *L, int table_index) {
-        uint8_t type = 0;
-        uint8_t *t = static_cast<uint8_t *>(read(&type, sizeof(type)));
+        const uint8_t *t = static_cast<const uint8_t *>(read(sizeof(uint8_t)));
         if (t == nullptr) {
             _invalid_stream(L);
         }
@@ -481,8 +506,8 @@ struct read_block {
 
     void _unpack_table(lua_State *L, int array_size, int table_index) {
         if (array_size == MAX_COOKIE - 1) {
-            uint8_t type = 0;
-            uint8_t *t = static_cast<uint8_t *>(read(&type, sizeof(type)));
+            const uint8_t *t =
+                static_cast<const uint8_t *>(read(sizeof(uint8_t)));
             if (t == nullptr ||
                 (*t & 0x7) != static_cast<uint8_t>(data_type::TYPE_NUMBER) ||
                 (*t >> 3) ==
@@ -525,12 +550,35 @@ struct read_block {
                 }
                 break;
             case data_type::TYPE_USERDATA:
-                lua_pushlightuserdata(L, _get_pointer(L));
+                switch (static_cast<userdata_type>(cookie)) {
+                    case userdata_type::TYPE_BUFFER: {
+                        // the packed reference moves to the userdata
+                        auto b = static_cast<shared_buffer *>(_get_pointer(L));
+                        if (keep) {
+                            buffer_grab(b);
+                        }
+                        buffer_touserdata(L, b);
+                        break;
+                    }
+                    case userdata_type::TYPE_SHARED_STRING: {
+                        auto b = static_cast<shared_buffer *>(_get_pointer(L));
+                        lua_pushlstring(L, buffer_data(b), buffer_size(b));
+                        if (!keep) {
+                            buffer_release(b);
+                        }
+                        break;
+                    }
+                    default:
+                        lua_pushlightuserdata(L, _get_pointer(L));
+                        break;
+                }
                 break;
             case data_type::TYPE_CELL: {
                 cell *c = static_cast<cell *>(_get_pointer(L));
                 cell_touserdata(L, table_index, c);
-                cell_release(c);
+                if (!keep) {
+                    cell_release(c);
+                }
                 break;
             }
             case data_type::TYPE_SHORT_STRING:
@@ -538,9 +586,8 @@ struct read_block {
                 break;
             case data_type::TYPE_LONG_STRING:
                 if (cookie == 2) {
-                    uint16_t len = 0;
-                    uint16_t *plen =
-                        static_cast<uint16_t *>(read(&len, sizeof(len)));
+                    const uint16_t *plen =
+                        static_cast<const uint16_t *>(read(sizeof(uint16_t)));
                     if (plen == nullptr) {
                         _invalid_stream(L);
                     }
@@ -549,9 +596,8 @@ struct read_block {
                     if (cookie != 4) {
                         _invalid_stream(L);
                     }
-                    uint32_t len = 0;
-                    uint32_t *plen =
-                        static_cast<uint32_t *>(read(&len, sizeof(len)));
+                    const uint32_t *plen =
+                        static_cast<const uint32_t *>(read(sizeof(uint32_t)));
                     if (plen == nullptr) {
                         _invalid_stream(L);
                     }
@@ -565,7 +611,11 @@ struct read_block {
     }
 };
 
+// The block holds a reference to every cell, buffer and string of
+// SHARED_STRING_SIZE or more packed into it, unpacking drops them. A block
+// never unpacked, or only ever with nodelete like the config, keeps them.
 int data_pack(lua_State *L);
+// block [, nodelete]
 int data_unpack(lua_State *L);
 
 #endif
\ No newline at end of file
@@ -1,10 +1,46 @@
 #include "hive_socket_lib.h"
 
 #include "client.h"
+#include "hive_dns.h"
+#include "hive_tls.h"
 #include "server.h"
 #include "udp_client.h"
 #include "udp_server.h"
 
+// opts.tls of listen and connect, true or a table of cert and key for a
+// server, servername, verify and cafile for a client, max_version for
+// both. false without one.
+static bool _tls_options(lua_State *L, int index, tls_options &opts) {
+    if (!lua_istable(L, index)) {
+        return false;
+    }
+    int t = lua_getfield(L, index, "tls");
+    if (t == LUA_TTABLE) {
+        struct {
+            const char *name;
+            std::string *value;
+        } strings[] = {
+            {"cert", &opts.cert},
+            {"key", &opts.key},
+            {"servername", &opts.servername},
+            {"cafile", &opts.cafile},
+            {"max_version", &opts.max_version},
+        };
+        for (auto &field : strings) {
+            if (lua_getfield(L, -1, field.name) == LUA_TSTRING) {
+                *field.value = lua_tostring(L, -1);
+            }
+            lua_pop(L, 1);
+        }
+        lua_getfield(L, -1, "verify");
+        opts.verify = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    bool on = t == LUA_TTABLE || lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return on;
+}
+
 static int llisten(lua_State *L) {
     cell *c = cell_fromuserdata(L, 1);
     if (c == nullptr) {
@@ -12,13 +48,14 @@ static int llisten(lua_State *L) {
     }
     const char *addr = luaL_checkstring(L, 2);
     unsigned short port = static_cast<unsigned short>(luaL_checkinteger(L, 3));
+    lua_Integer event = luaL_checkinteger(L, 4);
+    tls_options tls;
+    bool secure = _tls_options(L, 5, tls);
 
-    auto s = std::make_shared<server>(c, addr, port);
-    if (s->listen()) {
-        server_map[s->session_id()] = s;
-        lua_pushinteger(L, s->session_id());
-        return 1;
-    }
+    auto s = std::make_shared<server>(c, addr, port, secure ? &tls : nullptr);
+    // in the table first, a failed listen removes it on its thread
+    server_map.set(s->session_id(), s);
+    s->listen(event);
 
     return 0;
 }
@@ -31,46 +68,49 @@ static int lconnect(lua_State *L) {
     const char *addr = luaL_checkstring(L, 2);
     unsigned short port = static_cast<unsigned short>(luaL_checkinteger(L, 3));
     lua_Integer event = luaL_checkinteger(L, 4);
+    tls_options tls;
+    bool secure = _tls_options(L, 5, tls);
 
-    auto cl = std::make_shared<client>(c, addr, port);
-    if (cl->connect(event)) {
-        client_map[cl->session_id()] = cl;
-        session_map[cl->session_id()] = cl->get_session();
-    }
+    auto cl = std::make_shared<client>(c, addr, port, secure ? &tls : nullptr);
+    // in the tables first, a failed connect removes them on its thread
+    client_map.set(cl->session_id(), cl);
+    session_map.set(cl->session_id(), cl->get_session());
+    cl->connect(event);
 
     return 0;
 }
 
-static int lpollonce(lua_State *L) {
-    lua_pushinteger(L, io_context.poll());
-    return 1;
-}
-
-static int lpollfor(lua_State *L) {
-    lua_Integer ts = 100;
-    if (lua_gettop(L) > 0) {
-        ts = luaL_checkinteger(L, 1);
-    }
-    lua_pushinteger(L, io_context.run_for(std::chrono::milliseconds(ts)));
-    return 1;
-}
-
 static int lforward(lua_State *L) {
     uint32_t session_id = static_cast<uint32_t>(luaL_checkinteger(L, 1));
     cell *c = cell_fromuserdata(L, 2);
     if (c == nullptr) {
         return 0;
     }
-    auto session = session_map[session_id];
-    if (session == nullptr) {
-        return 0;
+    auto session = session_map.get(session_id);
+    if (session) {
+        session->set_to_cell(c);
+    } else {
+        // a reliable udp socket passes for a tcp one
+        auto udp = udp_session_map.get(session_id);
+        if (udp == nullptr) {
+            return 0;
+        }
+        udp->set_to_cell(c);
     }
-    int boolean = session->set_to_cell(c);
-    lua_pushboolean(L, boolean);
+    lua_pushboolean(L, 1);
     return 1;
 }
 
+static int ludp_write(lua_State *L);
+
+// a buffer is sent as itself, the socket cell writes it without a copy
 static int lsendpack(lua_State *L) {
+    shared_buffer *b = buffer_fromuserdata(L, 1);
+    if (b) {
+        lua_pushinteger(L, static_cast<lua_Integer>(buffer_size(b)));
+        lua_pushvalue(L, 1);
+        return 2;
+    }
     std::size_t len = 0;
     const char *str = luaL_checklstring(L, 1, &len);
     lua_pushinteger(L, static_cast<lua_Integer>(len));
@@ -83,16 +123,42 @@ static int lsendpack(lua_State *L) {
 static int lsend(lua_State *L) {
     uint32_t id = static_cast<uint32_t>(luaL_checkinteger(L, 1));
     std::size_t sz = static_cast<std::size_t>(luaL_checkinteger(L, 2));
-    auto msg = static_cast<const char *>(lua_touserdata(L, 3));
-    auto session = session_map[id];
+    shared_buffer *b = buffer_fromuserdata(L, 3);
+    auto msg = b ? nullptr : static_cast<const char *>(lua_touserdata(L, 3));
+    auto session = session_map.get(id);
     if (session == nullptr) {
         delete[] msg;
         return luaL_error(L, "Write to invalid socket %d", id);
     }
-    session->write(msg, sz);
+    if (b) {
+        session->write(b);
+    } else {
+        session->write(msg, sz);
+    }
     return 0;
 }
 
+// from any cell, queued on the session without a hop through the socket cell
+static int lwrite(lua_State *L) {
+    uint32_t id = static_cast<uint32_t>(luaL_checkinteger(L, 1));
+    auto session = session_map.get(id);
+    if (session == nullptr) {
+        return ludp_write(L);
+    }
+    shared_buffer *b = buffer_fromuserdata(L, 2);
+    if (b) {
+        session->write(b);
+    } else {
+        std::size_t len = 0;
+        const char *str = luaL_checklstring(L, 2, &len);
+        char *msg = new char[len];
+        memcpy(msg, str, len);
+        session->write(msg, len);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 static int lfree(lua_State *L) {
     read_buffer *buffer = static_cast<read_buffer *>(lua_touserdata(L, 1));
     buffer->free();
@@ -129,6 +195,44 @@ static int lpush(lua_State *L) {
     return 2;
 }
 
+// take sz bytes from the front, pushed as one string when push is set
+static void _consume(lua_State *L, read_buffer *buffer, std::size_t sz,
+                     bool push) {
+    if (!push) {
+        buffer->skip(sz);
+        return;
+    }
+    buffer->consumed(sz);
+    r_block *block = buffer->head;
+    if (block == nullptr || sz < block->len - block->ptr) {
+        lua_pushlstring(L, block ? &block->data[block->ptr] : "", sz);
+        if (block) {
+            block->ptr += sz;
+        }
+        return;
+    }
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    while (sz > 0) {
+        block = buffer->head;
+        std::size_t n = block->len - block->ptr;
+        if (sz < n) {
+            luaL_addlstring(&b, &block->data[block->ptr], sz);
+            block->ptr += sz;
+            break;
+        }
+        luaL_addlstring(&b, &block->data[block->ptr], n);
+        sz -= n;
+        buffer->head = block->next;
+        rblock_free(block);
+    }
+    if (buffer->head == nullptr) {
+        buffer->tail = nullptr;
+    }
+    luaL_pushresult(&b);
+}
+
 static int lreadline(lua_State *L) {
     read_buffer *buffer = static_cast<read_buffer *>(lua_touserdata(L, 1));
     if (buffer == nullptr) {
@@ -139,84 +243,17 @@ static int lreadline(lua_State *L) {
     const char *sep = luaL_checklstring(L, 2, &len);
     bool read = !lua_toboolean(L, 3);
 
-    if (buffer->len + 1 <= len) {
+    std::size_t i = buffer->find(sep, len);
+    if (i == read_buffer::npos) {
         return 0;
     }
-    for (std::size_t i = 0; i < buffer->len + 1 - len; i++) {
-        if (buffer->check_sep(i, sep, len)) {
-            if (!read) {
-                lua_pushboolean(L, 1);
-            } else {
-                std::size_t tmp_i = i;
-                std::size_t tmp_len = len;
-                if (i == 0) {
-                    lua_pushlstring(L, "", 0);
-                } else {
-                    if (i < (buffer->head->len - buffer->head->ptr)) {
-                        lua_pushlstring(
-                            L, &buffer->head->data[buffer->head->ptr], i);
-                        buffer->head->ptr += i;
-                    } else {
-                        luaL_Buffer b;
-                        luaL_buffinit(L, &b);
-                        luaL_addlstring(&b,
-                                        &buffer->head->data[buffer->head->ptr],
-                                        buffer->head->len - buffer->head->ptr);
-                        r_block *block = buffer->head;
-                        i -= (block->len - block->ptr);
-                        buffer->head = block->next;
-                        delete block;
-                        while (buffer->head && i > buffer->head->len) {
-                            luaL_addlstring(&b, &buffer->head->data[0],
-                                            buffer->head->len);
-                            block = buffer->head;
-                            i -= block->len;
-                            buffer->head = block->next;
-                            delete block;
-                        }
-                        if (buffer->head && i > 0) {
-                            luaL_addlstring(&b, &buffer->head->data[0], i);
-                            luaL_pushresult(&b);
-                            buffer->head->ptr = i;
-                        } else {
-                            luaL_pushresult(&b);
-                        }
-                    }
-                }
-                if (len < (buffer->head->len - buffer->head->ptr)) {
-                    buffer->head->ptr += len;
-                } else {
-                    r_block *block = buffer->head;
-                    len -= (block->len - block->ptr);
-                    buffer->head = block->next;
-                    delete block;
-                    while (buffer->head && len > buffer->head->len) {
-                        block = buffer->head;
-                        len -= block->len;
-                        buffer->head = block->next;
-                        delete block;
-                    }
-                    if (buffer->head) {
-                        if (len == buffer->head->len) {
-                            block = buffer->head;
-                            buffer->head = block->next;
-                            delete block;
-                            if (buffer->head == nullptr) {
-                                buffer->tail = nullptr;
-                            }
-                        } else {
-                            buffer->head->ptr = len;
-                        }
-                    } else {
-                        buffer->tail = nullptr;
-                    }
-                }
-                buffer->len -= (tmp_i + tmp_len);
-            }
-            return 1;
-        }
+    if (!read) {
+        lua_pushboolean(L, 1);
+    } else {
+        _consume(L, buffer, i, true);
+        _consume(L, buffer, len, false);
     }
-    return 0;
+    return 1;
 }
 
 static int lpop(lua_State *L) {
@@ -237,48 +274,7 @@ static int lpop(lua_State *L) {
         sz = buffer->len;
     }
 
-    std::size_t tmp_sz = sz;
-    if (sz < (buffer->head->len - buffer->head->ptr)) {
-        lua_pushlstring(L, &buffer->head->data[buffer->head->ptr], sz);
-        buffer->head->ptr += sz;
-    } else {
-        luaL_Buffer b;
-        luaL_buffinit(L, &b);
-        luaL_addlstring(&b, &buffer->head->data[buffer->head->ptr],
-                        buffer->head->len - buffer->head->ptr);
-        r_block *block = buffer->head;
-        sz -= (block->len - block->ptr);
-        buffer->head = block->next;
-        delete block;
-        while (buffer->head && sz > buffer->head->len) {
-            luaL_addlstring(&b, &buffer->head->data[0], buffer->head->len);
-            block = buffer->head;
-            sz -= block->len;
-            buffer->head = block->next;
-            delete block;
-        }
-        if (buffer->head && sz > 0) {
-            luaL_addlstring(&b, &buffer->head->data[0], sz);
-            luaL_pushresult(&b);
-            if (sz == buffer->head->len) {
-                block = buffer->head;
-                buffer->head = block->next;
-                delete block;
-                if (buffer->head == nullptr) {
-                    buffer->tail = nullptr;
-                }
-            } else {
-                buffer->head->ptr = sz;
-            }
-        } else {
-            luaL_pushresult(&b);
-            if (buffer->head == nullptr) {
-                buffer->tail = nullptr;
-            }
-        }
-    }
-    buffer->len -= tmp_sz;
-
+    _consume(L, buffer, sz, true);
     lua_pushinteger(L, buffer->len);
 
     return 2;
@@ -294,7 +290,8 @@ static int lreadall(lua_State *L) {
     luaL_buffinit(L, &b);
     r_block *block = buffer->head;
     while (block) {
-        luaL_addlstring(&b, &block->data[0], block->len);
+        // a readline or pop may have consumed the front of the head
+        luaL_addlstring(&b, &block->data[block->ptr], block->len - block->ptr);
         block = block->next;
     }
     buffer->free();
@@ -302,13 +299,42 @@ static int lreadall(lua_State *L) {
     return 1;
 }
 
+// from the owning cell, see session::set_framing
+static int lframing(lua_State *L) {
+    uint32_t id = static_cast<uint32_t>(luaL_checkinteger(L, 1));
+    lua_Integer header = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, header == 0 || header == 1 || header == 2 || header == 4,
+                  2, "header size must be 0, 1, 2 or 4");
+    bool big_endian = lua_toboolean(L, 3);
+    lua_Integer max = luaL_checkinteger(L, 4);
+    luaL_argcheck(L, max >= 0, 4, "max frame size must not be negative");
+
+    auto session = session_map.get(id);
+    if (session) {
+        session->set_framing(static_cast<std::size_t>(header), big_endian,
+                             static_cast<std::size_t>(max));
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    // a reliable udp socket in message mode hands over whole messages as
+    // frames, there is no header to set
+    auto udp = udp_session_map.get(id);
+    lua_pushboolean(L, udp != nullptr && udp->message_mode());
+    return 1;
+}
+
 static int lpause(lua_State *L) {
     uint32_t id = static_cast<uint32_t>(luaL_checkinteger(L, 1));
 
-    auto session = session_map[id];
+    auto session = session_map.get(id);
 
     if (session) {
         session->pause();
+    } else {
+        auto udp = udp_session_map.get(id);
+        if (udp) {
+            udp->pause();
+        }
     }
 
     return 0;
@@ -317,36 +343,88 @@ static int lpause(lua_State *L) {
 static int lresume(lua_State *L) {
     uint32_t id = static_cast<uint32_t>(luaL_checkinteger(L, 1));
 
-    auto session = session_map[id];
+    auto session = session_map.get(id);
     if (session) {
         session->resume();
+    } else {
+        auto udp = udp_session_map.get(id);
+        if (udp) {
+            udp->resume();
+        }
     }
 
     return 0;
 }
 
+static int ludp_close(lua_State *L);
+
 static int lclose(lua_State *L) {
     uint32_t id = static_cast<uint32_t>(luaL_checkinteger(L, 1));
 
-    auto server = server_map[id];
-    auto client = client_map[id];
-    auto session = session_map[id];
+    auto server = server_map.get(id);
+    auto client = client_map.get(id);
+    auto session = session_map.get(id);
 
     if (server) {
         server->close();
-        server_map[id] = nullptr;
+        server_map.erase(id);
     } else if (client) {
         client->close();
-        client_map[id] = nullptr;
-        session_map[id] = nullptr;
+        client_map.erase(id);
+        session_map.erase(id);
     } else if (session) {
         session->close();
-        session_map[id] = nullptr;
+        session_map.erase(id);
+    } else {
+        return ludp_close(L);
     }
 
     return 0;
 }
 
+// the options of a reliable udp socket, see arq_config
+static void _arq_config(lua_State *L, int index, arq_config &config) {
+    luaL_checktype(L, index, LUA_TTABLE);
+    struct {
+        const char *name;
+        uint32_t *value;
+        lua_Integer min;
+        lua_Integer max;
+    } integers[] = {
+        {"interval", &config.interval, 1, 5000},
+        {"resend", &config.resend, 0, 64},
+        {"sndwnd", &config.sndwnd, 1, 65535},
+        {"rcvwnd", &config.rcvwnd, 1, 65535},
+        {"mtu", &config.mtu, 64, UDP_BLOCK_SIZE},
+    };
+    for (auto &field : integers) {
+        if (lua_getfield(L, index, field.name) != LUA_TNIL) {
+            lua_Integer v = luaL_checkinteger(L, -1);
+            if (v < field.min || v > field.max) {
+                luaL_error(L, "arq option %s = %d out of [%d, %d]", field.name,
+                           static_cast<int>(v), static_cast<int>(field.min),
+                           static_cast<int>(field.max));
+            }
+            *field.value = static_cast<uint32_t>(v);
+        }
+        lua_pop(L, 1);
+    }
+    struct {
+        const char *name;
+        bool *value;
+    } booleans[] = {
+        {"nodelay", &config.nodelay},
+        {"nocwnd", &config.nocwnd},
+        {"message", &config.message},
+    };
+    for (auto &field : booleans) {
+        if (lua_getfield(L, index, field.name) != LUA_TNIL) {
+            *field.value = lua_toboolean(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+}
+
 static int ludp_listen(lua_State *L) {
     cell *c = cell_fromuserdata(L, 1);
     if (c == nullptr) {
@@ -354,14 +432,19 @@ static int ludp_listen(lua_State *L) {
     }
     const char *addr = luaL_checkstring(L, 2);
     unsigned short port = static_cast<unsigned short>(luaL_checkinteger(L, 3));
-
-    auto s = std::make_shared<udp_server>(c, addr, port);
-    if (s->listen()) {
-        udp_server_map[s->session_id()] = s;
-        lua_pushinteger(L, s->session_id());
-        return 1;
+    lua_Integer event = luaL_checkinteger(L, 4);
+    // reliable with options
+    arq_config config;
+    bool reliable = !lua_isnoneornil(L, 5);
+    if (reliable) {
+        _arq_config(L, 5, config);
     }
 
+    auto s = std::make_shared<udp_server>(c, addr, port,
+                                          reliable ? &config : nullptr);
+    udp_server_map.set(s->session_id(), s);
+    s->listen(event);
+
     return 0;
 }
 
@@ -373,13 +456,18 @@ static int ludp_connect(lua_State *L) {
     const char *addr = luaL_checkstring(L, 2);
     unsigned short port = static_cast<unsigned short>(luaL_checkinteger(L, 3));
     lua_Integer event = luaL_checkinteger(L, 4);
-
-    auto cl = std::make_shared<udp_client>(c, addr, port);
-    if (cl->connect(event)) {
-        udp_client_map[cl->session_id()] = cl;
-        udp_session_map[cl->session_id()] = cl->get_session();
+    arq_config config;
+    bool reliable = !lua_isnoneornil(L, 5);
+    if (reliable) {
+        _arq_config(L, 5, config);
     }
 
+    auto cl = std::make_shared<udp_client>(c, addr, port,
+                                           reliable ? &config : nullptr);
+    udp_client_map.set(cl->session_id(), cl);
+    udp_session_map.set(cl->session_id(), cl->get_session());
+    cl->connect(event);
+
     return 0;
 }
 
@@ -389,12 +477,12 @@ static int ludp_forward(lua_State *L) {
     if (c == nullptr) {
         return 0;
     }
-    auto session = udp_session_map[session_id];
+    auto session = udp_session_map.get(session_id);
     if (session == nullptr) {
         return 0;
     }
-    int boolean = session->set_to_cell(c);
-    lua_pushboolean(L, boolean);
+    session->set_to_cell(c);
+    lua_pushboolean(L, 1);
     return 1;
 }
 
@@ -402,7 +490,14 @@ static int ludp_send(lua_State *L) {
     uint32_t id = static_cast<uint32_t>(luaL_checkinteger(L, 1));
     std::size_t sz = static_cast<std::size_t>(luaL_checkinteger(L, 2));
     auto msg = static_cast<const char *>(lua_touserdata(L, 3));
-    auto session = udp_session_map[id];
+    shared_buffer *b = buffer_fromuserdata(L, 3);
+    if (b) {
+        // datagrams are small, keep the udp write path owning its bytes
+        char *tmp = new char[sz];
+        memcpy(tmp, buffer_data(b), sz);
+        msg = tmp;
+    }
+    auto session = udp_session_map.get(id);
     if (session == nullptr) {
         delete[] msg;
         return luaL_error(L, "Write to invalid udp socket %d", id);
@@ -411,6 +506,34 @@ static int ludp_send(lua_State *L) {
     return 0;
 }
 
+// from any cell, like lwrite, the datagram joins the socket's next batch
+static int ludp_write(lua_State *L) {
+    uint32_t id = static_cast<uint32_t>(luaL_checkinteger(L, 1));
+    auto session = udp_session_map.get(id);
+    if (session == nullptr) {
+        return 0;
+    }
+    std::size_t len = 0;
+    const char *str = nullptr;
+    shared_buffer *b = buffer_fromuserdata(L, 2);
+    if (b) {
+        str = buffer_data(b);
+        len = buffer_size(b);
+    } else {
+        str = luaL_checklstring(L, 2, &len);
+    }
+    if (len > session->write_limit()) {
+        // lua errors longjmp, the session is not to be held past one
+        session.reset();
+        return luaL_argerror(L, 2, "message too large");
+    }
+    char *msg = new char[len];
+    memcpy(msg, str, len);
+    session->write(msg, len);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 static int ludp_free(lua_State *L) {
     udp_read_buffer *buffer =
         static_cast<udp_read_buffer *>(lua_touserdata(L, 1));
@@ -466,22 +589,23 @@ static int ludp_pop(lua_State *L) {
 static int ludp_close(lua_State *L) {
     uint32_t id = static_cast<uint32_t>(luaL_checkinteger(L, 1));
 
-    auto server = udp_server_map[id];
-    auto client = udp_client_map[id];
-    auto session = udp_session_map[id];
+    auto server = udp_server_map.get(id);
+    auto client = udp_client_map.get(id);
+    auto session = udp_session_map.get(id);
 
     if (server) {
         server->close();
-        udp_server_map[id] = nullptr;
+        udp_server_map.erase(id);
     } else if (client) {
         client->close();
-        udp_client_map[id] = nullptr;
-        udp_session_map[id] = nullptr;
+        udp_client_map.erase(id);
+        udp_session_map.erase(id);
     } else if (session) {
         session->close();
-        udp_session_map[id] = nullptr;
-        server = udp_server_map[session->belong_session_id()];
-        if (server) {
+        udp_session_map.erase(id);
+        server = udp_server_map.get(session->belong_session_id());
+        // a reliable one leaves once done lingering
+        if (server && !session->reliable()) {
             server->remove_session(session->remote_endpoint());
         }
     }
@@ -489,16 +613,67 @@ static int ludp_close(lua_State *L) {
     return 0;
 }
 
+// live handles and table entries, slots is the high water mark of handles
+static int lstats(lua_State *L) {
+    lua_createtable(L, 0, 22);
+    lua_pushinteger(L, handles.live_count());
+    lua_setfield(L, -2, "handles");
+    lua_pushinteger(L, handles.slot_count());
+    lua_setfield(L, -2, "slots");
+    lua_pushinteger(L, session_map.size());
+    lua_setfield(L, -2, "sessions");
+    lua_pushinteger(L, server_map.size());
+    lua_setfield(L, -2, "servers");
+    lua_pushinteger(L, client_map.size());
+    lua_setfield(L, -2, "clients");
+    lua_pushinteger(L, udp_session_map.size());
+    lua_setfield(L, -2, "udp_sessions");
+    lua_pushinteger(L, udp_server_map.size());
+    lua_setfield(L, -2, "udp_servers");
+    lua_pushinteger(L, udp_client_map.size());
+    lua_setfield(L, -2, "udp_clients");
+    dns_stats dns = dns_get_stats();
+    lua_pushinteger(L, dns.lookups);
+    lua_setfield(L, -2, "dns_lookups");
+    lua_pushinteger(L, dns.hits);
+    lua_setfield(L, -2, "dns_hits");
+    lua_pushinteger(L, dns.failures);
+    lua_setfield(L, -2, "dns_failures");
+    lua_pushinteger(L, dns.cached);
+    lua_setfield(L, -2, "dns_cached");
+    lua_pushinteger(L, dns.pending);
+    lua_setfield(L, -2, "dns_pending");
+    lua_pushnumber(L, dns.avg_ms);
+    lua_setfield(L, -2, "dns_ms_avg");
+    lua_pushnumber(L, dns.max_ms);
+    lua_setfield(L, -2, "dns_ms_max");
+    tls_stats tls = tls_get_stats();
+    lua_pushinteger(L, tls.handshakes);
+    lua_setfield(L, -2, "tls_handshakes");
+    lua_pushinteger(L, tls.resumed);
+    lua_setfield(L, -2, "tls_resumed");
+    lua_pushinteger(L, tls.failures);
+    lua_setfield(L, -2, "tls_failures");
+    lua_pushinteger(L, tls.pending);
+    lua_setfield(L, -2, "tls_pending");
+    lua_pushinteger(L, tls.cached);
+    lua_setfield(L, -2, "tls_cached");
+    lua_pushnumber(L, tls.avg_ms);
+    lua_setfield(L, -2, "tls_ms_avg");
+    lua_pushnumber(L, tls.max_ms);
+    lua_setfield(L, -2, "tls_ms_max");
+    return 1;
+}
+
 int socket_lib(lua_State *L) {
     luaL_checkversion(L);
     luaL_Reg l[] = {
         {"listen", llisten},
         {"connect", lconnect},
-        {"pollonce", lpollonce},
-        {"pollfor", lpollfor},
         {"forward", lforward},
         {"sendpack", lsendpack},
         {"send", lsend},
+        {"write", lwrite},
         {"push", lpush},
         {"readline", lreadline},
         {"pop", lpop},
@@ -513,6 +688,9 @@ int socket_lib(lua_State *L) {
         {"udp_push", ludp_push},
         {"udp_pop", ludp_pop},
         {"udp_close", ludp_close},
+        {"stats", lstats},
+        {"udp_write", ludp_write},
+        {"framing", lframing},
         {nullptr, nullptr},
     };
     luaL_newlib(L, l);
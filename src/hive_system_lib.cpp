@@ -19,8 +19,14 @@ static int llaunch(lua_State *L) {
     if (lua_type(L, 2) == LUA_TSTRING) {
         loadername = luaL_checkstring(L, 2);
     }
-    lua_State *sL = scheduler_newtask(L, true);
-    cell *c = cell_new(sL, filename, loadername);
+    cell *c = nullptr;
+    lua_State *sL = scheduler_pooltask(L, loadername);
+    if (sL) {
+        c = cell_start(sL, filename);
+    } else {
+        sL = scheduler_newtask(L, true);
+        c = cell_new(sL, filename, loadername);
+    }
     if (c) {
         cell_touserdata(L, lua_upvalueindex(1), c);
         scheduler_starttask(sL);
@@ -0,0 +1,226 @@
+#include "hive_timer.h"
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+#include "hive_cell.h"
+#include "hive_seri.h"
+
+// Hierarchical timing wheel in milliseconds, ported from skynet's timer:
+// one near wheel of 256 slots and four levels of 64 slots cascading down.
+static const int TIME_NEAR_SHIFT = 8;
+static const int TIME_NEAR = 1 << TIME_NEAR_SHIFT;
+static const int TIME_LEVEL_SHIFT = 6;
+static const int TIME_LEVEL = 1 << TIME_LEVEL_SHIFT;
+static const uint32_t TIME_NEAR_MASK = TIME_NEAR - 1;
+static const uint32_t TIME_LEVEL_MASK = TIME_LEVEL - 1;
+
+struct timer_node {
+    timer_node *next{nullptr};
+    uint32_t expire{0};
+    cell *c{nullptr};
+    lua_Integer event{0};
+};
+
+struct link_list {
+    timer_node head;
+    timer_node *tail{&head};
+};
+
+struct timewheel {
+    link_list near[TIME_NEAR];
+    link_list t[4][TIME_LEVEL];
+    std::mutex mut;
+    uint32_t time{0};
+    long long current_point{0};
+    int size{0};
+};
+
+static long long _gettime() {
+    auto duration_in_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch());
+    return duration_in_ms.count();
+}
+
+static timer_node *link_clear(link_list *list) {
+    timer_node *ret = list->head.next;
+    list->head.next = nullptr;
+    list->tail = &list->head;
+    return ret;
+}
+
+static void link(link_list *list, timer_node *node) {
+    list->tail->next = node;
+    list->tail = node;
+    node->next = nullptr;
+}
+
+static void add_node(timewheel *tw, timer_node *node) {
+    uint32_t time = node->expire;
+    uint32_t current_time = tw->time;
+
+    if ((time | TIME_NEAR_MASK) == (current_time | TIME_NEAR_MASK)) {
+        link(&tw->near[time & TIME_NEAR_MASK], node);
+    } else {
+        int i = 0;
+        uint32_t mask = TIME_NEAR << TIME_LEVEL_SHIFT;
+        for (i = 0; i < 3; i++) {
+            if ((time | (mask - 1)) == (current_time | (mask - 1))) {
+                break;
+            }
+            mask <<= TIME_LEVEL_SHIFT;
+        }
+        link(&tw->t[i][((time >> (TIME_NEAR_SHIFT + i * TIME_LEVEL_SHIFT)) &
+                        TIME_LEVEL_MASK)],
+             node);
+    }
+}
+
+static void move_list(timewheel *tw, int level, int idx) {
+    timer_node *current = link_clear(&tw->t[level][idx]);
+    while (current) {
+        timer_node *next = current->next;
+        add_node(tw, current);
+        current = next;
+    }
+}
+
+static void timer_shift(timewheel *tw) {
+    uint32_t mask = TIME_NEAR;
+    uint32_t ct = ++tw->time;
+    if (ct == 0) {
+        move_list(tw, 3, 0);
+    } else {
+        uint32_t time = ct >> TIME_NEAR_SHIFT;
+        int i = 0;
+        while ((ct & (mask - 1)) == 0) {
+            int idx = static_cast<int>(time & TIME_LEVEL_MASK);
+            if (idx != 0) {
+                move_list(tw, i, idx);
+                break;
+            }
+            mask <<= TIME_LEVEL_SHIFT;
+            time >>= TIME_LEVEL_SHIFT;
+            ++i;
+        }
+    }
+}
+
+static void _wakeup(cell *c, lua_Integer event) {
+    // the same response the system cell used to send for "timeout"
+    write_block b;
+    b.init(nullptr);
+    b.wb_integer(event);
+    b.wb_boolean(1);
+    block *ret = b.close();
+    if (cell_send(c, 1, ret)) {
+        b.free();
+    }
+    cell_release(c);
+}
+
+static int dispatch_list(timer_node *current) {
+    int n = 0;
+    while (current) {
+        timer_node *next = current->next;
+        _wakeup(current->c, current->event);
+        delete current;
+        current = next;
+        ++n;
+    }
+    return n;
+}
+
+// called with tw->mut locked
+static int timer_execute(timewheel *tw) {
+    int n = 0;
+    int idx = tw->time & TIME_NEAR_MASK;
+    while (tw->near[idx].head.next) {
+        timer_node *current = link_clear(&tw->near[idx]);
+        // deliver without the lock, cells may add timers meanwhile
+        tw->mut.unlock();
+        n += dispatch_list(current);
+        tw->mut.lock();
+    }
+    tw->size -= n;
+    return n;
+}
+
+static int timer_tick(timewheel *tw) {
+    tw->mut.lock();
+    // try to dispatch timeout 0 (rare condition)
+    int n = timer_execute(tw);
+    timer_shift(tw);
+    n += timer_execute(tw);
+    tw->mut.unlock();
+    return n;
+}
+
+timewheel *timewheel_new() {
+    timewheel *tw = new timewheel;
+    tw->current_point = _gettime();
+    return tw;
+}
+
+void timewheel_release(timewheel *tw) {
+    auto free_list = [](link_list *list) {
+        timer_node *current = link_clear(list);
+        while (current) {
+            timer_node *next = current->next;
+            cell_release(current->c);
+            delete current;
+            current = next;
+        }
+    };
+    for (int i = 0; i < TIME_NEAR; i++) {
+        free_list(&tw->near[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < TIME_LEVEL; j++) {
+            free_list(&tw->t[i][j]);
+        }
+    }
+    delete tw;
+}
+
+void timewheel_add(timewheel *tw, cell *c, lua_Integer ti,
+                   lua_Integer event) {
+    cell_grab(c);
+    // ti <= 0 (cell.yield) still waits for the next tick, giving the
+    // cell's queued messages a turn before it resumes
+    if (ti < 0) {
+        ti = 0;
+    }
+
+    timer_node *node = new timer_node;
+    node->c = c;
+    node->event = event;
+
+    tw->mut.lock();
+    node->expire = static_cast<uint32_t>(ti) + tw->time;
+    add_node(tw, node);
+    ++tw->size;
+    tw->mut.unlock();
+}
+
+int timewheel_update(timewheel *tw) {
+    long long cp = _gettime();
+    if (cp <= tw->current_point) {
+        return 0;
+    }
+    long long diff = cp - tw->current_point;
+    tw->current_point = cp;
+    int n = 0;
+    for (long long i = 0; i < diff; i++) {
+        n += timer_tick(tw);
+    }
+    return n;
+}
+
+int timewheel_size(timewheel *tw) {
+    tw->mut.lock();
+    int size = tw->size;
+    tw->mut.unlock();
+    return size;
+}
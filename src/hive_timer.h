@@ -0,0 +1,17 @@
+#ifndef hive_timer_h
+#define hive_timer_h
+
+#include "lua.hpp"
+
+struct cell;
+struct timewheel;
+
+timewheel *timewheel_new();
+void timewheel_release(timewheel *tw);
+// wake cell c with a response for session event after ti milliseconds
+void timewheel_add(timewheel *tw, cell *c, lua_Integer ti, lua_Integer event);
+// advance the wheel to the monotonic clock, return the number of timeouts
+int timewheel_update(timewheel *tw);
+int timewheel_size(timewheel *tw);
+
+#endif
@@ -0,0 +1,362 @@
+#include "hive_tls.h"
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "asio/post.hpp"
+#include "asio/thread_pool.hpp"
+
+// client sessions kept to resume, one per context, name, host and port
+static const std::size_t TLS_CACHE_SIZE = 1024;
+// a record holds at most this much plaintext
+static const std::size_t TLS_RECORD_SIZE = 16 * 1024;
+
+using tls_clock = std::chrono::steady_clock;
+
+struct tls_context {
+    SSL_CTX *ctx{nullptr};
+    bool server{false};
+    // a client's sessions are only resumed by the same context, which
+    // verified the peer alike
+    std::string name;
+
+    ~tls_context() { SSL_CTX_free(ctx); }
+};
+
+static std::once_flag init_once;
+static std::mutex mut;
+static std::unordered_map<std::string, std::shared_ptr<tls_context>> clients;
+static std::unordered_map<std::string, SSL_SESSION *> sessions;
+static tls_stats stats{};
+static double total_ms = 0;
+
+static void _init() {
+    std::call_once(init_once, []() {
+        SSL_library_init();
+        SSL_load_error_strings();
+    });
+}
+
+// the first error queued on this thread, the queue is left empty
+static std::string _error(const char *what) {
+    std::string msg(what);
+    unsigned long e = ERR_get_error();
+    if (e != 0) {
+        char buf[256];
+        ERR_error_string_n(e, buf, sizeof(buf));
+        msg += ": ";
+        msg += buf;
+    }
+    ERR_clear_error();
+    return msg;
+}
+
+static bool _max_version(SSL_CTX *ctx, const std::string &version,
+                         std::string &err) {
+    if (version.empty()) {
+        return true;
+    }
+    int v = version == "1.2" ? TLS1_2_VERSION
+            : version == "1.3" ? TLS1_3_VERSION
+                               : 0;
+    if (v == 0 || SSL_CTX_set_max_proto_version(ctx, v) != 1) {
+        err = "unknown tls max_version " + version;
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<tls_context> tls_server_context(const tls_options &opts,
+                                                std::string &err) {
+    _init();
+    if (opts.cert.empty() || opts.key.empty()) {
+        err = "tls server needs cert and key";
+        return nullptr;
+    }
+    auto c = std::make_shared<tls_context>();
+    c->server = true;
+    c->ctx = SSL_CTX_new(TLS_server_method());
+    if (!c->ctx) {
+        err = _error("SSL_CTX_new");
+        return nullptr;
+    }
+    if (!_max_version(c->ctx, opts.max_version, err)) {
+        return nullptr;
+    }
+    if (SSL_CTX_use_certificate_chain_file(c->ctx, opts.cert.c_str()) != 1) {
+        err = _error(opts.cert.c_str());
+        return nullptr;
+    }
+    if (SSL_CTX_use_PrivateKey_file(c->ctx, opts.key.c_str(),
+                                    SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(c->ctx) != 1) {
+        err = _error(opts.key.c_str());
+        return nullptr;
+    }
+    static const unsigned char sid_ctx[] = "hive";
+    SSL_CTX_set_session_id_context(c->ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(c->ctx, SSL_SESS_CACHE_SERVER);
+    return c;
+}
+
+std::shared_ptr<tls_context> tls_client_context(const tls_options &opts,
+                                                std::string &err) {
+    _init();
+    std::string key = opts.max_version + "|" +
+                      (opts.verify ? "verify:" + opts.cafile : "");
+    std::lock_guard<std::mutex> lock(mut);
+    auto it = clients.find(key);
+    if (it != clients.end()) {
+        return it->second;
+    }
+    auto c = std::make_shared<tls_context>();
+    c->name = key;
+    c->ctx = SSL_CTX_new(TLS_client_method());
+    if (!c->ctx) {
+        err = _error("SSL_CTX_new");
+        return nullptr;
+    }
+    if (!_max_version(c->ctx, opts.max_version, err)) {
+        return nullptr;
+    }
+    if (opts.verify) {
+        int ok = opts.cafile.empty()
+                     ? SSL_CTX_set_default_verify_paths(c->ctx)
+                     : SSL_CTX_load_verify_locations(
+                           c->ctx, opts.cafile.c_str(), nullptr);
+        if (ok != 1) {
+            err = _error(opts.cafile.empty() ? "default verify paths"
+                                             : opts.cafile.c_str());
+            return nullptr;
+        }
+        SSL_CTX_set_verify(c->ctx, SSL_VERIFY_PEER, nullptr);
+    } else {
+        SSL_CTX_set_verify(c->ctx, SSL_VERIFY_NONE, nullptr);
+    }
+    clients[key] = c;
+    return c;
+}
+
+void tls_offload(std::function<void()> job) {
+    // a handshake is mostly public key math, it gets threads of its own so
+    // a burst of them doesn't hold up the sockets, never freed as the
+    // network threads
+    static asio::thread_pool *pool = new asio::thread_pool(std::max(
+        1u, std::min(4u, std::thread::hardware_concurrency() / 2)));
+    asio::post(*pool, std::move(job));
+}
+
+tls_stream::tls_stream(std::shared_ptr<tls_context> ctx,
+                       const std::string &peer,
+                       const std::string &servername)
+    : ctx(ctx) {
+    if (!peer.empty()) {
+        this->peer = ctx->name + "|" + servername + "|" + peer;
+    }
+    SSL *s = SSL_new(ctx->ctx);
+    BIO *in = BIO_new(BIO_s_mem());
+    BIO *out = BIO_new(BIO_s_mem());
+    BIO_set_mem_eof_return(in, -1);
+    BIO_set_mem_eof_return(out, -1);
+    SSL_set_bio(s, in, out);
+    ssl = s;
+    in_bio = in;
+    out_bio = out;
+    if (ctx->server) {
+        SSL_set_accept_state(s);
+        return;
+    }
+    SSL_set_connect_state(s);
+    if (!servername.empty()) {
+        bool verify = SSL_CTX_get_verify_mode(ctx->ctx) & SSL_VERIFY_PEER;
+        ASN1_OCTET_STRING *ip = a2i_IPADDRESS(servername.c_str());
+        if (ip != nullptr) {
+            // an address is never sent as SNI, it is checked against the
+            // IP names of the certificate
+            ASN1_OCTET_STRING_free(ip);
+            if (verify) {
+                X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(s),
+                                              servername.c_str());
+            }
+        } else {
+            SSL_set_tlsext_host_name(s, servername.c_str());
+            if (verify) {
+                SSL_set1_host(s, servername.c_str());
+            }
+        }
+    }
+    std::lock_guard<std::mutex> lock(mut);
+    auto it = sessions.find(this->peer);
+    if (it != sessions.end()) {
+        SSL_set_session(s, it->second);
+    }
+}
+
+tls_stream::~tls_stream() {
+    if (start != tls_clock::time_point()) {
+        // left in the middle of its handshake
+        std::lock_guard<std::mutex> lock(mut);
+        --stats.pending;
+    }
+    // frees the bios too
+    SSL_free(static_cast<SSL *>(ssl));
+}
+
+void tls_stream::fail(const char *what, int ret) {
+    SSL *s = static_cast<SSL *>(ssl);
+    int e = SSL_get_error(s, ret);
+    if (e == SSL_ERROR_SSL) {
+        err = _error(what);
+        long v = SSL_get_verify_result(s);
+        if (v != X509_V_OK) {
+            err += ", ";
+            err += X509_verify_cert_error_string(v);
+        }
+    } else {
+        err = std::string(what) + " error " + std::to_string(e);
+        ERR_clear_error();
+    }
+}
+
+tls_result tls_stream::handshake(const char *data, std::size_t len) {
+    SSL *s = static_cast<SSL *>(ssl);
+    if (start == tls_clock::time_point()) {
+        start = tls_clock::now();
+        std::lock_guard<std::mutex> lock(mut);
+        ++stats.pending;
+    }
+    if (len > 0) {
+        BIO_write(static_cast<BIO *>(in_bio), data, static_cast<int>(len));
+    }
+    int ret = SSL_do_handshake(s);
+    tls_result r = tls_result::done;
+    if (ret != 1) {
+        int e = SSL_get_error(s, ret);
+        if (e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE) {
+            return tls_result::more;
+        }
+        fail("handshake", ret);
+        r = tls_result::failed;
+    }
+
+    double ms = std::chrono::duration<double, std::milli>(tls_clock::now() -
+                                                          start)
+                    .count();
+    start = tls_clock::time_point();
+    SSL_SESSION *keep = nullptr;
+    bool reused = r == tls_result::done && SSL_session_reused(s);
+    if (r == tls_result::done && !ctx->server && !peer.empty()) {
+        keep = SSL_get1_session(s);
+    }
+    std::lock_guard<std::mutex> lock(mut);
+    --stats.pending;
+    if (r == tls_result::failed) {
+        ++stats.failures;
+        return r;
+    }
+    ++stats.handshakes;
+    if (reused) {
+        ++stats.resumed;
+    }
+    total_ms += ms;
+    stats.max_ms = std::max(stats.max_ms, ms);
+    if (keep) {
+        auto it = sessions.find(peer);
+        if (it != sessions.end()) {
+            SSL_SESSION_free(it->second);
+            it->second = keep;
+        } else {
+            if (sessions.size() >= TLS_CACHE_SIZE) {
+                SSL_SESSION_free(sessions.begin()->second);
+                sessions.erase(sessions.begin());
+            }
+            sessions[peer] = keep;
+        }
+    }
+    return r;
+}
+
+tls_result tls_stream::decrypt(const char *data, std::size_t len,
+                               std::vector<r_block *> &out) {
+    SSL *s = static_cast<SSL *>(ssl);
+    if (len > 0) {
+        BIO_write(static_cast<BIO *>(in_bio), data, static_cast<int>(len));
+    }
+    r_block *b = nullptr;
+    tls_result r = tls_result::more;
+    while (true) {
+        if (!b) {
+            b = rblock_new(TLS_RECORD_SIZE);
+        }
+        int n = SSL_read(s, b->data + b->len,
+                         static_cast<int>(b->cap - b->len));
+        if (n > 0) {
+            b->len += n;
+            if (b->len == b->cap) {
+                out.push_back(b);
+                b = nullptr;
+            }
+            continue;
+        }
+        int e = SSL_get_error(s, n);
+        if (e == SSL_ERROR_ZERO_RETURN) {
+            r = tls_result::closed;
+        } else if (e != SSL_ERROR_WANT_READ && e != SSL_ERROR_WANT_WRITE) {
+            fail("read", n);
+            r = tls_result::failed;
+        }
+        break;
+    }
+    if (b->len > 0) {
+        out.push_back(b);
+    } else {
+        rblock_free(b);
+    }
+    return r;
+}
+
+bool tls_stream::encrypt(const char *data, std::size_t len) {
+    SSL *s = static_cast<SSL *>(ssl);
+    while (len > 0) {
+        // the out bio grows as needed, a write is never short
+        int n = SSL_write(s, data, static_cast<int>(
+                                       std::min(len, TLS_RECORD_SIZE * 4)));
+        if (n <= 0) {
+            fail("write", n);
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+void tls_stream::shutdown() {
+    SSL_shutdown(static_cast<SSL *>(ssl));
+    ERR_clear_error();
+}
+
+char *tls_stream::output(std::size_t &len) {
+    BIO *out = static_cast<BIO *>(out_bio);
+    len = BIO_ctrl_pending(out);
+    if (len == 0) {
+        return nullptr;
+    }
+    char *data = new char[len];
+    BIO_read(out, data, static_cast<int>(len));
+    return data;
+}
+
+tls_stats tls_get_stats() {
+    std::lock_guard<std::mutex> lock(mut);
+    tls_stats s = stats;
+    s.cached = static_cast<int>(sessions.size());
+    s.avg_ms = s.handshakes > 0 ? total_ms / s.handshakes : 0;
+    return s;
+}
@@ -0,0 +1,101 @@
+#ifndef hive_tls_h
+#define hive_tls_h
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "asio_buffer.h"
+
+// TLS for tcp sessions on memory BIOs, so cells read and write plaintext.
+// Handshakes run a step at a time on threads of their own, the network
+// threads only seal and open records. A client keeps the session of its
+// last handshake per host and port to resume the next one, a server
+// resumes from the cache and tickets of its context.
+
+struct tls_options {
+    // server, PEM files
+    std::string cert;
+    std::string key;
+    // client, the name sent and verified, and the CA file to verify with
+    std::string servername;
+    std::string cafile;
+    bool verify{false};
+    // "1.2" or "1.3", empty : the most the library speaks. LibreSSL only
+    // resumes TLS 1.2 sessions
+    std::string max_version;
+};
+
+struct tls_context;
+
+// nullptr and err when the files don't load
+std::shared_ptr<tls_context> tls_server_context(const tls_options &opts,
+                                                std::string &err);
+// one per verify setting and max_version, shared by every client
+std::shared_ptr<tls_context> tls_client_context(const tls_options &opts,
+                                                std::string &err);
+
+// run job on a handshake thread
+void tls_offload(std::function<void()> job);
+
+enum class tls_result { more, done, closed, failed };
+
+// One end of a connection. handshake runs on a handshake thread, the rest
+// on the network thread of the session, never both at once.
+class tls_stream {
+   public:
+    tls_stream(const tls_stream &) = delete;
+    tls_stream &operator=(const tls_stream &) = delete;
+
+    // peer is the key a client resumes by. servername is a host name, sent
+    // as SNI, or an address, and a verifying client checks the certificate
+    // against it
+    tls_stream(std::shared_ptr<tls_context> ctx, const std::string &peer,
+               const std::string &servername);
+    ~tls_stream();
+
+    // feeds the records read, more until the handshake is done or failed
+    tls_result handshake(const char *data, std::size_t len);
+    // the plaintext of the records read appended to out as blocks, closed
+    // once the peer sent close_notify
+    tls_result decrypt(const char *data, std::size_t len,
+                       std::vector<r_block *> &out);
+    bool encrypt(const char *data, std::size_t len);
+    // close_notify
+    void shutdown();
+    // the records to send, a new[] array, nullptr when there are none
+    char *output(std::size_t &len);
+
+    const std::string &error() const { return err; }
+
+   private:
+    void fail(const char *what, int ret);
+
+    std::shared_ptr<tls_context> ctx;
+    std::string peer;
+    void *ssl{nullptr};
+    void *in_bio{nullptr};
+    void *out_bio{nullptr};
+    std::string err;
+    std::chrono::steady_clock::time_point start;
+};
+
+// of both ends
+struct tls_stats {
+    long long handshakes;
+    long long resumed;
+    long long failures;
+    // handshakes on their way
+    int pending;
+    // client sessions kept to resume
+    int cached;
+    // milliseconds per handshake, from the first record to the last
+    double avg_ms;
+    double max_ms;
+};
+
+tls_stats tls_get_stats();
+
+#endif
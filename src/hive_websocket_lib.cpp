@@ -0,0 +1,403 @@
+#include "hive_websocket_lib.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WS_MASK_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define WS_MASK_NEON
+#endif
+
+#ifdef HIVE_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#include "asio_buffer.h"
+
+// Reads WebSocket frames (RFC 6455) off the front of a socket read buffer
+// and builds them back into single strings, masking 16 bytes at a time.
+// frame returns what it read and drops it from the buffer, or nil and the
+// bytes buffered when the frame is not all here, or false and the close
+// code to answer when it is malformed. With zlib, deflate and inflate do
+// permessage-deflate (RFC 7692) without context takeover.
+
+// payloads longer than this are refused unless a limit is given
+static const lua_Integer WS_FRAME_LIMIT = 256 * 1024;
+// the close codes for a broken frame and for one over the limit
+static const int WS_PROTOCOL_ERROR = 1002;
+static const int WS_TOO_BIG = 1009;
+
+// byte i of the buffer, -1 past its end
+static int _byte(read_buffer *buffer, std::size_t i) {
+    for (r_block *b = buffer->head; b != nullptr; b = b->next) {
+        std::size_t n = b->len - b->ptr;
+        if (i < n) {
+            return static_cast<unsigned char>(b->data[b->ptr + i]);
+        }
+        i -= n;
+    }
+    return -1;
+}
+
+// n bytes of src xor key into dst, key[0] going on src[0]
+static void _mask(char *dst, const char *src, std::size_t n,
+                  const unsigned char key[4]) {
+    unsigned char k[16];
+    for (int i = 0; i < 16; i++) {
+        k[i] = key[i & 3];
+    }
+    std::size_t i = 0;
+#if defined(WS_MASK_SSE2)
+    __m128i vk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(k));
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_xor_si128(v, vk));
+    }
+#elif defined(WS_MASK_NEON)
+    uint8x16_t vk = vld1q_u8(k);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(src + i));
+        vst1q_u8(reinterpret_cast<uint8_t *>(dst + i), veorq_u8(v, vk));
+    }
+#endif
+    uint64_t wk;
+    memcpy(&wk, k, sizeof(wk));
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, src + i, sizeof(w));
+        w ^= wk;
+        memcpy(dst + i, &w, sizeof(w));
+    }
+    for (; i < n; i++) {
+        dst[i] = src[i] ^ k[i & 3];
+    }
+}
+
+// the key turned so its byte at offset comes first
+static void _turn(const unsigned char key[4], std::size_t offset,
+                  unsigned char out[4]) {
+    for (int i = 0; i < 4; i++) {
+        out[i] = key[(offset + i) & 3];
+    }
+}
+
+// size bytes from offset on out of the buffer into dst, unmasked when key
+// is set
+static void _copy(read_buffer *buffer, std::size_t offset, char *dst,
+                  std::size_t size, const unsigned char *key) {
+    std::size_t done = 0;
+    for (r_block *b = buffer->head; b != nullptr && done < size; b = b->next) {
+        std::size_t n = b->len - b->ptr;
+        if (offset >= n) {
+            offset -= n;
+            continue;
+        }
+        const char *src = b->data + b->ptr + offset;
+        n -= offset;
+        offset = 0;
+        if (n > size - done) {
+            n = size - done;
+        }
+        if (key) {
+            unsigned char k[4];
+            _turn(key, done, k);
+            _mask(dst + done, src, n, k);
+        } else {
+            memcpy(dst + done, src, n);
+        }
+        done += n;
+    }
+}
+
+static int _more(lua_State *L, read_buffer *buffer) {
+    lua_pushnil(L);
+    lua_pushinteger(L, buffer ? static_cast<lua_Integer>(buffer->len) : 0);
+    return 2;
+}
+
+static int _bad(lua_State *L, int code) {
+    lua_pushboolean(L, 0);
+    lua_pushinteger(L, code);
+    return 2;
+}
+
+// buffer [, limit] -> opcode, payload, fin, rsv1 of the next frame, its
+// payload unmasked
+static int lframe(lua_State *L) {
+    read_buffer *buffer = static_cast<read_buffer *>(lua_touserdata(L, 1));
+    lua_Integer limit = luaL_optinteger(L, 2, WS_FRAME_LIMIT);
+    if (buffer == nullptr || buffer->len < 2) {
+        return _more(L, buffer);
+    }
+    int b0 = _byte(buffer, 0);
+    int b1 = _byte(buffer, 1);
+    bool fin = (b0 & 0x80) != 0;
+    int opcode = b0 & 0x0f;
+    bool masked = (b1 & 0x80) != 0;
+    uint64_t size = b1 & 0x7f;
+    // rsv2 and rsv3 belong to no extension we speak
+    if ((b0 & 0x30) != 0) {
+        return _bad(L, WS_PROTOCOL_ERROR);
+    }
+
+    std::size_t head = 2;
+    std::size_t extra = size == 126 ? 2 : size == 127 ? 8 : 0;
+    if (buffer->len < head + extra + (masked ? 4 : 0)) {
+        return _more(L, buffer);
+    }
+    if (extra > 0) {
+        size = 0;
+        for (std::size_t i = 0; i < extra; i++) {
+            size = (size << 8) | static_cast<uint64_t>(_byte(buffer, head + i));
+        }
+        head += extra;
+        if (size >> 63) {
+            return _bad(L, WS_PROTOCOL_ERROR);
+        }
+    }
+    // control frames are short and whole
+    if ((opcode & 0x08) != 0 && (size > 125 || !fin)) {
+        return _bad(L, WS_PROTOCOL_ERROR);
+    }
+    if (size > static_cast<uint64_t>(limit)) {
+        return _bad(L, WS_TOO_BIG);
+    }
+
+    unsigned char key[4];
+    if (masked) {
+        for (int i = 0; i < 4; i++) {
+            key[i] = static_cast<unsigned char>(_byte(buffer, head + i));
+        }
+        head += 4;
+    }
+    std::size_t sz = static_cast<std::size_t>(size);
+    if (buffer->len - head < sz) {
+        return _more(L, buffer);
+    }
+
+    lua_pushinteger(L, opcode);
+    luaL_Buffer b;
+    char *payload = luaL_buffinitsize(L, &b, sz);
+    _copy(buffer, head, payload, sz, masked ? key : nullptr);
+    luaL_pushresultsize(&b, sz);
+    lua_pushboolean(L, fin);
+    lua_pushboolean(L, (b0 & 0x40) != 0);
+    buffer->skip(head + sz);
+    return 4;
+}
+
+// opcode, payload [, key [, fin [, rsv1]]] -> the frame as one string,
+// masked with the 32 bit key when there is one. fin defaults to true
+static int lencode(lua_State *L) {
+    lua_Integer opcode = luaL_checkinteger(L, 1);
+    std::size_t sz = 0;
+    const char *payload = luaL_optlstring(L, 2, "", &sz);
+    bool masked = !lua_isnoneornil(L, 3) && lua_toboolean(L, 3);
+    uint32_t k = masked ? static_cast<uint32_t>(luaL_checkinteger(L, 3)) : 0;
+    bool fin = lua_isnoneornil(L, 4) || lua_toboolean(L, 4);
+    bool rsv1 = lua_toboolean(L, 5);
+
+    unsigned char head[14];
+    std::size_t n = 0;
+    head[n++] = static_cast<unsigned char>((fin ? 0x80 : 0) | (rsv1 ? 0x40 : 0) |
+                                           (opcode & 0x0f));
+    unsigned char m = masked ? 0x80 : 0;
+    if (sz < 126) {
+        head[n++] = static_cast<unsigned char>(m | sz);
+    } else if (sz <= 0xffff) {
+        head[n++] = m | 126;
+        head[n++] = static_cast<unsigned char>(sz >> 8);
+        head[n++] = static_cast<unsigned char>(sz);
+    } else {
+        head[n++] = m | 127;
+        uint64_t v = sz;
+        for (int i = 7; i >= 0; i--) {
+            head[n++] = static_cast<unsigned char>(v >> (i * 8));
+        }
+    }
+    unsigned char key[4] = {static_cast<unsigned char>(k >> 24),
+                            static_cast<unsigned char>(k >> 16),
+                            static_cast<unsigned char>(k >> 8),
+                            static_cast<unsigned char>(k)};
+    if (masked) {
+        memcpy(head + n, key, 4);
+        n += 4;
+    }
+
+    luaL_Buffer b;
+    char *out = luaL_buffinitsize(L, &b, n + sz);
+    memcpy(out, head, n);
+    if (masked) {
+        _mask(out + n, payload, sz, key);
+    } else {
+        memcpy(out + n, payload, sz);
+    }
+    luaL_pushresultsize(&b, n + sz);
+    return 1;
+}
+
+// data, key -> data xor the 4 byte key, a string or a 32 bit integer
+static int lmask(lua_State *L) {
+    std::size_t sz = 0;
+    const char *data = luaL_checklstring(L, 1, &sz);
+    unsigned char key[4];
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        uint32_t k = static_cast<uint32_t>(luaL_checkinteger(L, 2));
+        for (int i = 0; i < 4; i++) {
+            key[i] = static_cast<unsigned char>(k >> ((3 - i) * 8));
+        }
+    } else {
+        std::size_t ksz = 0;
+        const char *k = luaL_checklstring(L, 2, &ksz);
+        luaL_argcheck(L, ksz == 4, 2, "need a 4 byte key");
+        memcpy(key, k, 4);
+    }
+    luaL_Buffer b;
+    char *out = luaL_buffinitsize(L, &b, sz);
+    _mask(out, data, sz, key);
+    luaL_pushresultsize(&b, sz);
+    return 1;
+}
+
+#ifdef HIVE_WITH_ZLIB
+// the end of a sync flush, dropped from each message and put back to
+// inflate it
+static const unsigned char WS_DEFLATE_TAIL[4] = {0x00, 0x00, 0xff, 0xff};
+static const std::size_t WS_DEFLATE_CHUNK = 16 * 1024;
+
+// reset for every message, so one per thread serves all the cells on it
+struct ws_zstreams {
+    z_stream deflater;
+    z_stream inflater;
+    bool deflater_init{false};
+    bool inflater_init{false};
+
+    ~ws_zstreams() {
+        if (deflater_init) {
+            deflateEnd(&deflater);
+        }
+        if (inflater_init) {
+            inflateEnd(&inflater);
+        }
+    }
+};
+
+static thread_local ws_zstreams zstreams;
+
+static z_stream *_deflater(lua_State *L) {
+    z_stream *z = &zstreams.deflater;
+    if (!zstreams.deflater_init) {
+        memset(z, 0, sizeof(*z));
+        if (deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            luaL_error(L, "deflateInit2 failed");
+        }
+        zstreams.deflater_init = true;
+    } else {
+        deflateReset(z);
+    }
+    return z;
+}
+
+static z_stream *_inflater(lua_State *L) {
+    z_stream *z = &zstreams.inflater;
+    if (!zstreams.inflater_init) {
+        memset(z, 0, sizeof(*z));
+        if (inflateInit2(z, -MAX_WBITS) != Z_OK) {
+            luaL_error(L, "inflateInit2 failed");
+        }
+        zstreams.inflater_init = true;
+    } else {
+        inflateReset(z);
+    }
+    return z;
+}
+
+// data -> the payload of a compressed message
+static int ldeflate(lua_State *L) {
+    std::size_t sz = 0;
+    const char *data = luaL_checklstring(L, 1, &sz);
+    z_stream *z = _deflater(L);
+    z->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    z->avail_in = static_cast<uInt>(sz);
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    do {
+        char *out = luaL_prepbuffsize(&b, WS_DEFLATE_CHUNK);
+        z->next_out = reinterpret_cast<Bytef *>(out);
+        z->avail_out = static_cast<uInt>(WS_DEFLATE_CHUNK);
+        deflate(z, Z_SYNC_FLUSH);
+        luaL_addsize(&b, WS_DEFLATE_CHUNK - z->avail_out);
+    } while (z->avail_out == 0);
+    if (luaL_bufflen(&b) >= 4 &&
+        memcmp(luaL_buffaddr(&b) + luaL_bufflen(&b) - 4, WS_DEFLATE_TAIL, 4) ==
+            0) {
+        luaL_buffsub(&b, 4);
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+// data [, limit] -> the message, or nil and an error when it is broken or
+// inflates past limit
+static int linflate(lua_State *L) {
+    std::size_t sz = 0;
+    const char *data = luaL_checklstring(L, 1, &sz);
+    lua_Integer limit = luaL_optinteger(L, 2, WS_FRAME_LIMIT);
+    z_stream *z = _inflater(L);
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    const char *input[2] = {data, reinterpret_cast<const char *>(WS_DEFLATE_TAIL)};
+    std::size_t input_sz[2] = {sz, sizeof(WS_DEFLATE_TAIL)};
+    for (int i = 0; i < 2; i++) {
+        z->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input[i]));
+        z->avail_in = static_cast<uInt>(input_sz[i]);
+        for (;;) {
+            char *out = luaL_prepbuffsize(&b, WS_DEFLATE_CHUNK);
+            z->next_out = reinterpret_cast<Bytef *>(out);
+            z->avail_out = static_cast<uInt>(WS_DEFLATE_CHUNK);
+            int ret = inflate(z, Z_SYNC_FLUSH);
+            luaL_addsize(&b, WS_DEFLATE_CHUNK - z->avail_out);
+            if (luaL_bufflen(&b) > static_cast<std::size_t>(limit)) {
+                lua_pushnil(L);
+                lua_pushliteral(L, "message too large");
+                return 2;
+            }
+            if (ret == Z_STREAM_END ||
+                (ret == Z_BUF_ERROR && z->avail_in == 0)) {
+                break;
+            }
+            if (ret != Z_OK) {
+                lua_pushnil(L);
+                lua_pushstring(L, z->msg ? z->msg : "inflate failed");
+                return 2;
+            }
+            if (z->avail_in == 0 && z->avail_out != 0) {
+                break;
+            }
+        }
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+#endif
+
+int websocket_lib(lua_State *L) {
+    luaL_checkversion(L);
+    luaL_Reg l[] = {
+        {"frame", lframe},
+        {"encode", lencode},
+        {"mask", lmask},
+#ifdef HIVE_WITH_ZLIB
+        {"deflate", ldeflate},
+        {"inflate", linflate},
+#endif
+        {nullptr, nullptr},
+    };
+    luaL_newlib(L, l);
+    return 1;
+}
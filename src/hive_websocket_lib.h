@@ -0,0 +1,8 @@
+#ifndef hive_websocket_lib_h
+#define hive_websocket_lib_h
+
+#include "lua.hpp"
+
+int websocket_lib(lua_State *L);
+
+#endif
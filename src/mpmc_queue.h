@@ -0,0 +1,114 @@
+#ifndef mpmc_queue_h
+#define mpmc_queue_h
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// Bounded lock-free multi-producer multi-consumer ring (Dmitry Vyukov's
+// algorithm). Every slot carries a sequence number, so producers and
+// consumers only contend on a single CAS of their own cursor.
+template <typename T> class mpmc_queue {
+  private:
+    static const std::size_t CACHE_LINE_SIZE = 64;
+
+    struct slot {
+        std::atomic<std::size_t> sequence;
+        T data;
+    };
+
+    char pad0[CACHE_LINE_SIZE];
+    slot *buffer;
+    std::size_t mask;
+    char pad1[CACHE_LINE_SIZE - sizeof(slot *) - sizeof(std::size_t)];
+    std::atomic<std::size_t> enqueue_pos{0};
+    char pad2[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+    std::atomic<std::size_t> dequeue_pos{0};
+    char pad3[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+
+    static std::size_t round_up(std::size_t size) {
+        std::size_t n = 2;
+        while (n < size) {
+            n <<= 1;
+        }
+        return n;
+    }
+
+  public:
+    using value_type = T;
+
+    explicit mpmc_queue(std::size_t size)
+        : buffer(new slot[round_up(size)]), mask(round_up(size) - 1) {
+        for (std::size_t i = 0; i <= mask; i++) {
+            buffer[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    mpmc_queue(const mpmc_queue &) = delete;
+    mpmc_queue &operator=(const mpmc_queue &) = delete;
+
+    ~mpmc_queue() { delete[] buffer; }
+
+    // Returns false when the ring is full.
+    template <typename U> bool push(U &&new_value) {
+        slot *s = nullptr;
+        std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            s = &buffer[pos & mask];
+            std::size_t seq = s->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) -
+                        static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        s->data = std::forward<U>(new_value);
+        s->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false when the ring is empty.
+    bool pop(value_type &value) {
+        slot *s = nullptr;
+        std::size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            s = &buffer[pos & mask];
+            std::size_t seq = s->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) -
+                        static_cast<std::ptrdiff_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(s->data);
+        s->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate while other threads are pushing or popping.
+    std::size_t size() const {
+        std::size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+        std::size_t head = dequeue_pos.load(std::memory_order_relaxed);
+        return tail >= head ? tail - head : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    std::size_t capacity() const { return mask + 1; }
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef mpsc_queue_h
+#define mpsc_queue_h
+
+#include <atomic>
+#include <utility>
+
+// Unbounded multi-producer single-consumer queue (Dmitry Vyukov's node based
+// algorithm). Producers only do one atomic exchange; the consumer side takes
+// no lock and no atomic read-modify-write.
+template <typename T> class mpsc_queue {
+  private:
+    struct node {
+        std::atomic<node *> next{nullptr};
+        T value;
+    };
+
+    std::atomic<node *> head;
+    // owned by the consumer, always a dummy node whose value is consumed
+    node *tail;
+
+  public:
+    using value_type = T;
+
+    mpsc_queue() {
+        node *stub = new node;
+        head.store(stub);
+        tail = stub;
+    }
+
+    mpsc_queue(const mpsc_queue &) = delete;
+    mpsc_queue &operator=(const mpsc_queue &) = delete;
+
+    ~mpsc_queue() {
+        while (tail) {
+            node *next = tail->next.load(std::memory_order_relaxed);
+            delete tail;
+            tail = next;
+        }
+    }
+
+    template <typename U> void push(U &&new_value) {
+        node *n = new node;
+        n->value = std::forward<U>(new_value);
+        node *prev = head.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+    }
+
+    // Consumer only. May also fail while a producer is between the exchange
+    // and the link in push, empty() is false in that window.
+    bool pop(value_type &value) {
+        node *next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr) {
+            return false;
+        }
+        value = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+
+    // Consumer only. False as soon as a push has started.
+    bool empty() const { return head.load(std::memory_order_acquire) == tail; }
+};
+
+#endif
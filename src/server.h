@@ -1,78 +1,196 @@
 #ifndef server_h
 #define server_h
 
+#include <string>
+#include <vector>
+
+#include "hive_dns.h"
 #include "session.h"
 
+#if defined(__linux__)
+#include <sys/socket.h>
+
+using reuse_port =
+    asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
 class server : public std::enable_shared_from_this<server> {
    public:
     server(const server &) = delete;
     server &operator=(const server &) = delete;
 
-    server(cell *c, const char *addr, unsigned short port)
-        : acceptor(io_context),
-          to_cell(c),
-          id(get_session_increase_id()),
-          addr(addr),
-          port(port) {
+    // tls is nullptr for plain tcp
+    server(cell *c, const char *addr, unsigned short port,
+           const tls_options *tls)
+        : to_cell(c), id(get_session_increase_id()), addr(addr), port(port) {
         cell_grab(c);
-    }
-
-    bool listen() {
-        asio::ip::tcp::resolver resolver(io_context);
-        std::error_code ec;
-        asio::ip::tcp::resolver::iterator iter =
-            resolver.resolve(addr, std::to_string(port), ec);
-        asio::ip::tcp::resolver::iterator end;
-
-        if (iter == end || ec) {
-            log_error(
-                "server listen address = %s, port = %d, id = %d, error_code "
-                "= %d, error = %s",
-                addr, port, id, ec.value(), ec.message().c_str());
-            return false;
+        if (tls) {
+            tls_opts.reset(new tls_options(*tls));
         }
+    }
 
-        acceptor.open(iter->endpoint().protocol());
-        acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
-        acceptor.set_option(asio::socket_base::enable_connection_aborted(true));
-        acceptor.set_option(asio::socket_base::linger(true, 30));
-        acceptor.set_option(asio::ip::tcp::no_delay(true));
-        acceptor.non_blocking(true);
-        acceptor.bind(iter->endpoint());
-        acceptor.listen();
-
-        accept();
-        return true;
+    // the address is looked up off the network threads, the cell gets
+    // event back with the id, or nil and the error
+    void listen(lua_Integer event) {
+        auto self(shared_from_this());
+        dns_resolve(network_next().get_executor(), addr,
+                    [this, self, event](
+                        const std::error_code &ec,
+                        const std::vector<asio::ip::address> &addrs) {
+                        std::error_code err = ec;
+                        if (!err && id == 0) {
+                            // every handle is live
+                            err = asio::error::no_descriptors;
+                        }
+                        std::string msg;
+                        if (!err && tls_opts) {
+                            tls_ctx = tls_server_context(*tls_opts, msg);
+                        }
+                        if (!err && msg.empty()) {
+                            open(asio::ip::tcp::endpoint(addrs[0], port), err);
+                        }
+                        if (err) {
+                            msg = err.message();
+                        }
+                        if (!msg.empty()) {
+                            server_map.erase(id);
+                            log_error(
+                                "server listen address = %s, port = %d, id = "
+                                "%d, error = %s",
+                                addr.c_str(), port, id, msg.c_str());
+                        }
+                        notify_listen(event, msg);
+                    });
     }
 
     uint32_t session_id() { return id; }
 
-    void close() { acceptor.close(); }
+    void close() {
+        auto self(shared_from_this());
+        for (auto &acceptor : acceptors) {
+            asio::post(acceptor->get_executor(),
+                       [self, acceptor]() { acceptor->close(); });
+        }
+    }
 
     ~server() {
+        free_session_id(id);
         if (to_cell) {
             cell_release(to_cell);
         }
     }
 
    private:
-    void accept() {
+    void open(const asio::ip::tcp::endpoint &endpoint, std::error_code &ec) {
+        // on linux every network thread gets its own SO_REUSEPORT listener
+        // and the kernel spreads the connections, elsewhere one listener
+        // deals them out round robin
+        int n = 1;
+#if defined(__linux__)
+        n = network_threads();
+#endif
+        for (int i = 0; i < n && !ec; i++) {
+            asio::io_context &ctx = n > 1 ? network_context(i) : network_next();
+            auto acceptor = std::make_shared<asio::ip::tcp::acceptor>(ctx);
+            acceptor->open(endpoint.protocol(), ec);
+            if (ec) {
+                break;
+            }
+            acceptors.push_back(acceptor);
+            // the options are hints, only bind and listen may fail
+            std::error_code hint;
+            acceptor->set_option(asio::ip::tcp::acceptor::reuse_address(true),
+                                 hint);
+#if defined(__linux__)
+            if (n > 1) {
+                acceptor->set_option(reuse_port(true), hint);
+            }
+#endif
+            acceptor->set_option(
+                asio::socket_base::enable_connection_aborted(true), hint);
+            acceptor->set_option(asio::socket_base::linger(true, 30), hint);
+            acceptor->set_option(asio::ip::tcp::no_delay(true), hint);
+            acceptor->non_blocking(true, hint);
+            acceptor->bind(endpoint, ec);
+            if (!ec) {
+                acceptor->listen(asio::socket_base::max_listen_connections,
+                                 ec);
+            }
+        }
+        if (ec) {
+            for (auto &acceptor : acceptors) {
+                std::error_code ignored;
+                acceptor->close(ignored);
+            }
+            acceptors.clear();
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            accept(acceptors[i], n > 1 ? &network_context(i) : nullptr);
+        }
+    }
+
+    // err is empty once listening
+    void notify_listen(lua_Integer event, const std::string &msg) {
+        write_block b;
+        b.init(nullptr);
+        b.wb_integer(event);
+        b.wb_boolean(1);
+        if (!msg.empty()) {
+            b.wb_nil();
+            b.wb_string(msg.c_str(), msg.length());
+        } else {
+            b.wb_integer(id);
+        }
+        block *ret = b.close();
+        if (cell_send(to_cell, 1, ret)) {
+            b.free();
+        }
+    }
+
+    // accepted sockets go to ctx, or to the next shard when it is nullptr
+    void accept(std::shared_ptr<asio::ip::tcp::acceptor> acceptor,
+                asio::io_context *ctx) {
         auto self(shared_from_this());
 
-        acceptor.async_accept(
-            [this, self](std::error_code ec, asio::ip::tcp::socket socket) {
-                if (!acceptor.is_open()) {
+        acceptor->async_accept(
+            ctx ? *ctx : network_next(),
+            [this, self, acceptor, ctx](std::error_code ec,
+                                        asio::ip::tcp::socket socket) {
+                if (!acceptor->is_open()) {
                     log_error("accept not open, id = %d", id);
                     return;
                 }
 
-                if (!ec) {
-                    auto s = std::make_shared<session>(
-                        std::move(socket), get_session_increase_id());
-                    session_map[s->session_id()] = s;
-                    notify_accept(s);
+                uint32_t sid = ec ? 0 : get_session_increase_id();
+                if (!ec && sid == 0) {
+                    log_error("accept refused, every handle is live, id = %d",
+                              id);
+                    std::error_code ignored;
+                    socket.close(ignored);
+                    accept(acceptor, ctx);
+                } else if (!ec) {
+                    auto s = std::make_shared<session>(std::move(socket), sid);
+                    if (tls_ctx) {
+                        // the cell hears of it once the handshake is done
+                        s->set_tls(
+                            std::unique_ptr<tls_stream>(
+                                new tls_stream(tls_ctx, "", "")),
+                            false,
+                            [self](session *s, const std::string &err) {
+                                if (err.empty()) {
+                                    auto p = s->shared_from_this();
+                                    session_map.set(p->session_id(), p);
+                                    self->notify_accept(p);
+                                }
+                            });
+                    } else {
+                        session_map.set(s->session_id(), s);
+                        notify_accept(s);
+                    }
                     s->start();
-                    accept();
+                    accept(acceptor, ctx);
                 } else if (ec != asio::error::operation_aborted) {
                     log_error("accept error_code = %d, error = %s, id = %d",
                               ec.value(), ec.message().c_str(), id);
@@ -85,8 +203,9 @@ class server : public std::enable_shared_from_this<server> {
         b.init(nullptr);
         b.wb_integer(id);
         b.wb_integer(session->session_id());
+        std::error_code ec;
         std::string address =
-            session->get_socket().remote_endpoint().address().to_string();
+            session->get_socket().remote_endpoint(ec).address().to_string();
         b.wb_string(address.c_str(), address.length());
         block *ret = b.close();
         if (cell_send(to_cell, 6, ret)) {
@@ -94,11 +213,13 @@ class server : public std::enable_shared_from_this<server> {
         }
     }
 
-    asio::ip::tcp::acceptor acceptor;
+    std::vector<std::shared_ptr<asio::ip::tcp::acceptor>> acceptors;
     cell *to_cell;
     uint32_t id;
-    const char *addr;
+    std::string addr;
     unsigned short port;
+    std::unique_ptr<tls_options> tls_opts;
+    std::shared_ptr<tls_context> tls_ctx;
 };
 
 #endif
\ No newline at end of file
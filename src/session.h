@@ -1,19 +1,39 @@
 #ifndef session_h
 #define session_h
 
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "asio/ip/tcp.hpp"
+#include "asio/post.hpp"
+#include "asio/steady_timer.hpp"
 #include "asio_buffer.h"
 #include "common.h"
 #include "hive_cell.h"
 #include "hive_log.h"
 #include "hive_seri.h"
+#include "hive_tls.h"
+#include "mpsc_queue.h"
 
 static const std::size_t WARNING_SIZE = 1014 * 1024;
+// a tls handshake not done by then fails
+static const int TLS_HANDSHAKE_TIMEOUT = 10 * 1000;
 
+// Lives on the network thread of its socket. The public calls below come
+// from other threads, they are posted to that thread. Writes go through a
+// lock free queue and one posted flush picks up every write queued before
+// it runs. With tls the cell still reads and writes plaintext, records are
+// opened and sealed here.
 class session : public std::enable_shared_from_this<session> {
    public:
+    // err is empty once the handshake is done
+    using handshake_handler =
+        std::function<void(session *s, const std::string &err)>;
+
     session(const session &) = delete;
     session &operator=(const session &) = delete;
 
@@ -24,55 +44,172 @@ class session : public std::enable_shared_from_this<session> {
 
     uint32_t session_id() { return id; }
 
-    int set_to_cell(cell *c) {
-        if (to_cell) {
-            return 0;
-        }
-        to_cell = c;
+    void set_to_cell(cell *c) {
         cell_grab(c);
-        std::size_t size = unsend_read_buffers.size();
-        for (std::size_t i = 0; i < size; i++) {
-            notify_message(unsend_read_buffers[i]);
-        }
-        unsend_read_buffers.clear();
-        return 1;
+        auto self(shared_from_this());
+        asio::post(socket.get_executor(), [this, self, c]() {
+            if (to_cell) {
+                cell_release(c);
+                return;
+            }
+            to_cell = c;
+            std::size_t size = unsend_read_buffers.size();
+            for (std::size_t i = 0; i < size; i++) {
+                notify_message(unsend_read_buffers[i]);
+            }
+            unsend_read_buffers.clear();
+        });
     }
 
+    // only before start() or on the network thread
     cell *get_to_cell() { return to_cell; }
 
+    // before start(), handler runs once on the network thread
+    void set_tls(std::unique_ptr<tls_stream> stream, bool client,
+                 handshake_handler handler) {
+        tls = std::move(stream);
+        tls_client = client;
+        on_handshake = std::move(handler);
+    }
+
     void start() {
-        reading = true;
-        read();
+        auto self(shared_from_this());
+        asio::post(socket.get_executor(), [this, self]() {
+            reading = true;
+            if (!tls) {
+                read();
+                return;
+            }
+            tls_timer.reset(new asio::steady_timer(socket.get_executor()));
+            tls_timer->expires_after(
+                std::chrono::milliseconds(TLS_HANDSHAKE_TIMEOUT));
+            tls_timer->async_wait([this, self](std::error_code ec) {
+                if (!ec && !tls_ready) {
+                    handshake_done("handshake timeout");
+                    socket.close(ec);
+                }
+            });
+            if (tls_client) {
+                // the client speaks first
+                tls_step(nullptr);
+            } else {
+                read();
+            }
+        });
     }
 
+    // takes data, a new[] array
     void write(const char *data, std::size_t len) {
-        pending_write_buffer.append(data, len);
-        pending_write_len += len;
-        write();
+        w_block *blk = new w_block;
+        blk->data = data;
+        blk->len = len;
+        enqueue(blk);
+    }
+
+    void write(shared_buffer *b) {
+        buffer_grab(b);
+        w_block *blk = new w_block;
+        blk->data = buffer_data(b);
+        blk->len = buffer_size(b);
+        blk->shared = b;
+        enqueue(blk);
     }
 
-    void pause() { reading = false; }
+    // Deliver whole frames behind a little or big endian length header of
+    // 1, 2 or 4 bytes, header 0 turns it off. Bytes already handed to the
+    // cell stay raw, so it is set before the peer's first byte can arrive.
+    void set_framing(std::size_t header, bool big_endian, std::size_t max) {
+        auto self(shared_from_this());
+        asio::post(socket.get_executor(),
+                   [this, self, header, big_endian, max]() {
+                       frame_header = header;
+                       frame_big_endian = big_endian;
+                       frame_max = max;
+                       frame_head_len = 0;
+                   });
+    }
+
+    void pause() {
+        auto self(shared_from_this());
+        asio::post(socket.get_executor(), [this, self]() { reading = false; });
+    }
 
     void resume() {
-        if (!reading) {
-            reading = true;
-            read();
-        }
+        auto self(shared_from_this());
+        asio::post(socket.get_executor(), [this, self]() {
+            if (!reading) {
+                reading = true;
+                read();
+            }
+        });
     }
 
-    void close() { closing = true; }
+    void close() {
+        auto self(shared_from_this());
+        asio::post(socket.get_executor(), [this, self]() {
+            closing = true;
+            // the peer hears of it after the last write, or now when there
+            // is none left
+            if (!writing && pending_write_len == 0 && write_queue.empty()) {
+                close_send();
+            }
+        });
+    }
 
     ~session() {
+        free_session_id(id);
         if (to_cell) {
             cell_release(to_cell);
         }
         for (int i = 0; i < unsend_read_buffers.size(); i++) {
-            delete unsend_read_buffers[i];
+            rblock_free(unsend_read_buffers[i]);
         }
         unsend_read_buffers.clear();
+        if (frame_shared) {
+            buffer_release(frame_shared);
+        }
+        w_block *blk = nullptr;
+        while (write_queue.pop(blk)) {
+            delete blk;
+        }
+        for (auto b : tls_plain) {
+            delete b;
+        }
     }
 
    private:
+    void enqueue(w_block *blk) {
+        write_queue.push(blk);
+        if (!write_posted.exchange(true)) {
+            auto self(shared_from_this());
+            asio::post(socket.get_executor(), [this, self]() { flush(); });
+        }
+    }
+
+    void flush() {
+        // cleared first, a write queued from here on posts its own flush
+        write_posted.store(false);
+        w_block *blk = nullptr;
+        while (write_queue.pop(blk)) {
+            if (tls) {
+                tls_plain.push_back(blk);
+                continue;
+            }
+            pending_write_len += blk->len;
+            pending_write_buffer.append(blk);
+        }
+        // a push caught between its exchange and its link
+        if (!write_queue.empty() && !write_posted.exchange(true)) {
+            auto self(shared_from_this());
+            asio::post(socket.get_executor(), [this, self]() { flush(); });
+        }
+        if (tls) {
+            tls_seal();
+        } else {
+            write();
+        }
+    }
+
     void write() {
         if (!writing && pending_write_len > 0) {
             writing = true;
@@ -107,7 +244,7 @@ class session : public std::enable_shared_from_this<session> {
             if (pending_write_len > 0) {
                 write();
             } else if (closing) {
-                close_after_last_write();
+                close_send();
             }
         } else {
             log_error("session id = %d, write error_code = %d, error = %s", id,
@@ -125,17 +262,31 @@ class session : public std::enable_shared_from_this<session> {
 
     void read() {
         auto self(shared_from_this());
-        auto block = new r_block;
+        auto block = rblock_new(read_size);
         socket.async_read_some(
-            asio::buffer(block->data, block->len),
+            asio::buffer(block->data, block->cap),
             [this, self, block](std::error_code ec, std::size_t length) {
                 handle_read(block, ec, length);
             });
     }
 
+    // shut down the send side, after close_notify with tls
+    void close_send() {
+        if (tls && tls_ready && !tls_shutdown) {
+            tls_shutdown = true;
+            tls->shutdown();
+            if (tls_output()) {
+                // the last write shuts it down
+                return;
+            }
+        }
+        std::error_code ec;
+        socket.shutdown(asio::ip::tcp::socket::shutdown_send, ec);
+    }
+
     void handle_read(r_block *block, std::error_code ec, std::size_t length) {
         if (closing) {
-            delete block;
+            rblock_free(block);
             std::error_code ec;
             socket.shutdown(asio::ip::tcp::socket::shutdown_receive, ec);
             return;
@@ -143,26 +294,185 @@ class session : public std::enable_shared_from_this<session> {
 
         if (!ec) {
             block->len = length;
-            if (to_cell) {
-                notify_message(block);
-            } else {
-                unsend_read_buffers.push_back(block);
+            if (length == block->cap) {
+                read_size = std::min(block->cap * 2, READ_BLOCK_MAX);
+            } else if (length < read_size / 4) {
+                read_size = std::max(read_size / 2, READ_BLOCK_SIZE);
+            }
+            if (!tls) {
+                deliver(block);
+            } else if (!tls_ready) {
+                // read again once the step is done
+                tls_step(block);
+                return;
+            } else if (!tls_open(block->data, block->len, block)) {
+                return;
             }
             if (reading) {
                 read();
             }
         } else {
-            delete block;
+            rblock_free(block);
             log_error("session id = %d, read error_code = %d, error = %s", id,
                       ec.value(), ec.message().c_str());
-            if (ec != asio::error::operation_aborted &&
-                ec != asio::error::bad_descriptor) {
+            if (tls && !tls_ready) {
+                handshake_done(ec.message());
+            } else if (ec != asio::error::operation_aborted &&
+                       ec != asio::error::bad_descriptor) {
                 notify_close();
             }
         }
     }
 
+    void deliver(r_block *block) {
+        if (to_cell) {
+            notify_message(block);
+        } else {
+            unsend_read_buffers.push_back(block);
+        }
+    }
+
+    // feed the records read to the handshake on a handshake thread, block
+    // is nullptr for the first step of a client
+    void tls_step(r_block *block) {
+        auto self(shared_from_this());
+        tls_offload([this, self, block]() {
+            tls_result r = block ? tls->handshake(block->data, block->len)
+                                 : tls->handshake(nullptr, 0);
+            asio::post(socket.get_executor(), [this, self, block, r]() {
+                if (block) {
+                    rblock_free(block);
+                }
+                tls_stepped(r);
+            });
+        });
+    }
+
+    void tls_stepped(tls_result r) {
+        if (on_handshake == nullptr) {
+            // timed out meanwhile
+            return;
+        }
+        if (closing) {
+            handshake_done("closed");
+            return;
+        }
+        tls_output();
+        if (r == tls_result::more) {
+            if (reading) {
+                read();
+            }
+            return;
+        }
+        if (r == tls_result::failed) {
+            log_error("session id = %d, tls handshake error = %s", id,
+                      tls->error().c_str());
+            handshake_done(tls->error());
+            closing = true;
+            if (!writing && pending_write_len == 0) {
+                close_send();
+            }
+            return;
+        }
+        tls_ready = true;
+        handshake_done("");
+        // records that came along with the last of the handshake
+        if (!tls_open(nullptr, 0, nullptr)) {
+            return;
+        }
+        tls_seal();
+        if (reading) {
+            read();
+        }
+    }
+
+    void handshake_done(const std::string &err) {
+        handshake_handler handler;
+        handler.swap(on_handshake);
+        tls_timer->cancel();
+        if (handler) {
+            handler(this, err);
+        }
+    }
+
+    // hand the plaintext of the records in data to the cell, false when
+    // the stream is over
+    bool tls_open(const char *data, std::size_t len, r_block *block) {
+        tls_result r = tls->decrypt(data, len, tls_blocks);
+        if (block) {
+            rblock_free(block);
+        }
+        for (auto b : tls_blocks) {
+            deliver(b);
+        }
+        tls_blocks.clear();
+        tls_output();
+        if (r == tls_result::failed) {
+            log_error("session id = %d, tls error = %s", id,
+                      tls->error().c_str());
+        }
+        if (r == tls_result::failed || r == tls_result::closed) {
+            notify_close();
+            return false;
+        }
+        return true;
+    }
+
+    // seal the writes queued, small ones share records
+    void tls_seal() {
+        if (!tls_ready || tls_shutdown) {
+            return;
+        }
+        bool ok = true;
+        for (auto b : tls_plain) {
+            const char *data = b->data + b->ptr;
+            std::size_t len = b->len - b->ptr;
+            if (ok && tls_batch.size() + len > TLS_BATCH_SIZE) {
+                ok = tls_batch.empty() ||
+                     tls->encrypt(tls_batch.data(), tls_batch.size());
+                tls_batch.clear();
+            }
+            if (ok && len >= TLS_BATCH_SIZE) {
+                ok = tls->encrypt(data, len);
+            } else if (ok) {
+                tls_batch.insert(tls_batch.end(), data, data + len);
+            }
+            delete b;
+        }
+        tls_plain.clear();
+        if (ok && !tls_batch.empty()) {
+            ok = tls->encrypt(tls_batch.data(), tls_batch.size());
+        }
+        tls_batch.clear();
+        tls_output();
+        if (!ok) {
+            log_error("session id = %d, tls error = %s", id,
+                      tls->error().c_str());
+            notify_close();
+        }
+    }
+
+    // queue the records to send, false when there are none
+    bool tls_output() {
+        std::size_t len = 0;
+        char *data = tls->output(len);
+        if (!data) {
+            return false;
+        }
+        w_block *blk = new w_block;
+        blk->data = data;
+        blk->len = len;
+        pending_write_len += len;
+        pending_write_buffer.append(blk);
+        write();
+        return true;
+    }
+
     void notify_message(r_block *buffer) {
+        if (frame_header > 0) {
+            notify_frames(buffer);
+            return;
+        }
         write_block b;
         b.init(nullptr);
         b.wb_integer(id);
@@ -170,7 +480,122 @@ class session : public std::enable_shared_from_this<session> {
         block *ret = b.close();
         if (cell_send(to_cell, 7, ret)) {
             b.free();
-            delete buffer;
+            rblock_free(buffer);
+        }
+    }
+
+    struct frame_batch {
+        write_block b;
+        int count{0};
+        // released again when the cell is gone
+        shared_buffer *shared[FRAME_BATCH];
+        int shared_count{0};
+    };
+
+    // read the length header, false when the frame is over frame_max
+    bool frame_begin() {
+        std::size_t len = 0;
+        for (std::size_t i = 0; i < frame_header; i++) {
+            len = len << 8 |
+                  frame_head[frame_big_endian ? i : frame_header - 1 - i];
+        }
+        if (len > frame_max) {
+            log_error("session id = %d, frame size %zu over %zu", id, len,
+                      frame_max);
+            return false;
+        }
+        frame_len = len;
+        frame_got = 0;
+        frame_data.clear();
+        if (len >= SHARED_STRING_SIZE) {
+            // filled in place and unpacked as a string
+            frame_shared = buffer_new(nullptr, len);
+            return frame_shared != nullptr;
+        }
+        return true;
+    }
+
+    void frame_done(frame_batch &batch, const char *whole) {
+        if (batch.count == 0) {
+            batch.b.init(nullptr);
+            batch.b.wb_integer(id);
+        }
+        if (frame_shared) {
+            batch.b.wb_pointer(
+                frame_shared, data_type::TYPE_USERDATA,
+                static_cast<uint8_t>(userdata_type::TYPE_SHARED_STRING));
+            batch.shared[batch.shared_count++] = frame_shared;
+            frame_shared = nullptr;
+        } else if (whole) {
+            batch.b.wb_string(whole, frame_len);
+        } else {
+            batch.b.wb_string(frame_data.data(), frame_len);
+        }
+        frame_head_len = 0;
+        if (++batch.count == FRAME_BATCH) {
+            send_frames(batch);
+        }
+    }
+
+    void send_frames(frame_batch &batch) {
+        block *ret = batch.b.close();
+        if (cell_send(to_cell, 16, ret)) {
+            batch.b.free();
+            for (int i = 0; i < batch.shared_count; i++) {
+                buffer_release(batch.shared[i]);
+            }
+        }
+        batch.count = 0;
+        batch.shared_count = 0;
+    }
+
+    // cut the block into frames, the partial one at its end is kept
+    void notify_frames(r_block *buffer) {
+        frame_batch batch;
+        bool oversize = false;
+        const char *p = buffer->data + buffer->ptr;
+        const char *end = buffer->data + buffer->len;
+        while (p < end && !frame_error) {
+            if (frame_head_len < frame_header) {
+                frame_head[frame_head_len++] = static_cast<uint8_t>(*p++);
+                if (frame_head_len < frame_header) {
+                    continue;
+                }
+                if (!frame_begin()) {
+                    frame_error = true;
+                    oversize = true;
+                } else if (frame_len == 0) {
+                    frame_done(batch, nullptr);
+                }
+                continue;
+            }
+            std::size_t n = std::min(static_cast<std::size_t>(end - p),
+                                     frame_len - frame_got);
+            const char *whole = nullptr;
+            if (frame_shared) {
+                memcpy(buffer_writable(frame_shared) + frame_got, p, n);
+            } else if (n == frame_len) {
+                // inside this block, packed straight from it
+                whole = p;
+            } else {
+                frame_data.insert(frame_data.end(), p, p + n);
+            }
+            frame_got += n;
+            p += n;
+            if (frame_got == frame_len) {
+                frame_done(batch, whole);
+            }
+        }
+        if (batch.count > 0) {
+            send_frames(batch);
+        }
+        rblock_free(buffer);
+        if (oversize) {
+            // an oversize frame closes the socket
+            reading = false;
+            std::error_code ec;
+            socket.shutdown(asio::ip::tcp::socket::shutdown_receive, ec);
+            notify_close();
         }
     }
 
@@ -209,9 +634,36 @@ class session : public std::enable_shared_from_this<session> {
     asio::ip::tcp::socket socket;
     uint32_t id;
     std::vector<r_block *> unsend_read_buffers;
+    mpsc_queue<w_block *> write_queue;
+    std::atomic<bool> write_posted{false};
     write_buffer pending_write_buffer;
     std::size_t pending_write_len{0};
+    std::size_t read_size{READ_BLOCK_SIZE};
     std::size_t warning_size{0};
+    // length prefixed framing, off while frame_header is 0
+    std::size_t frame_header{0};
+    bool frame_big_endian{false};
+    std::size_t frame_max{0};
+    uint8_t frame_head[4];
+    std::size_t frame_head_len{0};
+    std::size_t frame_len{0};
+    std::size_t frame_got{0};
+    // a small frame split over reads, a large one goes to frame_shared
+    std::vector<char> frame_data;
+    shared_buffer *frame_shared{nullptr};
+    bool frame_error{false};
+    // tls, off while tls is nullptr
+    static const std::size_t TLS_BATCH_SIZE = 16 * 1024;
+    std::unique_ptr<tls_stream> tls;
+    bool tls_client{false};
+    bool tls_ready{false};
+    bool tls_shutdown{false};
+    handshake_handler on_handshake;
+    std::unique_ptr<asio::steady_timer> tls_timer;
+    // writes queued before the handshake is done
+    std::vector<w_block *> tls_plain;
+    std::vector<char> tls_batch;
+    std::vector<r_block *> tls_blocks;
     bool writing{false};
     bool reading{false};
     bool closing{false};
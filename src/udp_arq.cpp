@@ -0,0 +1,374 @@
+#include "udp_arq.h"
+
+static const int32_t ARQ_RTO_DEF = 200;
+static const int32_t ARQ_RTO_MIN = 100;
+static const int32_t ARQ_RTO_NODELAY = 30;
+static const uint32_t ARQ_DEAD_LINK = 20;
+static const uint32_t ARQ_THRESH_INIT = 2;
+
+// segments are little endian on the wire
+static char *_encode32(char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        *p++ = static_cast<char>(v >> (i * 8));
+    }
+    return p;
+}
+
+static const char *_decode32(const char *p, uint32_t &v) {
+    v = 0;
+    for (int i = 0; i < 4; i++) {
+        v |= static_cast<uint32_t>(static_cast<uint8_t>(p[i])) << (i * 8);
+    }
+    return p + 4;
+}
+
+arq::arq(uint32_t conv, const arq_config &config)
+    : conv(conv),
+      mtu(config.mtu),
+      mss(config.mtu - ARQ_HEADER),
+      ssthresh(ARQ_THRESH_INIT),
+      rx_rto(ARQ_RTO_DEF),
+      rx_minrto(config.nodelay ? ARQ_RTO_NODELAY : ARQ_RTO_MIN),
+      snd_wnd(config.sndwnd),
+      rcv_wnd(config.rcvwnd < ARQ_FRAGMENTS ? ARQ_FRAGMENTS : config.rcvwnd),
+      rmt_wnd(ARQ_FRAGMENTS),
+      interval(config.interval),
+      nodelay(config.nodelay ? 1 : 0),
+      fastresend(config.resend),
+      nocwnd(config.nocwnd),
+      stream(!config.message),
+      dead_link(ARQ_DEAD_LINK),
+      out(config.mtu) {}
+
+bool arq::conversation(const char *data, std::size_t len, uint32_t &conv) {
+    if (len < ARQ_HEADER) {
+        return false;
+    }
+    _decode32(data, conv);
+    return true;
+}
+
+bool arq::opening(const char *data, std::size_t len) {
+    if (len < ARQ_HEADER) {
+        return false;
+    }
+    uint32_t sn = 0;
+    _decode32(data + 12, sn);
+    return static_cast<uint8_t>(data[4]) == ARQ_CMD_PUSH && sn == 0;
+}
+
+char *arq::encode(char *p, const segment &seg) const {
+    p = _encode32(p, seg.conv);
+    *p++ = static_cast<char>(seg.cmd);
+    *p++ = static_cast<char>(seg.frg);
+    *p++ = static_cast<char>(seg.wnd);
+    *p++ = static_cast<char>(seg.wnd >> 8);
+    p = _encode32(p, seg.ts);
+    p = _encode32(p, seg.sn);
+    p = _encode32(p, seg.una);
+    return _encode32(p, static_cast<uint32_t>(seg.data.size()));
+}
+
+uint16_t arq::wnd_unused() const {
+    if (rcv_queue.size() < rcv_wnd) {
+        return static_cast<uint16_t>(rcv_wnd - rcv_queue.size());
+    }
+    return 0;
+}
+
+bool arq::send(const char *data, std::size_t len) {
+    if (stream && !snd_queue.empty()) {
+        // top up the last segment not sent yet
+        segment &last = snd_queue.back();
+        if (last.data.size() < mss) {
+            std::size_t n = mss - last.data.size();
+            if (n > len) {
+                n = len;
+            }
+            last.data.append(data, n);
+            data += n;
+            len -= n;
+            if (len == 0) {
+                return true;
+            }
+        }
+    }
+
+    std::size_t count = len <= mss ? 1 : (len + mss - 1) / mss;
+    if (!stream && count >= ARQ_FRAGMENTS) {
+        return false;
+    }
+    for (std::size_t i = 0; i < count; i++) {
+        std::size_t n = len > mss ? mss : len;
+        segment seg;
+        seg.data.assign(data, n);
+        seg.frg = stream ? 0 : static_cast<uint8_t>(count - i - 1);
+        snd_queue.push_back(std::move(seg));
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+void arq::update_ack(int32_t rtt) {
+    if (rx_srtt == 0) {
+        rx_srtt = rtt;
+        rx_rttval = rtt / 2;
+    } else {
+        int32_t delta = rtt - rx_srtt;
+        if (delta < 0) {
+            delta = -delta;
+        }
+        rx_rttval = (3 * rx_rttval + delta) / 4;
+        rx_srtt = (7 * rx_srtt + rtt) / 8;
+        if (rx_srtt < 1) {
+            rx_srtt = 1;
+        }
+    }
+    int32_t var = 4 * rx_rttval;
+    if (var < static_cast<int32_t>(interval)) {
+        var = static_cast<int32_t>(interval);
+    }
+    int32_t rto = rx_srtt + var;
+    if (rto < rx_minrto) {
+        rto = rx_minrto;
+    } else if (rto > ARQ_RTO_MAX) {
+        rto = ARQ_RTO_MAX;
+    }
+    rx_rto = rto;
+}
+
+void arq::shrink_buf() {
+    snd_una = snd_buf.empty() ? snd_nxt : snd_buf.front().sn;
+}
+
+void arq::parse_ack(uint32_t sn) {
+    if (arq_diff(sn, snd_una) < 0 || arq_diff(sn, snd_nxt) >= 0) {
+        return;
+    }
+    for (auto it = snd_buf.begin(); it != snd_buf.end(); ++it) {
+        if (it->sn == sn) {
+            snd_buf.erase(it);
+            break;
+        }
+        if (arq_diff(sn, it->sn) < 0) {
+            break;
+        }
+    }
+}
+
+void arq::parse_una(uint32_t una) {
+    while (!snd_buf.empty() && arq_diff(una, snd_buf.front().sn) > 0) {
+        snd_buf.pop_front();
+    }
+}
+
+void arq::parse_fastack(uint32_t sn, uint32_t ts) {
+    if (arq_diff(sn, snd_una) < 0 || arq_diff(sn, snd_nxt) >= 0) {
+        return;
+    }
+    for (auto &seg : snd_buf) {
+        if (arq_diff(sn, seg.sn) < 0) {
+            break;
+        }
+        // only segments sent before the acked one count as skipped
+        if (sn != seg.sn && arq_diff(ts, seg.ts) >= 0) {
+            ++seg.fastack;
+        }
+    }
+}
+
+void arq::parse_data(segment &&seg) {
+    uint32_t sn = seg.sn;
+    if (arq_diff(sn, rcv_nxt + rcv_wnd) >= 0 || arq_diff(sn, rcv_nxt) < 0) {
+        return;
+    }
+    // ordered by sn, a new segment is most likely the last
+    auto it = rcv_buf.end();
+    while (it != rcv_buf.begin()) {
+        auto prev = it - 1;
+        if (prev->sn == sn) {
+            return;
+        }
+        if (arq_diff(sn, prev->sn) > 0) {
+            break;
+        }
+        it = prev;
+    }
+    rcv_buf.insert(it, std::move(seg));
+    move_ready();
+}
+
+void arq::move_ready() {
+    while (!rcv_buf.empty() && rcv_buf.front().sn == rcv_nxt &&
+           rcv_queue.size() < rcv_wnd) {
+        rcv_queue.push_back(std::move(rcv_buf.front()));
+        rcv_buf.pop_front();
+        ++rcv_nxt;
+    }
+}
+
+bool arq::input(const char *data, std::size_t len, uint32_t now) {
+    if (len < ARQ_HEADER) {
+        return false;
+    }
+
+    uint32_t prev_una = snd_una;
+    bool acked = false;
+    uint32_t maxack = 0;
+    uint32_t latest_ts = 0;
+    while (len >= ARQ_HEADER) {
+        segment seg;
+        uint32_t size = 0;
+        const char *p = _decode32(data, seg.conv);
+        seg.cmd = static_cast<uint8_t>(p[0]);
+        seg.frg = static_cast<uint8_t>(p[1]);
+        seg.wnd = static_cast<uint16_t>(static_cast<uint8_t>(p[2]) |
+                                        static_cast<uint8_t>(p[3]) << 8);
+        p = _decode32(p + 4, seg.ts);
+        p = _decode32(p, seg.sn);
+        p = _decode32(p, seg.una);
+        p = _decode32(p, size);
+        len -= ARQ_HEADER;
+        if (seg.conv != conv || len < size || seg.cmd < ARQ_CMD_PUSH ||
+            seg.cmd > ARQ_CMD_FIN) {
+            return false;
+        }
+
+        rmt_wnd = seg.wnd;
+        parse_una(seg.una);
+        shrink_buf();
+        switch (seg.cmd) {
+            case ARQ_CMD_ACK:
+                if (arq_diff(now, seg.ts) >= 0) {
+                    update_ack(arq_diff(now, seg.ts));
+                }
+                parse_ack(seg.sn);
+                shrink_buf();
+                if (!acked || arq_diff(seg.sn, maxack) > 0) {
+                    acked = true;
+                    maxack = seg.sn;
+                    latest_ts = seg.ts;
+                }
+                break;
+            case ARQ_CMD_PUSH:
+                if (arq_diff(seg.sn, rcv_nxt + rcv_wnd) < 0) {
+                    acklist.emplace_back(seg.sn, seg.ts);
+                    if (arq_diff(seg.sn, rcv_nxt) >= 0) {
+                        seg.data.assign(p, size);
+                        parse_data(std::move(seg));
+                    }
+                }
+                break;
+            case ARQ_CMD_WASK:
+                probe |= ARQ_ASK_TELL;
+                break;
+            case ARQ_CMD_WINS:
+                break;
+            case ARQ_CMD_FIN:
+                fin_received = true;
+                break;
+        }
+        data = p + size;
+        len -= size;
+    }
+
+    if (acked) {
+        parse_fastack(maxack, latest_ts);
+    }
+
+    // slow start, then about one segment more per round trip
+    if (arq_diff(snd_una, prev_una) > 0 && cwnd < rmt_wnd) {
+        if (cwnd < ssthresh) {
+            ++cwnd;
+            incr += mss;
+        } else {
+            if (incr < mss) {
+                incr = mss;
+            }
+            incr += (mss * mss) / incr + (mss / 16);
+            if ((cwnd + 1) * mss <= incr) {
+                cwnd = (incr + mss - 1) / mss;
+            }
+        }
+        if (cwnd > rmt_wnd) {
+            cwnd = rmt_wnd;
+            incr = rmt_wnd * mss;
+        }
+    }
+    return true;
+}
+
+int arq::peek_size() const {
+    if (rcv_queue.empty()) {
+        return -1;
+    }
+    const segment &seg = rcv_queue.front();
+    if (seg.frg == 0) {
+        return static_cast<int>(seg.data.size());
+    }
+    if (rcv_queue.size() < static_cast<std::size_t>(seg.frg) + 1) {
+        return -1;
+    }
+    std::size_t len = 0;
+    for (const segment &s : rcv_queue) {
+        len += s.data.size();
+        if (s.frg == 0) {
+            break;
+        }
+    }
+    return static_cast<int>(len);
+}
+
+void arq::recv(char *buf) {
+    bool recover = rcv_queue.size() >= rcv_wnd;
+    while (!rcv_queue.empty()) {
+        segment &seg = rcv_queue.front();
+        uint8_t frg = seg.frg;
+        memcpy(buf, seg.data.data(), seg.data.size());
+        buf += seg.data.size();
+        rcv_queue.pop_front();
+        if (frg == 0) {
+            break;
+        }
+    }
+    move_ready();
+    // the window was full, tell the peer it opened
+    if (recover && rcv_queue.size() < rcv_wnd) {
+        probe |= ARQ_ASK_TELL;
+    }
+}
+
+std::size_t arq::readable() const {
+    std::size_t len = 0;
+    for (const segment &seg : rcv_queue) {
+        len += seg.data.size();
+    }
+    return len;
+}
+
+bool arq::check(uint32_t now, uint32_t &at) const {
+    if (!acklist.empty() || probe != 0 || fin_pending) {
+        at = now;
+        return true;
+    }
+    bool wait = false;
+    if (rmt_wnd == 0 && !snd_queue.empty()) {
+        at = probe_wait == 0 ? now : ts_probe;
+        wait = true;
+    }
+    for (const segment &seg : snd_buf) {
+        if (!wait || arq_diff(seg.resendts, at) < 0) {
+            at = seg.resendts;
+            wait = true;
+        }
+    }
+    if (wait) {
+        // no sooner than interval, the due segments go out together
+        uint32_t soonest = now + interval;
+        if (arq_diff(at, soonest) < 0) {
+            at = arq_diff(at, now) <= 0 ? now : soonest;
+        }
+    }
+    return wait;
+}
@@ -0,0 +1,318 @@
+#ifndef udp_arq_h
+#define udp_arq_h
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+// conv, cmd, frg, wnd, ts, sn, una, len
+static const std::size_t ARQ_HEADER = 24;
+// segments of one message, the receive window is never smaller
+static const uint32_t ARQ_FRAGMENTS = 128;
+
+struct arq_config {
+    // halve the rto growth and skip the minimum rto
+    bool nodelay{true};
+    // ms between flushes while segments are in flight
+    uint32_t interval{10};
+    // resend a segment skipped by this many acks, 0 waits for its rto
+    uint32_t resend{2};
+    // no congestion window, only the send and receive windows
+    bool nocwnd{false};
+    uint32_t sndwnd{32};
+    uint32_t rcvwnd{ARQ_FRAGMENTS};
+    uint32_t mtu{1400};
+    // keep the boundary of every send, else a byte stream
+    bool message{false};
+};
+
+// Selective repeat ARQ in the manner of KCP: segments are acked one by one
+// and by the cumulative una, resent on rto or when later ones were acked
+// resend times, under a congestion window. Wire format of KCP plus a fin
+// command, so it speaks with KCP peers of the same mode. Not thread safe,
+// it has no clock and no socket, the owner feeds it datagrams and time and
+// gets datagrams back from flush.
+class arq {
+   public:
+    arq(const arq &) = delete;
+    arq &operator=(const arq &) = delete;
+
+    arq(uint32_t conv, const arq_config &config);
+
+    // the conversation of a datagram, false when it has no segment
+    static bool conversation(const char *data, std::size_t len,
+                             uint32_t &conv);
+    // whether a datagram may start a conversation, its first segment sn 0
+    static bool opening(const char *data, std::size_t len);
+
+    // queue data to send, false when a message needs over ARQ_FRAGMENTS
+    bool send(const char *data, std::size_t len);
+    // a datagram from the peer, false when it is malformed
+    bool input(const char *data, std::size_t len, uint32_t now);
+
+    // bytes of the next whole message, or in stream mode of the next
+    // segment, -1 when there is none
+    int peek_size() const;
+    // move the next message to buf, peek_size() bytes
+    void recv(char *buf);
+    // bytes of the segments ready to recv
+    std::size_t readable() const;
+
+    // acks, window probes, new and due segments go out through output,
+    // a datagram of at most mtu bytes per call
+    template <typename F>
+    void flush(uint32_t now, F output);
+    // when flush is due next, false when nothing waits for a timer
+    bool check(uint32_t now, uint32_t &at) const;
+
+    // tell the peer this side is gone, sent once and never acked
+    void fin() { fin_pending = true; }
+
+    uint32_t max_message() const { return (ARQ_FRAGMENTS - 1) * mss; }
+    // nothing queued or unacked
+    bool idle() const { return snd_queue.empty() && snd_buf.empty(); }
+    // a segment was sent dead_link times without an ack
+    bool dead() const { return dead_link_hit; }
+    // the peer sent fin
+    bool finished() const { return fin_received; }
+
+   private:
+    struct segment {
+        uint32_t conv{0};
+        uint8_t cmd{0};
+        uint8_t frg{0};
+        uint16_t wnd{0};
+        uint32_t ts{0};
+        uint32_t sn{0};
+        uint32_t una{0};
+        uint32_t resendts{0};
+        uint32_t rto{0};
+        uint32_t fastack{0};
+        uint32_t xmit{0};
+        std::string data;
+    };
+
+    char *encode(char *p, const segment &seg) const;
+    uint16_t wnd_unused() const;
+    void update_ack(int32_t rtt);
+    void shrink_buf();
+    void parse_ack(uint32_t sn);
+    void parse_una(uint32_t una);
+    void parse_fastack(uint32_t sn, uint32_t ts);
+    void parse_data(segment &&seg);
+    void move_ready();
+    // append seg to out, output first if it would not fit the mtu
+    template <typename F>
+    void put(F &output, const segment &seg);
+    template <typename F>
+    void put_cmd(F &output, uint8_t cmd);
+
+    uint32_t conv;
+    uint32_t mtu;
+    uint32_t mss;
+    uint32_t snd_una{0};
+    uint32_t snd_nxt{0};
+    uint32_t rcv_nxt{0};
+    uint32_t ssthresh;
+    uint32_t cwnd{0};
+    uint32_t incr{0};
+    int32_t rx_rttval{0};
+    int32_t rx_srtt{0};
+    int32_t rx_rto;
+    int32_t rx_minrto;
+    uint32_t snd_wnd;
+    uint32_t rcv_wnd;
+    uint32_t rmt_wnd;
+    uint32_t probe{0};
+    uint32_t ts_probe{0};
+    uint32_t probe_wait{0};
+    uint32_t interval;
+    uint32_t nodelay;
+    uint32_t fastresend;
+    bool nocwnd;
+    bool stream;
+    uint32_t dead_link;
+    bool dead_link_hit{false};
+    bool fin_pending{false};
+    bool fin_received{false};
+    std::deque<segment> snd_queue;
+    std::deque<segment> snd_buf;
+    std::deque<segment> rcv_buf;
+    std::deque<segment> rcv_queue;
+    // sn, ts of the segments to ack
+    std::vector<std::pair<uint32_t, uint32_t>> acklist;
+    std::vector<char> out;
+    std::size_t out_len{0};
+};
+
+static const uint8_t ARQ_CMD_PUSH = 81;
+static const uint8_t ARQ_CMD_ACK = 82;
+// window probe ask and tell
+static const uint8_t ARQ_CMD_WASK = 83;
+static const uint8_t ARQ_CMD_WINS = 84;
+static const uint8_t ARQ_CMD_FIN = 85;
+static const uint32_t ARQ_ASK_SEND = 1;
+static const uint32_t ARQ_ASK_TELL = 2;
+// fast resends of one segment before only its rto resends it
+static const uint32_t ARQ_FAST_LIMIT = 5;
+static const uint32_t ARQ_PROBE_INIT = 7000;
+static const uint32_t ARQ_PROBE_LIMIT = 120000;
+static const int32_t ARQ_RTO_MAX = 60000;
+
+static inline int32_t arq_diff(uint32_t later, uint32_t earlier) {
+    return static_cast<int32_t>(later - earlier);
+}
+
+template <typename F>
+void arq::put(F &output, const segment &seg) {
+    if (out_len + ARQ_HEADER + seg.data.size() > mtu) {
+        output(out.data(), out_len);
+        out_len = 0;
+    }
+    char *p = encode(out.data() + out_len, seg);
+    if (!seg.data.empty()) {
+        memcpy(p, seg.data.data(), seg.data.size());
+    }
+    out_len += ARQ_HEADER + seg.data.size();
+}
+
+template <typename F>
+void arq::put_cmd(F &output, uint8_t cmd) {
+    segment seg;
+    seg.conv = conv;
+    seg.cmd = cmd;
+    seg.wnd = wnd_unused();
+    seg.una = rcv_nxt;
+    put(output, seg);
+}
+
+template <typename F>
+void arq::flush(uint32_t now, F output) {
+    segment ack;
+    ack.conv = conv;
+    ack.cmd = ARQ_CMD_ACK;
+    ack.wnd = wnd_unused();
+    ack.una = rcv_nxt;
+    for (auto &a : acklist) {
+        ack.sn = a.first;
+        ack.ts = a.second;
+        put(output, ack);
+    }
+    acklist.clear();
+
+    // a zero remote window is probed, slower and slower
+    if (rmt_wnd == 0) {
+        if (probe_wait == 0) {
+            probe_wait = ARQ_PROBE_INIT;
+            ts_probe = now + probe_wait;
+        } else if (arq_diff(now, ts_probe) >= 0) {
+            probe_wait += probe_wait / 2;
+            if (probe_wait > ARQ_PROBE_LIMIT) {
+                probe_wait = ARQ_PROBE_LIMIT;
+            }
+            ts_probe = now + probe_wait;
+            probe |= ARQ_ASK_SEND;
+        }
+    } else {
+        ts_probe = 0;
+        probe_wait = 0;
+    }
+    if (probe & ARQ_ASK_SEND) {
+        put_cmd(output, ARQ_CMD_WASK);
+    }
+    if (probe & ARQ_ASK_TELL) {
+        put_cmd(output, ARQ_CMD_WINS);
+    }
+    probe = 0;
+
+    uint32_t window = snd_wnd < rmt_wnd ? snd_wnd : rmt_wnd;
+    if (!nocwnd && cwnd < window) {
+        window = cwnd;
+    }
+    while (arq_diff(snd_nxt, snd_una + window) < 0 && !snd_queue.empty()) {
+        segment seg = std::move(snd_queue.front());
+        snd_queue.pop_front();
+        seg.conv = conv;
+        seg.cmd = ARQ_CMD_PUSH;
+        seg.ts = now;
+        seg.sn = snd_nxt++;
+        seg.resendts = now;
+        seg.rto = rx_rto;
+        snd_buf.push_back(std::move(seg));
+    }
+
+    uint32_t resent = fastresend > 0 ? fastresend : 0xffffffff;
+    uint32_t rtomin = nodelay == 0 ? (rx_rto >> 3) : 0;
+    bool lost = false;
+    bool change = false;
+    uint16_t wnd = wnd_unused();
+    for (auto &seg : snd_buf) {
+        bool needsend = false;
+        if (seg.xmit == 0) {
+            needsend = true;
+            seg.rto = rx_rto;
+            seg.resendts = now + seg.rto + rtomin;
+        } else if (arq_diff(now, seg.resendts) >= 0) {
+            needsend = true;
+            if (nodelay == 0) {
+                seg.rto += seg.rto > static_cast<uint32_t>(rx_rto)
+                               ? seg.rto
+                               : static_cast<uint32_t>(rx_rto);
+            } else {
+                seg.rto += seg.rto / 2;
+            }
+            if (seg.rto > static_cast<uint32_t>(ARQ_RTO_MAX)) {
+                seg.rto = ARQ_RTO_MAX;
+            }
+            seg.resendts = now + seg.rto;
+            lost = true;
+        } else if (seg.fastack >= resent && seg.xmit <= ARQ_FAST_LIMIT) {
+            needsend = true;
+            seg.fastack = 0;
+            seg.resendts = now + seg.rto;
+            change = true;
+        }
+        if (needsend) {
+            ++seg.xmit;
+            seg.ts = now;
+            seg.wnd = wnd;
+            seg.una = rcv_nxt;
+            put(output, seg);
+            if (seg.xmit >= dead_link) {
+                dead_link_hit = true;
+            }
+        }
+    }
+
+    if (fin_pending) {
+        put_cmd(output, ARQ_CMD_FIN);
+        fin_pending = false;
+    }
+    if (out_len > 0) {
+        output(out.data(), out_len);
+        out_len = 0;
+    }
+
+    // fast resend halves the window, a timeout starts over from one
+    if (change) {
+        uint32_t inflight = snd_nxt - snd_una;
+        ssthresh = inflight / 2 < 2 ? 2 : inflight / 2;
+        cwnd = ssthresh + resent;
+        incr = cwnd * mss;
+    }
+    if (lost) {
+        ssthresh = window / 2 < 2 ? 2 : window / 2;
+        cwnd = 1;
+        incr = mss;
+    }
+    if (cwnd < 1) {
+        cwnd = 1;
+        incr = mss;
+    }
+}
+
+#endif
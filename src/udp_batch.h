@@ -0,0 +1,95 @@
+#ifndef udp_batch_h
+#define udp_batch_h
+
+#include <system_error>
+
+#include "asio/ip/udp.hpp"
+#include "asio_buffer.h"
+
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
+
+// datagrams per recvmmsg / sendmmsg
+static const int UDP_BATCH = 32;
+// batches read per handler, a socket still not drained is read again from
+// a posted handler, readiness is edge triggered and would not come back
+static const int UDP_RECV_ROUNDS = 4;
+
+static inline bool udp_would_block(const std::error_code &ec) {
+    return ec == asio::error::would_block || ec == asio::error::try_again;
+}
+
+// Receives up to UDP_BATCH datagrams per call into blocks allocated ahead,
+// one recvmmsg on linux. The socket must be non blocking.
+struct udp_recv_batch {
+    udp_r_block *blocks[UDP_BATCH]{};
+    asio::ip::udp::endpoint endpoints[UDP_BATCH];
+#ifdef __linux__
+    mmsghdr msgs[UDP_BATCH];
+    iovec iov[UDP_BATCH];
+#endif
+
+    ~udp_recv_batch() {
+        for (int i = 0; i < UDP_BATCH; i++) {
+            delete blocks[i];
+        }
+    }
+
+    // the number of datagrams read, 0 with ec set when none could be
+    int receive(asio::ip::udp::socket &socket, std::error_code &ec) {
+        for (int i = 0; i < UDP_BATCH; i++) {
+            if (blocks[i] == nullptr) {
+                blocks[i] = new udp_r_block;
+            }
+        }
+#ifdef __linux__
+        for (int i = 0; i < UDP_BATCH; i++) {
+            iov[i].iov_base = blocks[i]->data.data();
+            iov[i].iov_len = blocks[i]->data.size();
+            msghdr &h = msgs[i].msg_hdr;
+            h = msghdr();
+            h.msg_name = endpoints[i].data();
+            h.msg_namelen = static_cast<socklen_t>(endpoints[i].capacity());
+            h.msg_iov = &iov[i];
+            h.msg_iovlen = 1;
+        }
+        int n = recvmmsg(socket.native_handle(), msgs, UDP_BATCH,
+                         MSG_DONTWAIT, nullptr);
+        if (n < 0) {
+            ec = std::error_code(errno, asio::error::get_system_category());
+            return 0;
+        }
+        for (int i = 0; i < n; i++) {
+            blocks[i]->len = msgs[i].msg_len;
+            endpoints[i].resize(msgs[i].msg_hdr.msg_namelen);
+        }
+        return n;
+#else
+        int n = 0;
+        while (n < UDP_BATCH) {
+            std::error_code e;
+            std::size_t len = socket.receive_from(
+                asio::buffer(blocks[n]->data), endpoints[n], 0, e);
+            if (e) {
+                if (n == 0) {
+                    ec = e;
+                }
+                break;
+            }
+            blocks[n]->len = len;
+            ++n;
+        }
+        return n;
+#endif
+    }
+
+    // hand block i over, a new one is allocated for the next receive
+    udp_r_block *take(int i) {
+        udp_r_block *block = blocks[i];
+        blocks[i] = nullptr;
+        return block;
+    }
+};
+
+#endif
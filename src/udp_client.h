@@ -1,6 +1,10 @@
 #ifndef udp_client_h
 #define udp_client_h
 
+#include <string>
+#include <vector>
+
+#include "hive_dns.h"
 #include "udp_session.h"
 
 class udp_client : public std::enable_shared_from_this<udp_client> {
@@ -8,57 +12,85 @@ class udp_client : public std::enable_shared_from_this<udp_client> {
     udp_client(const udp_client &) = delete;
     udp_client &operator=(const udp_client &) = delete;
 
-    udp_client(cell *c, const char *addr, unsigned short port)
-        : to_cell(c), addr(addr), port(port) {}
-
-    bool connect(lua_Integer event) {
-        asio::ip::udp::resolver resolver(io_context);
-        std::error_code ec;
-        asio::ip::udp::resolver::iterator iter =
-            resolver.resolve(addr, std::to_string(port), ec);
-        asio::ip::udp::resolver::iterator end;
-
-        if (iter == end || ec) {
-            log_error(
-                "udp client connect address = %s, port = %d, "
-                "error_code = %d, error = %s",
-                addr, port, ec.value(), ec.message().c_str());
-            return false;
+    // the session is reliable with a config, see udp_session
+    udp_client(cell *c, const char *addr, unsigned short port,
+               const arq_config *config = nullptr)
+        : addr(addr), port(port) {
+        auto socket = std::make_shared<asio::ip::udp::socket>(network_next());
+        auto id = get_session_increase_id();
+        auto sender = std::make_shared<udp_sender>(socket);
+        session_ptr = std::make_shared<udp_session>(
+            socket, sender, asio::ip::udp::endpoint(), id, id);
+        if (config) {
+            // done lingering, the pending wait goes and with it this client
+            session_ptr->set_reliable(id, *config, [socket]() {
+                std::error_code ec;
+                socket->cancel(ec);
+            });
         }
+        session_ptr->set_to_cell(c);
+    }
 
+    // the address is looked up off the network threads
+    void connect(lua_Integer event) {
         auto self(shared_from_this());
-        auto socket = std::make_shared<asio::ip::udp::socket>(io_context);
-        auto id = get_session_increase_id();
-        session_ptr = std::make_shared<udp_session>(socket, *iter, id, id);
-        session_ptr->set_to_cell(to_cell);
-        session_ptr->get_socket()->async_connect(
-            *iter, [this, self, event](std::error_code ec) {
-                handle_connect(event, ec);
-            });
-        return true;
+        dns_resolve(session_ptr->get_socket()->get_executor(), addr,
+                    [this, self, event](
+                        std::error_code ec,
+                        const std::vector<asio::ip::address> &addrs) {
+                        if (!ec && session_ptr->session_id() == 0) {
+                            // every handle is live
+                            ec = asio::error::no_descriptors;
+                        }
+                        if (ec) {
+                            handle_connect(event, ec);
+                            return;
+                        }
+                        session_ptr->remote_endpoint() =
+                            asio::ip::udp::endpoint(addrs[0], port);
+                        session_ptr->get_socket()->async_connect(
+                            session_ptr->remote_endpoint(),
+                            [this, self, event](std::error_code ec) {
+                                handle_connect(event, ec);
+                            });
+                    });
     }
 
     std::shared_ptr<udp_session> get_session() { return session_ptr; }
 
     uint32_t session_id() { return session_ptr->session_id(); }
 
-    void close() { closing = true, session_ptr->close(); }
+    void close() {
+        session_ptr->close();
+        auto self(shared_from_this());
+        asio::post(session_ptr->get_socket()->get_executor(), [this, self]() {
+            closing = true;
+            // the pending wait holds this client, queued datagrams still go.
+            // A reliable session cancels it once it is done lingering.
+            if (!session_ptr->reliable()) {
+                std::error_code ec;
+                session_ptr->get_socket()->cancel(ec);
+            }
+        });
+    }
 
     ~udp_client() {}
 
    private:
     void handle_connect(lua_Integer event, std::error_code &ec) {
         if (!ec) {
+            std::error_code nb;
+            session_ptr->get_socket()->non_blocking(true, nb);
             notify_connect_succ(event);
             handle_recv();
         } else {
-            udp_client_map[session_ptr->session_id()] = nullptr;
-            udp_session_map[session_ptr->session_id()] = nullptr;
+            udp_client_map.erase(session_ptr->session_id());
+            udp_session_map.erase(session_ptr->session_id());
 
             log_error(
                 "udp client connect address = %s, port = %d, id = %d, "
                 "error_code = %d, error = %s",
-                addr, port, session_ptr->session_id(), ec.value(),
+                addr.c_str(), port, session_ptr->session_id(), ec.value(),
                 ec.message().c_str());
 
             notify_connect_fail(event, ec.message());
@@ -67,36 +99,66 @@ class udp_client : public std::enable_shared_from_this<udp_client> {
 
     void handle_recv() {
         auto self(shared_from_this());
-        auto block = new udp_r_block;
-        session_ptr->get_socket()->async_receive(
-            asio::buffer(block->data, block->len),
-            [this, self, block](std::error_code ec, std::size_t length) {
-                if (closing) {
-                    delete block;
+        session_ptr->get_socket()->async_wait(
+            asio::ip::udp::socket::wait_read, [this, self](std::error_code ec) {
+                // a closing reliable session still reads its acks
+                if (closing && (ec || !session_ptr->reliable())) {
                     std::error_code ec;
                     session_ptr->get_socket()->shutdown(
                         asio::ip::udp::socket::shutdown_receive, ec);
                     return;
                 }
 
-                if (!ec) {
-                    block->len = length;
-                    session_ptr->read(block);
-                    handle_recv();
-                } else {
-                    delete block;
-                    log_error(
-                        "session id = %d, read error_code = %d, error = %s",
-                        session_ptr->session_id(), ec.value(),
-                        ec.message().c_str());
-                    if (ec != asio::error::operation_aborted &&
-                        ec != asio::error::bad_descriptor) {
-                        session_ptr->notify_close();
-                    }
-                }
+                on_readable(ec);
             });
     }
 
+    void on_readable(std::error_code ec) {
+        bool drained = true;
+        if (!ec) {
+            drained = receive(ec);
+        }
+        session_ptr->flush_read();
+        if (closing && session_ptr->done()) {
+            // it cancelled the wait this handler came from
+            return;
+        }
+        if (!ec) {
+            if (drained) {
+                handle_recv();
+            } else {
+                auto self(shared_from_this());
+                asio::post(session_ptr->get_socket()->get_executor(),
+                           [this, self]() { on_readable(std::error_code()); });
+            }
+            return;
+        }
+        log_error("session id = %d, read error_code = %d, error = %s",
+                  session_ptr->session_id(), ec.value(), ec.message().c_str());
+        if (ec != asio::error::operation_aborted &&
+            ec != asio::error::bad_descriptor) {
+            session_ptr->link_failed();
+        }
+    }
+
+    // drain the socket batch by batch, ec is left clear on would block.
+    // false when UDP_RECV_ROUNDS ran out first
+    bool receive(std::error_code &ec) {
+        for (int round = 0; round < UDP_RECV_ROUNDS; round++) {
+            int n = batch.receive(*session_ptr->get_socket(), ec);
+            for (int i = 0; i < n; i++) {
+                session_ptr->read(batch.take(i));
+            }
+            if (udp_would_block(ec)) {
+                ec.clear();
+            }
+            if (ec || n < UDP_BATCH) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     void notify_connect_succ(lua_Integer event) {
         write_block b;
         b.init(nullptr);
@@ -122,10 +184,10 @@ class udp_client : public std::enable_shared_from_this<udp_client> {
         }
     }
 
-    cell *to_cell;
-    const char *addr;
+    std::string addr;
     unsigned short port;
     std::shared_ptr<udp_session> session_ptr;
+    udp_recv_batch batch;
     bool closing{false};
 };
 
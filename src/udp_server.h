@@ -1,6 +1,10 @@
 #ifndef udp_server_h
 #define udp_server_h
 
+#include <string>
+#include <vector>
+
+#include "hive_dns.h"
 #include "udp_session.h"
 
 class udp_server : public std::enable_shared_from_this<udp_server> {
@@ -8,77 +12,95 @@ class udp_server : public std::enable_shared_from_this<udp_server> {
     udp_server(const udp_server &) = delete;
     udp_server &operator=(const udp_server &) = delete;
 
-    udp_server(cell *c, const char *addr, unsigned short port)
-        : remote_endpoint(),
-          to_cell(c),
+    // sessions are reliable with a config, see udp_session
+    udp_server(cell *c, const char *addr, unsigned short port,
+               const arq_config *config = nullptr)
+        : to_cell(c),
           id(get_session_increase_id()),
           addr(addr),
           port(port) {
-        acceptor = std::make_shared<asio::ip::udp::socket>(io_context);
+        acceptor = std::make_shared<asio::ip::udp::socket>(network_next());
+        if (config) {
+            reliable.reset(new arq_config(*config));
+        }
         cell_grab(c);
     }
 
-    bool listen() {
-        asio::ip::udp::resolver resolver(io_context);
-        std::error_code ec;
-        asio::ip::udp::resolver::iterator iter =
-            resolver.resolve(addr, std::to_string(port), ec);
-        asio::ip::udp::resolver::iterator end;
-
-        if (iter == end || ec) {
-            log_error(
-                "udp listen address = %s, port = %d, id = %d, error_code "
-                "= %d, error = %s",
-                addr, port, id, ec.value(), ec.message().c_str());
-            return false;
-        }
-
-        acceptor->open(iter->endpoint().protocol());
-        acceptor->bind(iter->endpoint());
-
-        accept();
-        return true;
+    // the address is looked up off the network threads, the cell gets
+    // event back with the id, or nil and the error
+    void listen(lua_Integer event) {
+        auto self(shared_from_this());
+        dns_resolve(acceptor->get_executor(), addr,
+                    [this, self, event](
+                        const std::error_code &ec,
+                        const std::vector<asio::ip::address> &addrs) {
+                        std::error_code err = ec;
+                        if (!err && id == 0) {
+                            // every handle is live
+                            err = asio::error::no_descriptors;
+                        }
+                        if (!err) {
+                            asio::ip::udp::endpoint endpoint(addrs[0], port);
+                            acceptor->open(endpoint.protocol(), err);
+                            if (!err) {
+                                acceptor->bind(endpoint, err);
+                            }
+                        }
+                        if (err) {
+                            std::error_code ignored;
+                            acceptor->close(ignored);
+                            udp_server_map.erase(id);
+                            log_error(
+                                "udp listen address = %s, port = %d, id = %d, "
+                                "error_code = %d, error = %s",
+                                addr.c_str(), port, id, err.value(),
+                                err.message().c_str());
+                        } else {
+                            acceptor->non_blocking(true, err);
+                            sender = std::make_shared<udp_sender>(acceptor);
+                            accept();
+                        }
+                        notify_listen(event, err);
+                    });
     }
 
     uint32_t session_id() { return id; }
 
+    bool is_reliable() { return reliable != nullptr; }
+
     void remove_session(asio::ip::udp::endpoint endpoint) {
-        sessions[endpoint] = nullptr;
+        auto self(shared_from_this());
+        asio::post(acceptor->get_executor(),
+                   [this, self, endpoint]() { sessions.erase(endpoint); });
     }
 
-    void close() { acceptor->close(); }
+    void close() {
+        auto self(shared_from_this());
+        asio::post(acceptor->get_executor(),
+                   [this, self]() { acceptor->close(); });
+    }
 
     ~udp_server() {
+        free_session_id(id);
         if (to_cell) {
             cell_release(to_cell);
         }
     }
 
    private:
+    // wait until readable, then drain the socket batch by batch
     void accept() {
         auto self(shared_from_this());
-        auto block = new udp_r_block;
-        acceptor->async_receive_from(
-            asio::buffer(block->data, block->len), remote_endpoint,
-            [this, self, block](std::error_code ec, std::size_t length) {
+        acceptor->async_wait(
+            asio::ip::udp::socket::wait_read,
+            [this, self](std::error_code ec) {
                 if (!acceptor->is_open()) {
                     log_error("udp accept not open, id = %d", id);
                     return;
                 }
 
                 if (!ec) {
-                    auto s = sessions[remote_endpoint];
-                    if (s == nullptr) {
-                        s = std::make_shared<udp_session>(
-                            acceptor, remote_endpoint,
-                            get_session_increase_id(), id);
-                        udp_session_map[s->session_id()] = s;
-                        sessions[remote_endpoint] = s;
-                        notify_accept(s);
-                    }
-                    block->len = length;
-                    s->read(block);
-                    accept();
+                    receive();
                 } else if (ec != asio::error::operation_aborted) {
                     log_error("udp accept error_code = %d, error = %s, id = %d",
                               ec.value(), ec.message().c_str(), id);
@@ -86,24 +108,122 @@ class udp_server : public std::enable_shared_from_this<udp_server> {
             });
     }
 
+    void receive() {
+        bool drained = false;
+        for (int round = 0; round < UDP_RECV_ROUNDS && !drained; round++) {
+            std::error_code ec;
+            int n = batch.receive(*acceptor, ec);
+            for (int i = 0; i < n; i++) {
+                auto it = sessions.find(batch.endpoints[i]);
+                if (it == sessions.end()) {
+                    auto s = open_session(i);
+                    if (s == nullptr) {
+                        continue;
+                    }
+                    it = sessions.emplace(batch.endpoints[i], s).first;
+                }
+                if (it->second->read(batch.take(i))) {
+                    touched.push_back(it->second);
+                }
+            }
+            if (ec && !udp_would_block(ec)) {
+                log_error("udp accept error_code = %d, error = %s, id = %d",
+                          ec.value(), ec.message().c_str(), id);
+            }
+            drained = n < UDP_BATCH;
+        }
+        // one message per session for everything it got
+        for (auto &s : touched) {
+            s->flush_read();
+        }
+        touched.clear();
+
+        if (drained) {
+            accept();
+        } else {
+            auto self(shared_from_this());
+            asio::post(acceptor->get_executor(), [this, self]() {
+                if (acceptor->is_open()) {
+                    receive();
+                }
+            });
+        }
+    }
+
+    // the session of a new endpoint, a reliable one only from the first
+    // segment of a conversation, so stray acks of a closed one open none
+    std::shared_ptr<udp_session> open_session(int i) {
+        uint32_t conv = 0;
+        udp_r_block *block = batch.blocks[i];
+        if (reliable && (!arq::opening(block->data.data(), block->len) ||
+                         !arq::conversation(block->data.data(), block->len,
+                                            conv))) {
+            return nullptr;
+        }
+
+        uint32_t sid = get_session_increase_id();
+        if (sid == 0) {
+            log_error("udp accept refused, every handle is live, id = %d", id);
+            return nullptr;
+        }
+        auto s = std::make_shared<udp_session>(acceptor, sender,
+                                               batch.endpoints[i], sid, id);
+        if (reliable) {
+            std::weak_ptr<udp_server> owner = shared_from_this();
+            asio::ip::udp::endpoint endpoint = batch.endpoints[i];
+            s->set_reliable(conv, *reliable, [owner, endpoint]() {
+                auto self = owner.lock();
+                if (self) {
+                    self->remove_session(endpoint);
+                }
+            });
+        }
+        udp_session_map.set(s->session_id(), s);
+        notify_accept(s);
+        return s;
+    }
+
     void notify_accept(std::shared_ptr<udp_session> session) {
         write_block b;
         b.init(nullptr);
         b.wb_integer(id);
         b.wb_integer(session->session_id());
-        std::string address = remote_endpoint.address().to_string();
+        std::string address = session->remote_endpoint().address().to_string();
         b.wb_string(address.c_str(), address.length());
         block *ret = b.close();
-        if (cell_send(to_cell, 12, ret)) {
+        // a reliable one is accepted like a tcp socket
+        if (cell_send(to_cell, reliable ? 6 : 12, ret)) {
+            b.free();
+        }
+    }
+
+    void notify_listen(lua_Integer event, const std::error_code &ec) {
+        write_block b;
+        b.init(nullptr);
+        b.wb_integer(event);
+        b.wb_boolean(1);
+        if (ec) {
+            std::string msg = ec.message();
+            b.wb_nil();
+            b.wb_string(msg.c_str(), msg.length());
+        } else {
+            b.wb_integer(id);
+        }
+        block *ret = b.close();
+        if (cell_send(to_cell, 1, ret)) {
             b.free();
         }
     }
 
     std::shared_ptr<asio::ip::udp::socket> acceptor;
-    asio::ip::udp::endpoint remote_endpoint;
+    std::shared_ptr<udp_sender> sender;
+    udp_recv_batch batch;
+    std::unique_ptr<arq_config> reliable;
+    // sessions with datagrams read in this wakeup
+    std::vector<std::shared_ptr<udp_session>> touched;
     cell *to_cell;
     uint32_t id;
-    const char *addr;
+    std::string addr;
     unsigned short port;
     std::unordered_map<asio::ip::udp::endpoint, std::shared_ptr<udp_session>>
         sessions;
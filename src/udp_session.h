@@ -1,26 +1,131 @@
 #ifndef udp_session_h
 #define udp_session_h
 
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+
 #include "asio/ip/udp.hpp"
+#include "asio/post.hpp"
+#include "asio/steady_timer.hpp"
 #include "asio_buffer.h"
 #include "common.h"
+#include "hive_buffer.h"
 #include "hive_cell.h"
 #include "hive_log.h"
 #include "hive_seri.h"
+#include "udp_arq.h"
+#include "udp_batch.h"
+
+class udp_session;
+
+// The datagrams of every session on one udp socket, sent UDP_BATCH at a
+// time with sendmmsg on linux. Lives on the network thread of the socket.
+class udp_sender : public std::enable_shared_from_this<udp_sender> {
+   public:
+    udp_sender(const udp_sender &) = delete;
+    udp_sender &operator=(const udp_sender &) = delete;
+
+    explicit udp_sender(std::shared_ptr<asio::ip::udp::socket> socket)
+        : socket(socket) {}
+
+    // takes data, a new[] array. Sent by one flush posted behind the
+    // handlers already queued, so a burst of writes goes out together.
+    void send(std::shared_ptr<udp_session> from, const char *data,
+              std::size_t len) {
+        queue.push_back(datagram{std::move(from), data, len});
+        if (!flush_posted && !waiting) {
+            flush_posted = true;
+            auto self(shared_from_this());
+            asio::post(socket->get_executor(), [this, self]() {
+                flush_posted = false;
+                flush();
+            });
+        }
+    }
+
+    ~udp_sender() {
+        for (datagram &d : queue) {
+            delete[] d.data;
+        }
+    }
 
+   private:
+    struct datagram {
+        std::shared_ptr<udp_session> from;
+        const char *data;
+        std::size_t len;
+    };
+
+    void flush();
+    int send_batch(std::error_code &ec);
+
+    std::shared_ptr<asio::ip::udp::socket> socket;
+    std::deque<datagram> queue;
+    bool flush_posted{false};
+    // for the socket to turn writable
+    bool waiting{false};
+#ifdef __linux__
+    mmsghdr msgs[UDP_BATCH];
+    iovec iov[UDP_BATCH];
+#endif
+};
+
+static inline uint32_t arq_clock() {
+    return static_cast<uint32_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+// Shares the socket, and so the network thread, of its udp_server or
+// udp_client. The public calls from the socket cell are posted there.
+//
+// A reliable session runs an arq over its datagrams and talks to its cell
+// like a tcp session: bytes or frames, close, pause and resume. A timer on
+// the network thread resends while segments are unacked, an idle session
+// has none. Closing lingers until the peer acked everything or the link
+// died, then sends fin and calls on_finish.
 class udp_session : public std::enable_shared_from_this<udp_session> {
    public:
     udp_session(const udp_session &) = delete;
     udp_session &operator=(const udp_session &) = delete;
 
     udp_session(std::shared_ptr<asio::ip::udp::socket> socket,
+                std::shared_ptr<udp_sender> sender,
                 asio::ip::udp::endpoint endpoint, uint32_t session_id,
                 uint32_t belong_id)
         : socket(socket),
+          sender(sender),
           endpoint(endpoint),
           id(session_id),
           belong_id(belong_id) {}
 
+    // before the session is shared
+    void set_reliable(uint32_t conv, const arq_config &config,
+                      std::function<void()> finish) {
+        reliable_arq.reset(new arq(conv, config));
+        timer.reset(new asio::steady_timer(socket->get_executor()));
+        reliable_stream = !config.message;
+        on_finish = std::move(finish);
+    }
+
+    bool reliable() { return reliable_arq != nullptr; }
+
+    bool message_mode() { return reliable() && !reliable_stream; }
+
+    // only on the network thread, a closing reliable session is through
+    bool done() { return finished; }
+
+    // bytes one write may carry, a datagram or a reliable message
+    std::size_t write_limit() {
+        if (reliable_arq) {
+            return reliable_stream ? SIZE_MAX : reliable_arq->max_message();
+        }
+        return UDP_BLOCK_SIZE;
+    }
+
     std::shared_ptr<asio::ip::udp::socket> &get_socket() { return socket; }
 
     asio::ip::udp::endpoint &remote_endpoint() { return endpoint; }
@@ -29,110 +134,332 @@ class udp_session : public std::enable_shared_from_this<udp_session> {
 
     uint32_t belong_session_id() { return belong_id; }
 
-    int set_to_cell(cell *c) {
-        if (to_cell) {
-            return 0;
-        }
-        to_cell = c;
+    void set_to_cell(cell *c) {
         cell_grab(c);
-        std::size_t size = unsend_read_buffers.size();
-        for (std::size_t i = 0; i < size; i++) {
-            notify_message(unsend_read_buffers[i]);
-        }
-        unsend_read_buffers.clear();
-        return 1;
+        auto self(shared_from_this());
+        asio::post(socket->get_executor(), [this, self, c]() {
+            if (to_cell) {
+                cell_release(c);
+                return;
+            }
+            to_cell = c;
+            flush_read();
+        });
     }
 
+    // only on the network thread
     cell *get_to_cell() { return to_cell; }
 
-    void read(udp_r_block *block) {
+    // queue a datagram until flush_read, true when it starts a new batch
+    bool read(udp_r_block *block) {
+        if (reliable_arq) {
+            // acks still count while closing lingers
+            if (!finished) {
+                reliable_arq->input(block->data.data(), block->len,
+                                    arq_clock());
+            }
+            delete block;
+            bool first = !arq_read;
+            arq_read = true;
+            return first;
+        }
         if (closing) {
             delete block;
-            return;
+            return false;
         }
 
-        if (to_cell) {
-            notify_message(block);
+        bool first = read_head == nullptr;
+        if (first) {
+            read_head = block;
         } else {
-            unsend_read_buffers.push_back(block);
+            read_tail->next = block;
+        }
+        read_tail = block;
+        return first;
+    }
+
+    // the datagrams read so far go to the cell as one message
+    void flush_read() {
+        if (reliable_arq) {
+            arq_read = false;
+            arq_deliver();
+            arq_flush();
+            return;
+        }
+        if (to_cell && read_head) {
+            notify_message(read_head);
+            read_head = nullptr;
+            read_tail = nullptr;
         }
     }
 
+    // takes data, a new[] array
     void write(const char *data, std::size_t len) {
-        pending_write_buffer.append(data, len);
-        pending_write_count++;
-        write();
+        auto self(shared_from_this());
+        asio::post(socket->get_executor(), [this, self, data, len]() {
+            if (!reliable_arq) {
+                sender->send(self, data, len);
+                return;
+            }
+            if (!closing && !reliable_arq->send(data, len)) {
+                log_error("udp session id = %d, message size %zu over %u", id,
+                          len, reliable_arq->max_message());
+            }
+            delete[] data;
+            // the writes queued meanwhile go out in one flush
+            if (!flush_posted) {
+                flush_posted = true;
+                asio::post(socket->get_executor(), [this, self]() {
+                    flush_posted = false;
+                    arq_flush();
+                });
+            }
+        });
     }
 
-    void close() { closing = true; }
+    // a reliable session stops handing data to its cell, its receive
+    // window fills and the peer stops sending
+    void pause() {
+        auto self(shared_from_this());
+        asio::post(socket->get_executor(), [this, self]() { paused = true; });
+    }
+
+    void resume() {
+        auto self(shared_from_this());
+        asio::post(socket->get_executor(), [this, self]() {
+            if (paused) {
+                paused = false;
+                flush_read();
+            }
+        });
+    }
+
+    void write_failed(std::error_code ec) {
+        log_error("udp session id = %d, write error_code = %d, error = %s", id,
+                  ec.value(), ec.message().c_str());
+        if (ec == asio::error::operation_aborted ||
+            ec == asio::error::bad_descriptor ||
+            ec == asio::error::connection_aborted) {
+            return;
+        }
+        if (reliable_arq) {
+            link_failed();
+        } else if (!closing) {
+            closing = true;
+            notify_close();
+        }
+    }
+
+    // the socket failed, a reliable session stops resending and no longer
+    // lingers once closed
+    void link_failed() {
+        broken = true;
+        notify_close();
+        if (closing && reliable_arq) {
+            arq_flush();
+        }
+    }
+
+    void close() {
+        auto self(shared_from_this());
+        asio::post(socket->get_executor(), [this, self]() {
+            closing = true;
+            if (reliable_arq) {
+                arq_flush();
+            }
+        });
+    }
 
     void notify_close() {
-        if (!to_cell) {
+        if (!to_cell || close_notified) {
             return;
         }
+        close_notified = true;
 
         write_block b;
         b.init(nullptr);
         b.wb_integer(id);
         block *ret = b.close();
-        if (cell_send(to_cell, 14, ret)) {
+        if (cell_send(to_cell, reliable_arq ? 8 : 14, ret)) {
             b.free();
         }
     }
 
     ~udp_session() {
+        free_session_id(id);
         if (to_cell) {
             cell_release(to_cell);
         }
-        for (int i = 0; i < unsend_read_buffers.size(); i++) {
-            delete unsend_read_buffers[i];
-        }
-        unsend_read_buffers.clear();
+        _free_chain(read_head);
     }
 
    private:
-    void write() {
-        if (!writing && pending_write_count > 0) {
-            writing = true;
-            auto self(shared_from_this());
-
-            socket->async_send_to(
-                pending_write_buffer.const_buffer(), endpoint,
-                [this, self](std::error_code ec, std::size_t length) {
-                    handle_write(ec, length);
-                });
+    static void _free_chain(udp_r_block *block) {
+        while (block != nullptr) {
+            udp_r_block *next = block->next;
+            delete block;
+            block = next;
         }
     }
 
-    void handle_write(std::error_code ec, std::size_t length) {
-        writing = false;
-        auto close_after_last_write = [this]() {
-            std::error_code ec;
-            socket->shutdown(asio::ip::tcp::socket::shutdown_send, ec);
+    // closing lingers until every segment is acked, the peer is gone or
+    // the link died, then sends fin
+    void arq_flush() {
+        if (finished) {
+            return;
+        }
+        uint32_t now = arq_clock();
+        auto self(shared_from_this());
+        auto output = [this, &self](const char *data, std::size_t len) {
+            char *d = new char[len];
+            memcpy(d, data, len);
+            sender->send(self, d, len);
         };
+        if (closing && (reliable_arq->idle() || reliable_arq->dead() ||
+                        reliable_arq->finished() || broken ||
+                        !socket->is_open())) {
+            reliable_arq->fin();
+            reliable_arq->flush(now, output);
+            finished = true;
+            std::error_code ec;
+            timer->cancel(ec);
+            if (on_finish) {
+                std::function<void()> f = std::move(on_finish);
+                f();
+            }
+            return;
+        }
+        if (broken) {
+            return;
+        }
 
-        if (!ec) {
-            pending_write_buffer.retrieve();
-            pending_write_count--;
-            if (pending_write_count > 0) {
-                write();
-            } else if (closing) {
-                close_after_last_write();
+        reliable_arq->flush(now, output);
+        if (reliable_arq->dead()) {
+            log_error("udp session id = %d, link dead", id);
+            notify_close();
+            return;
+        }
+
+        uint32_t at = 0;
+        if (!reliable_arq->check(now, at) ||
+            (timer_armed && arq_diff(at, timer_at) >= 0)) {
+            return;
+        }
+        timer_armed = true;
+        timer_at = at;
+        timer->expires_after(std::chrono::milliseconds(arq_diff(at, now)));
+        timer->async_wait([this, self](std::error_code ec) {
+            if (!ec) {
+                timer_armed = false;
+                arq_flush();
             }
+        });
+    }
+
+    // what the arq put together goes to the cell as tcp socket messages
+    void arq_deliver() {
+        if (!to_cell || paused || closing || broken) {
+            return;
+        }
+        if (reliable_stream) {
+            deliver_stream();
         } else {
-            log_error("udp session id = %d, write error_code = %d, error = %s",
-                      id, ec.value(), ec.message().c_str());
-            if (ec != asio::error::operation_aborted &&
-                ec != asio::error::bad_descriptor &&
-                ec != asio::error::connection_aborted) {
-                close_after_last_write();
-                if (!closing) {
-                    notify_close();
+            deliver_messages();
+        }
+        if (reliable_arq->finished() && reliable_arq->peek_size() < 0) {
+            notify_close();
+        }
+    }
+
+    void deliver_stream() {
+        r_block *b = nullptr;
+        int n = 0;
+        while ((n = reliable_arq->peek_size()) >= 0) {
+            std::size_t size = static_cast<std::size_t>(n);
+            if (b && b->cap - b->len < size) {
+                notify_stream(b);
+                b = nullptr;
+            }
+            if (b == nullptr) {
+                b = rblock_new(std::min(
+                    std::max(reliable_arq->readable(), READ_BLOCK_SIZE),
+                    READ_BLOCK_MAX));
+            }
+            reliable_arq->recv(b->data + b->len);
+            b->len += size;
+        }
+        if (b) {
+            notify_stream(b);
+        }
+    }
+
+    void notify_stream(r_block *buffer) {
+        write_block b;
+        b.init(nullptr);
+        b.wb_integer(id);
+        b.wb_pointer(buffer, data_type::TYPE_USERDATA);
+        block *ret = b.close();
+        if (cell_send(to_cell, 7, ret)) {
+            b.free();
+            rblock_free(buffer);
+        }
+    }
+
+    // whole messages as socket frames, FRAME_BATCH per cell message
+    void deliver_messages() {
+        int n = 0;
+        while ((n = reliable_arq->peek_size()) >= 0) {
+            std::size_t size = static_cast<std::size_t>(n);
+            if (frames == 0) {
+                frame_block.init(nullptr);
+                frame_block.wb_integer(id);
+            }
+            if (size >= SHARED_STRING_SIZE) {
+                shared_buffer *sb = buffer_new(nullptr, size);
+                if (sb == nullptr) {
+                    // the message stays in the arq, the cell gets what was
+                    // batched before it and then the close
+                    log_error("udp session id = %d, no memory for a %zu "
+                              "bytes message",
+                              id, size);
+                    if (frames > 0) {
+                        send_frames();
+                    }
+                    link_failed();
+                    return;
                 }
+                reliable_arq->recv(buffer_writable(sb));
+                frame_block.wb_pointer(
+                    sb, data_type::TYPE_USERDATA,
+                    static_cast<uint8_t>(userdata_type::TYPE_SHARED_STRING));
+                frame_shared.push_back(sb);
+            } else {
+                frame_data.resize(size);
+                reliable_arq->recv(frame_data.data());
+                frame_block.wb_string(frame_data.data(), size);
+            }
+            if (++frames == FRAME_BATCH) {
+                send_frames();
             }
         }
+        if (frames > 0) {
+            send_frames();
+        }
     }
 
+    void send_frames() {
+        block *ret = frame_block.close();
+        if (cell_send(to_cell, 16, ret)) {
+            frame_block.free();
+            for (shared_buffer *sb : frame_shared) {
+                buffer_release(sb);
+            }
+        }
+        frames = 0;
+        frame_shared.clear();
+    }
+
+    // a chain of datagrams, pushed into the cell's udp buffer in one go
     void notify_message(udp_r_block *buffer) {
         write_block b;
         b.init(nullptr);
@@ -141,20 +468,104 @@ class udp_session : public std::enable_shared_from_this<udp_session> {
         block *ret = b.close();
         if (cell_send(to_cell, 13, ret)) {
             b.free();
-            delete buffer;
+            _free_chain(buffer);
         }
     }
 
     cell *to_cell{nullptr};
     std::shared_ptr<asio::ip::udp::socket> socket;
+    std::shared_ptr<udp_sender> sender;
     asio::ip::udp::endpoint endpoint;
     uint32_t id;
     uint32_t belong_id;
-    std::vector<udp_r_block *> unsend_read_buffers;
-    udp_write_buffer pending_write_buffer;
-    std::size_t pending_write_count{0};
-    bool writing{false};
+    udp_r_block *read_head{nullptr};
+    udp_r_block *read_tail{nullptr};
     bool closing{false};
+    bool close_notified{false};
+
+    std::unique_ptr<arq> reliable_arq;
+    bool reliable_stream{true};
+    std::unique_ptr<asio::steady_timer> timer;
+    std::function<void()> on_finish;
+    bool arq_read{false};
+    bool flush_posted{false};
+    bool timer_armed{false};
+    uint32_t timer_at{0};
+    bool paused{false};
+    bool broken{false};
+    bool finished{false};
+    write_block frame_block;
+    int frames{0};
+    std::vector<shared_buffer *> frame_shared;
+    std::vector<char> frame_data;
 };
 
-#endif
\ No newline at end of file
+inline void udp_sender::flush() {
+    while (!queue.empty()) {
+        std::error_code ec;
+        int n = send_batch(ec);
+        for (int i = 0; i < n; i++) {
+            delete[] queue.front().data;
+            queue.pop_front();
+        }
+        if (!ec) {
+            continue;
+        }
+        if (udp_would_block(ec)) {
+            waiting = true;
+            auto self(shared_from_this());
+            socket->async_wait(asio::ip::udp::socket::wait_write,
+                               [this, self](std::error_code ec) {
+                                   waiting = false;
+                                   if (!ec) {
+                                       flush();
+                                   }
+                               });
+            return;
+        }
+        // the first datagram not sent failed, the rest are tried again
+        datagram d = std::move(queue.front());
+        queue.pop_front();
+        delete[] d.data;
+        d.from->write_failed(ec);
+    }
+}
+
+inline int udp_sender::send_batch(std::error_code &ec) {
+    int n = queue.size() < UDP_BATCH ? static_cast<int>(queue.size())
+                                     : UDP_BATCH;
+#ifdef __linux__
+    for (int i = 0; i < n; i++) {
+        datagram &d = queue[i];
+        iov[i].iov_base = const_cast<char *>(d.data);
+        iov[i].iov_len = d.len;
+        msghdr &h = msgs[i].msg_hdr;
+        h = msghdr();
+        asio::ip::udp::endpoint &to = d.from->remote_endpoint();
+        h.msg_name = to.data();
+        h.msg_namelen = static_cast<socklen_t>(to.size());
+        h.msg_iov = &iov[i];
+        h.msg_iovlen = 1;
+    }
+    int sent = sendmmsg(socket->native_handle(), msgs, n, MSG_DONTWAIT);
+    if (sent < 0) {
+        ec = std::error_code(errno, asio::error::get_system_category());
+        return 0;
+    }
+    return sent;
+#else
+    int sent = 0;
+    while (sent < n) {
+        datagram &d = queue[sent];
+        socket->send_to(asio::buffer(d.data, d.len),
+                        d.from->remote_endpoint(), 0, ec);
+        if (ec) {
+            break;
+        }
+        ++sent;
+    }
+    return sent;
+#endif
+}
+
+#endif
@@ -0,0 +1,55 @@
+// Global queue micro benchmark: every thread pushes a cell pointer and pops
+// one back, the same pattern _message_dispatch runs per message.
+//
+// usage: queue_bench [ops per thread]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "src/concurrent_queue.h"
+#include "src/mpmc_queue.h"
+
+static const int DEFAULT_OPS = 100000;
+static const int THREADS[] = {1, 2, 4, 8, 16, 32};
+
+template <typename Queue> static void _run(Queue &q, int ops, int id) {
+    void *v = reinterpret_cast<void *>(static_cast<std::size_t>(id + 1));
+    for (int i = 0; i < ops; i++) {
+        q.push(v);
+        void *out = nullptr;
+        while (!q.pop(out)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+template <typename Queue> static double bench(Queue &q, int thread, int ops) {
+    std::vector<std::thread> threads;
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < thread; i++) {
+        threads.emplace_back(_run<Queue>, std::ref(q), ops, i);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(end - begin).count();
+    return static_cast<double>(thread) * ops / sec;
+}
+
+int main(int argc, char *argv[]) {
+    int ops = argc > 1 ? atoi(argv[1]) : DEFAULT_OPS;
+    printf("%8s %16s %16s %8s\n", "threads", "mutex ops/s", "lockfree ops/s",
+           "speedup");
+    for (int thread : THREADS) {
+        concurrent_queue<void *> mutex_queue;
+        mpmc_queue<void *> lockfree_queue(65536);
+        double m = bench(mutex_queue, thread, ops);
+        double l = bench(lockfree_queue, thread, ops);
+        printf("%8d %16.0f %16.0f %7.2fx\n", thread, m, l, l / m);
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+// Serialization micro benchmark: data_pack and data_unpack over the
+// message shapes cells exchange, one round trip is what a cell.send and
+// its dispatch pay.
+//
+// usage: seri_bench [rounds per shape]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "src/hive_env.h"
+#include "src/hive_seri.h"
+
+static const int DEFAULT_ROUNDS = 200000;
+
+struct shape {
+    const char *name;
+    // a lua chunk returning the values to pack
+    const char *chunk;
+    // rounds are divided by this for the heavy shapes
+    int weight;
+};
+
+static const shape SHAPES[] = {
+    {"small rpc", "return 2, 1024, 'login', 'user_1234', 'token_abcdef', true",
+     1},
+    {"nested table",
+     "local items = {} "
+     "for i = 1, 10 do items[i] = {id = i, count = i * 3, bind = i % 2 == 0} "
+     "end "
+     "return 3, 'sync', {id = 10001, name = 'player_10001', level = 42, "
+     "pos = {x = 1.5, y = 2.25, z = -3.0}, items = items, "
+     "flags = {vip = true, muted = false}}",
+     8},
+    {"int array", "local t = {} for i = 1, 1000 do t[i] = i * 7 end return t",
+     40},
+    {"string 1k", "return 'chat', string.rep('x', 1024)", 4},
+};
+
+static void _release(void *blk) {
+    read_block rb;
+    rb.init(static_cast<block *>(blk));
+    rb.close();
+}
+
+static void *_pack(lua_State *L, int args) {
+    lua_pushcfunction(L, data_pack);
+    for (int i = 1; i <= args; i++) {
+        lua_pushvalue(L, i);
+    }
+    lua_call(L, args, 1);
+    void *blk = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return blk;
+}
+
+static double bench_pack(lua_State *L, int args, int rounds) {
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        _release(_pack(L, args));
+    }
+    auto end = std::chrono::steady_clock::now();
+    return rounds / std::chrono::duration<double>(end - begin).count();
+}
+
+static double bench_roundtrip(lua_State *L, int args, int rounds) {
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        void *blk = _pack(L, args);
+        lua_pushcfunction(L, data_unpack);
+        lua_pushlightuserdata(L, blk);
+        lua_call(L, 1, LUA_MULTRET);
+        lua_settop(L, args);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return rounds / std::chrono::duration<double>(end - begin).count();
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+    printf("%-14s %14s %16s\n", "shape", "pack ops/s", "roundtrip ops/s");
+    for (const shape &s : SHAPES) {
+        lua_State *L = luaL_newstate();
+        luaL_openlibs(L);
+        // data_unpack looks cells up in the env cell_map
+        hive_createenv(L);
+        lua_newtable(L);
+        hive_setenv(L, "cell_map");
+        if (luaL_dostring(L, s.chunk) != LUA_OK) {
+            fprintf(stderr, "%s : %s\n", s.name, lua_tostring(L, -1));
+            return 1;
+        }
+        int args = lua_gettop(L);
+        int n = rounds / s.weight;
+        double pack = bench_pack(L, args, n);
+        double roundtrip = bench_roundtrip(L, args, n);
+        printf("%-14s %14.0f %16.0f\n", s.name, pack, roundtrip);
+        lua_close(L);
+    }
+    return 0;
+}
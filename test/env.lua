@@ -0,0 +1,35 @@
+local cell = require "cell"
+local env = require "env"
+
+-- Every cell unpacks the same config block, a value past SHARED_STRING_SIZE
+-- must read the same in all of them
+local CELLS = 6
+
+local command = {}
+
+function cell.main(parent)
+    local big = env.getconfig("big")
+    if parent then
+        cell.send(parent, "report", big)
+        return
+    end
+    print("main", #big, big:sub(1, 8))
+    local done, n, waiting = cell.event(), 0, false
+    function command.report(got)
+        n = n + 1
+        print("child", #got, got == big)
+        if n == CELLS and waiting then
+            cell.wakeup(done)
+        end
+    end
+    for i = 1, CELLS do
+        cell.newservice("test.env", cell.self)
+    end
+    if n < CELLS then
+        waiting = true
+        cell.wait(done)
+    end
+    print("ENV DONE")
+end
+
+cell.message(command)
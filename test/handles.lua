@@ -0,0 +1,57 @@
+local cell = require "cell"
+local socket = require "socket"
+local udp = require "udp"
+local csocket = require "cell.c.socket"
+
+-- Socket ids are slot | generation << 20, a slot's generation wraps after
+-- 4095 sockets. Cycle udp sockets until one has, a tcp socket open all
+-- along must keep its id to itself.
+local PORT = 8899
+local SLOT_BITS = 20
+local LIMIT = 100000
+
+local function slot(fd)
+    return fd & ((1 << SLOT_BITS) - 1), fd >> SLOT_BITS
+end
+
+function cell.main()
+    socket.listen("127.0.0.1", PORT, function(fd, addr)
+        local s = socket.bind(fd, addr)
+        cell.fork(function()
+            while true do
+                local line = s:readline("\n")
+                if not line then
+                    break
+                end
+                s:write(line .. "\n")
+            end
+        end)
+    end)
+    local c = socket.connect("127.0.0.1", PORT)
+    c:write("before\n")
+    print("echo", c:readline("\n"))
+    local live = csocket.stats().handles
+
+    local last = {}
+    local n, wrapped = 0, nil
+    while n < LIMIT and not wrapped do
+        local u = udp.connect("127.0.0.1", PORT)
+        local fd = u.__fd
+        assert(fd ~= 0 and fd ~= c.__fd, fd)
+        local s, gen = slot(fd)
+        if last[s] and gen <= last[s] then
+            wrapped = {s, last[s], gen}
+        end
+        last[s] = gen
+        u:disconnect()
+        n = n + 1
+    end
+    print("wrapped", wrapped ~= nil, "slot", wrapped and wrapped[1], "generation", wrapped and wrapped[2],
+        "to", wrapped and wrapped[3])
+
+    c:write("after\n")
+    print("echo", c:readline("\n"))
+    cell.sleep(100)
+    print("handles back", csocket.stats().handles == live)
+    print("HANDLES DONE")
+end
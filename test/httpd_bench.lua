@@ -0,0 +1,90 @@
+local cell = require "cell"
+local socket = require "socket"
+local httpd = require "http.httpd"
+local httpc = require "http.httpc"
+local chttp = require "cell.c.http"
+
+-- Requests per second against httpd.serve from CLIENTS connections at
+-- once, each sending REQUESTS requests: a new connection per request, one
+-- kept alive connection, and that one with DEPTH requests pipelined. Then
+-- through httpc without and with its connection pool.
+local PORT = 8892
+local CLIENTS = 16
+local REQUESTS = 500
+local DEPTH = 8
+
+local REQ = "GET /bench HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n"
+local REQ_CLOSE = "GET /bench HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n"
+
+local function handler(url)
+    return 200, "hello " .. url
+end
+
+local function response(c)
+    local code, _, _, header = c:readwith(chttp.response)
+    assert(code == 200, code)
+    return c:readbytes(tonumber(header["content-length"]))
+end
+
+local function client(mode)
+    if mode:find("httpc") then
+        for i = 1, REQUESTS do
+            assert(httpc.get("127.0.0.1:" .. PORT, "/bench") == 200)
+        end
+        return
+    end
+    local c
+    local sent = 0
+    while sent < REQUESTS do
+        c = c or socket.connect("127.0.0.1", PORT)
+        if mode == "close" then
+            c:write(REQ_CLOSE)
+            response(c)
+            c:disconnect()
+            c = nil
+            sent = sent + 1
+        else
+            local n = mode == "pipeline" and DEPTH or 1
+            c:write(string.rep(REQ, n))
+            for i = 1, n do
+                response(c)
+            end
+            sent = sent + n
+        end
+    end
+    if c then
+        c:disconnect()
+    end
+end
+
+local function bench(mode)
+    local done = cell.event()
+    local finished = 0
+    local t0 = cell.time()
+    for i = 1, CLIENTS do
+        cell.fork(function()
+            client(mode)
+            finished = finished + 1
+            if finished == CLIENTS then
+                cell.wakeup(done)
+            end
+        end)
+    end
+    cell.wait(done)
+    local n = CLIENTS * REQUESTS
+    print(string.format("%-11s %d requests, %.0f requests/sec", mode, n, n / (cell.time() - t0)))
+end
+
+function cell.main()
+    socket.listen("127.0.0.1", PORT, function(fd, addr)
+        local s = socket.bind(fd, addr)
+        cell.fork(httpd.serve, s, handler, {timeout = 5000})
+    end)
+    bench("close")
+    bench("keepalive")
+    bench("pipeline")
+    httpc.pool{max_idle = 0}
+    bench("httpc")
+    httpc.pool{max_idle = CLIENTS}
+    bench("httpc pool")
+end
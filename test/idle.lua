@@ -0,0 +1,29 @@
+local cell = require "cell"
+
+-- One worker and nothing else to do, a periodic timeout must keep firing:
+-- nothing but the timer wakes the worker, a wakeup it misses has to be
+-- made up by its own bounded wait.
+local ROUNDS = 500
+local PERIOD = 2
+
+function cell.main()
+    local left = ROUNDS
+    local late = 0
+    local last = cell.time()
+    local done = cell.event()
+    local function tick()
+        local now = cell.time()
+        late = math.max(late, now - last - PERIOD / 1000)
+        last = now
+        left = left - 1
+        if left == 0 then
+            cell.wakeup(done)
+            return
+        end
+        cell.timeout(PERIOD, tick)
+    end
+    cell.timeout(PERIOD, tick)
+    cell.wait(done)
+    print("ticks", ROUNDS, "late ok", late < 0.1, string.format("max late %.1f ms", late * 1000))
+    print("IDLE DONE")
+end
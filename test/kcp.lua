@@ -0,0 +1,50 @@
+local cell = require "cell"
+local socket = require "socket"
+
+local function accepter(fd, addr, listen_fd)
+    print("kcp accept", fd, addr, listen_fd)
+    local s = socket.bind(fd, addr)
+    cell.fork(function()
+        local line = s:readline()
+        while line do
+            s:write("echo " .. line .. "\n")
+            line = s:readline()
+        end
+        print("kcp closed", fd)
+    end)
+end
+
+local function message_accepter(fd, addr)
+    local s = socket.bind(fd, addr)
+    s:framing()
+    cell.fork(function()
+        local msg = s:readframe()
+        while msg do
+            s:write(#msg .. " bytes")
+            msg = s:readframe()
+        end
+    end)
+end
+
+function cell.main()
+    print("[cell main]", cell.self, cell.id, cell.time())
+
+    socket.kcp_listen("127.0.0.1", 8889, accepter)
+    local client = socket.kcp_connect("127.0.0.1", 8889)
+    print("client connect", client)
+    for i = 1, 3 do
+        client:write("hello " .. i .. "\n")
+        print("client read", client:readline())
+    end
+    client:disconnect()
+
+    local opts = {message = true, interval = 20}
+    socket.kcp_listen("127.0.0.1", 8890, message_accepter, opts)
+    local c = socket.kcp_connect("127.0.0.1", 8890, opts)
+    c:framing()
+    c:write("")
+    print("client read", c:readframe())
+    c:write(string.rep("x", 20000))
+    print("client read", c:readframe())
+    c:disconnect()
+end
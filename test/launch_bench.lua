@@ -0,0 +1,30 @@
+local cell = require "cell"
+
+-- Cells launched per second, in bursts with a pause between them (a login
+-- storm). Compare test/config_launch_bench with pool = 0 and pool = 64.
+local ROUND = 20
+local BURST = 64
+local PAUSE = 200
+
+function cell.main(role)
+    if role then
+        return
+    end
+
+    local launched = 0
+    local cost = 0
+    for round = 1, ROUND do
+        local cells = {}
+        local t0 = cell.time()
+        for i = 1, BURST do
+            cells[i] = cell.newservice("test.launch_bench", "child")
+        end
+        cost = cost + cell.time() - t0
+        launched = launched + BURST
+        for i = 1, BURST do
+            cell.kill(cells[i])
+        end
+        cell.sleep(PAUSE)
+    end
+    print(string.format("launched %d cells, %.0f cells/sec", launched, launched / cost))
+end
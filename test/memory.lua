@@ -0,0 +1,48 @@
+local cell = require "cell"
+local socket = require "socket"
+
+-- memory_limit caps user cells only. A cell that runs out fails on its
+-- own, the system and socket cells keep serving everyone else.
+local PORT = 8900
+local LIMIT = 4 * 1024 * 1024
+
+local command = {}
+
+function command.grow()
+    local t = {}
+    local ok, err = pcall(function()
+        for i = 1, math.huge do
+            t[i] = string.rep("x", 1024) .. i
+        end
+    end)
+    t = nil
+    collectgarbage()
+    return ok, err
+end
+
+function cell.main(hog)
+    if hog then
+        return
+    end
+    local _, limit = cell.memory()
+    print("limit", limit == LIMIT)
+    local h = cell.newservice("test.memory", true)
+    print("hog", cell.call(h, "grow"))
+    print("hog again", cell.call(h, "grow"))
+
+    socket.listen("127.0.0.1", PORT, function(fd, addr)
+        local s = socket.bind(fd, addr)
+        cell.fork(function()
+            local line = s:readline("\n")
+            s:write(line .. "\n")
+            s:disconnect()
+        end)
+    end)
+    local c = socket.connect("127.0.0.1", PORT)
+    c:write("echo\n")
+    print("socket", c:readline("\n") == "echo")
+    c:disconnect()
+    print("MEMORY DONE")
+end
+
+cell.command(command)
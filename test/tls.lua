@@ -0,0 +1,129 @@
+local cell = require "cell"
+local socket = require "socket"
+local csocket = require "cell.c.socket"
+local httpd = require "http.httpd"
+local httpc = require "http.httpc"
+local sockethelper = require "http.sockethelper"
+local tlshelper = require "http.tlshelper"
+
+-- tls terminated by the sockets against tls through http.tlshelper, both
+-- echo ROUNDS requests of SIZE bytes over one connection. The echo server
+-- is capped to TLS 1.2 so its sessions resume, the others speak the most
+-- the library does
+local PORT = 8894
+local CERT = "test/tls/cert.pem"
+local KEY = "test/tls/key.pem"
+local ROUNDS = 2000
+local SIZE = 4096
+
+local function echo(fd, addr)
+    local s = socket.bind(fd, addr)
+    cell.fork(function()
+        while true do
+            local data = s:readbytes(SIZE)
+            if not data then
+                break
+            end
+            s:write(data)
+        end
+        s:disconnect()
+    end)
+end
+
+local function lua_echo(fd, addr)
+    local s = socket.bind(fd, addr)
+    cell.fork(function()
+        local ctx = tlshelper.newctx()
+        ctx:set_cert(CERT, KEY)
+        local t = tlshelper.newtls("server", ctx)
+        if pcall(tlshelper.initresponsefunc(s, t)) then
+            local read, write = tlshelper.readfunc(s, t), tlshelper.writefunc(s, t)
+            while pcall(function()
+                write(read(SIZE))
+            end) do
+            end
+        end
+        s:disconnect()
+    end)
+end
+
+local function handshakes()
+    local s = csocket.stats()
+    return string.format("handshakes %d resumed %d failures %d cached %d", s.tls_handshakes, s.tls_resumed,
+        s.tls_failures, s.tls_cached)
+end
+
+local function bench(name, read, write)
+    local payload = string.rep("x", SIZE)
+    local t0 = cell.time()
+    for i = 1, ROUNDS do
+        write(payload)
+        assert(read(SIZE) == payload)
+    end
+    local mb = ROUNDS * SIZE * 2 / 1024 / 1024
+    print(string.format("%-6s %d round trips, %.1f MB/sec", name, ROUNDS, mb / (cell.time() - t0)))
+end
+
+function cell.main()
+    socket.listen("127.0.0.1", PORT, echo, {tls = {cert = CERT, key = KEY, max_version = "1.2"}})
+    socket.listen("127.0.0.1", PORT + 1, lua_echo)
+    socket.listen("127.0.0.1", PORT + 2, function(fd, addr)
+        cell.fork(httpd.serve, socket.bind(fd, addr), function(url)
+            return 200, "tls " .. url
+        end)
+    end, {tls = {cert = CERT, key = KEY}})
+    socket.listen("127.0.0.1", PORT + 3, function(fd, addr)
+        local s = socket.bind(fd, addr)
+        s:write("not tls\r\n")
+        s:disconnect()
+    end)
+    print("bad cert", pcall(socket.listen, "127.0.0.1", PORT + 4, echo, {tls = {cert = "none.pem", key = KEY}}))
+    print("bad version",
+        pcall(socket.listen, "127.0.0.1", PORT + 4, echo, {tls = {cert = CERT, key = KEY, max_version = "1.0"}}))
+    socket.listen("127.0.0.1", PORT + 5, echo, {tls = {cert = CERT, key = KEY}})
+    socket.listen("127.0.0.2", PORT + 6, echo, {tls = {cert = CERT, key = KEY}})
+    local latest = socket.connect("127.0.0.1", PORT + 5, {tls = true})
+    latest:write(string.rep("b", SIZE))
+    print("latest echo", latest:readbytes(SIZE) == string.rep("b", SIZE))
+    latest:disconnect()
+    print("client capped", socket.connect("127.0.0.1", PORT + 5, {tls = {max_version = "1.2"}}) ~= nil)
+
+    local c = socket.connect("127.0.0.1", PORT, {tls = true})
+    c:write(string.rep("a", SIZE))
+    print("echo", c:readbytes(SIZE) == string.rep("a", SIZE))
+    c:disconnect()
+    for i = 1, 3 do
+        socket.connect("127.0.0.1", PORT, {tls = true}):disconnect()
+    end
+    print(handshakes())
+
+    print("unverified", socket.connect("127.0.0.1", PORT, {tls = {verify = true}}))
+    print("plain peer", socket.connect("127.0.0.1", PORT + 3, {tls = true}))
+    local v = socket.connect("localhost", PORT, {tls = {verify = true, cafile = CERT}})
+    print("verified", v ~= nil)
+    v:disconnect()
+    -- the certificate names 127.0.0.1 but not 127.0.0.2
+    v = socket.connect("127.0.0.1", PORT, {tls = {verify = true, cafile = CERT}})
+    print("verified ip", v ~= nil)
+    v:disconnect()
+    print("wrong ip", socket.connect("127.0.0.2", PORT + 6, {tls = {verify = true, cafile = CERT}}))
+
+    print("https", httpc.get("https://127.0.0.1:" .. (PORT + 2), "/a"))
+    print("https", httpc.get("https://localhost:" .. (PORT + 2), "/b"))
+
+    c = socket.connect("127.0.0.1", PORT, {tls = true})
+    bench("native", function(n)
+        return c:readbytes(n)
+    end, function(data)
+        c:write(data)
+    end)
+    c:disconnect()
+
+    local s = socket.connect("127.0.0.1", PORT + 1)
+    local t = tlshelper.newtls("client", tlshelper.newctx())
+    tlshelper.initrequestfunc(s, t)()
+    bench("lua", tlshelper.readfunc(s, t), tlshelper.writefunc(s, t))
+    s:disconnect()
+    print(handshakes())
+    print("TLS DONE")
+end
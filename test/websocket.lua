@@ -0,0 +1,61 @@
+local cell = require "cell"
+local socket = require "socket"
+local websocket = require "http.websocket"
+local cws = require "cell.c.websocket"
+
+local PORT = 8893
+local ROUNDS = 20000
+
+local function accepter(fd, addr)
+    cell.fork(function()
+        local ws = websocket.accept(fd, "ws", addr, {deflate = true})
+        print("websocket accept", addr, "deflate", ws.deflate)
+        while true do
+            local ok, msg = pcall(ws.readmsg, ws)
+            if not ok or not msg then
+                break
+            end
+            ws:writemsg(msg, "binary")
+        end
+    end)
+end
+
+local function key()
+    return math.random(0, 0xffffffff)
+end
+
+function cell.main()
+    print("[cell main]", cell.self, cell.id, cell.time())
+    socket.listen("127.0.0.1", PORT, accepter)
+
+    local url = "ws://127.0.0.1:" .. PORT .. "/echo"
+    local ws = websocket.connect(url)
+    ws:writemsg("hello", "text", key())
+    print("echo", ws:readmsg())
+    local big = string.rep("0123456789abcdef", 5000)
+    ws:writemsg(big, "binary", key())
+    print("echo big", ws:readmsg() == big)
+
+    -- a fragmented message with a ping between its frames
+    ws.interface.write(cws.encode(1, "frag", key(), false) .. cws.encode(9, "ping", key()) ..
+        cws.encode(0, "men", key(), false) .. cws.encode(0, "ted", key()))
+    print("echo fragments", ws:readmsg())
+
+    -- small frames round trip
+    local t0 = cell.time()
+    for i = 1, ROUNDS do
+        ws:writemsg("ping " .. i, "text", key())
+        assert(ws:readmsg() == "ping " .. i)
+    end
+    print(string.format("%d small messages, %.0f messages/sec", ROUNDS, ROUNDS / (cell.time() - t0)))
+    ws:close()
+
+    if cws.deflate then
+        local dws = websocket.connect(url, nil, nil, {deflate = true})
+        print("deflate", dws.deflate)
+        dws:writemsg(big, "text", key())
+        print("echo deflated", dws:readmsg() == big)
+        print("deflated size", #cws.deflate(big), "of", #big)
+        dws:close()
+    end
+end